@@ -0,0 +1,1191 @@
+// Desktop benchmark for the merge engine.
+//
+// Runs every merge mode on synthetic stacks and on the examples/ stacks scaled
+// to the requested resolutions, and reports wall time, per-stage time and peak RSS.
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <string>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include "opencv2/imgcodecs.hpp"
+#include "opencv2/imgproc.hpp"
+#include "opencv2/photo.hpp"
+#include "../engine/align.h"
+#include "../engine/borders.h"
+#include "../engine/common.h"
+#include "../engine/focusstack.h"
+#include "../engine/hdr.h"
+#include "../engine/imageio.h"
+#include "../engine/incrementalpanorama.h"
+#include "../engine/job.h"
+#include "../engine/longexposure.h"
+#include "../engine/panorama.h"
+#include "../engine/profile.h"
+#include "../engine/registration.h"
+#include "../engine/warpmaps.h"
+
+
+using namespace cv;
+
+
+struct BenchMode {
+    const char* name;
+    const char* examplesFolder;
+    bool panorama;
+    std::function<bool (const std::vector<Mat>&, Mat&)> run;
+};
+
+
+struct Options {
+    std::string examples = "examples";
+    std::vector<double> megaPixels = {12, 24, 48};
+    std::vector<std::string> modes;
+    std::vector<std::string> sources = {"synthetic", "examples"};
+    int frames = 3;
+    int repeat = 1;
+    bool verify = false;
+};
+
+
+static
+std::vector<std::string> split(const std::string& value) {
+    std::vector<std::string> items;
+    size_t start = 0;
+    while (start <= value.size()) {
+        size_t end = value.find(',', start);
+        if (std::string::npos == end) end = value.size();
+        if (end > start) items.push_back(value.substr(start, end - start));
+        start = end + 1;
+    }
+    return items;
+}
+
+
+static
+bool contains(const std::vector<std::string>& items, const std::string& item) {
+    if (items.empty()) return true;
+    for (const auto& it: items)
+        if (it == item) return true;
+    return false;
+}
+
+
+// Resets the peak RSS counter (Linux >= 4.0), so each run reports its own peak
+static
+void resetPeakRss() {
+    std::ofstream clearRefs("/proc/self/clear_refs");
+    if (clearRefs) clearRefs << "5";
+}
+
+
+static
+long readStatusKb(const char* key) {
+    std::ifstream status("/proc/self/status");
+    std::string line;
+    size_t keyLength = strlen(key);
+
+    while (std::getline(status, line)) {
+        if (0 == line.compare(0, keyLength, key))
+            return atol(line.c_str() + keyLength);
+    }
+
+    return -1;
+}
+
+
+static
+double peakRssMb() {
+    long kb = readStatusKb("VmHWM:");
+    if (kb < 0) {
+        struct rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+        kb = usage.ru_maxrss;
+    }
+    return kb / 1024.0;
+}
+
+
+static
+Size sizeForMegaPixels(const Size& aspect, double megaPixels) {
+    double scale = std::sqrt(megaPixels * 1e6 / aspect.area());
+    return Size(cvRound(aspect.width * scale), cvRound(aspect.height * scale));
+}
+
+
+// Textured scene: smoothed noise plus a few shapes, so feature detectors find something
+static
+Mat makeSyntheticScene(const Size& size, int seed) {
+    RNG rng(seed);
+    Size smallSize(std::max(16, size.width / 16), std::max(16, size.height / 16));
+    Mat noise(smallSize, CV_8UC3);
+    rng.fill(noise, RNG::UNIFORM, Scalar::all(0), Scalar::all(256));
+
+    Mat scene;
+    resize(noise, scene, size, 0.0, 0.0, INTER_CUBIC);
+
+    int shapes = 64;
+    for (int i = 0; i < shapes; i++) {
+        Point center(rng.uniform(0, size.width), rng.uniform(0, size.height));
+        int radius = rng.uniform(size.width / 80 + 1, size.width / 20 + 2);
+        Scalar color(rng.uniform(0, 256), rng.uniform(0, 256), rng.uniform(0, 256));
+        if (i & 1)
+            circle(scene, center, radius, color, -1, LINE_AA);
+        else
+            rectangle(scene, Rect(center.x, center.y, radius, radius), color, -1);
+    }
+
+    return scene;
+}
+
+
+static
+std::vector<Mat> makeSyntheticStack(const Size& size, int frames, bool panorama) {
+    std::vector<Mat> images;
+
+    if (panorama) {
+        // Overlapping crops (40% overlap) of a wider scene
+        int step = size.width * 6 / 10;
+        Mat scene = makeSyntheticScene(Size(size.width + step * (frames - 1), size.height), 1);
+        for (int i = 0; i < frames; i++)
+            images.push_back(scene(Rect(i * step, 0, size.width, size.height)).clone());
+        return images;
+    }
+
+    // Same scene with small shifts and some noise, like a hand held burst
+    Mat scene = makeSyntheticScene(size, 1);
+    RNG rng(2);
+    for (int i = 0; i < frames; i++) {
+        Mat t = (Mat_<double>(2, 3) << 1, 0, rng.uniform(-8, 8), 0, 1, rng.uniform(-8, 8));
+        Mat frame, frameNoise(size, CV_8UC3);
+        warpAffine(scene, frame, t, size, INTER_LINEAR, BORDER_REFLECT);
+        rng.fill(frameNoise, RNG::NORMAL, Scalar::all(0), Scalar::all(6));
+        add(frame, frameNoise, frame);
+        images.push_back(frame);
+    }
+
+    return images;
+}
+
+
+static
+std::vector<Mat> loadExampleStack(const std::string& folder, double megaPixels) {
+    std::vector<Mat> images;
+
+    for (int i = 1; ; i++) {
+        Mat image = imread(folder + "/" + std::to_string(i) + ".jpg", IMREAD_COLOR);
+        if (image.empty()) break;
+
+        cvtColor(image, image, COLOR_BGR2RGB);
+        Size size = sizeForMegaPixels(image.size(), megaPixels);
+        Mat scaled;
+        resize(image, scaled, size, 0.0, 0.0, size.area() > image.size().area() ? INTER_CUBIC : INTER_AREA);
+        images.push_back(scaled);
+    }
+
+    return images;
+}
+
+
+// Aligned the same way the app does: the first frame is the reference, the others get a small rotation
+static
+std::vector<Ptr<FrameSource>> frameSources(const std::vector<Mat>& images) {
+    std::vector<Ptr<FrameSource>> frames;
+    for (size_t i = 0; i < images.size(); i++) {
+        Mat transform;
+        if (i > 0)
+            transform = getRotationMatrix2D(Point2f(images[i].cols / 2.0f, images[i].rows / 2.0f), 0.2 * i, 1.0);
+        frames.push_back(makePtr<MatFrameSource>(images[i], transform));
+    }
+    return frames;
+}
+
+
+static
+bool runOne(const BenchMode& mode, const std::string& source, double megaPixels, const std::vector<Mat>& images, int repeat) {
+    StageRecorder recorder;
+    StageRecorder::setCurrent(&recorder);
+
+    bool success = true;
+    double totalMs = 0.0;
+    Mat output;
+
+    double inputMb = 0;
+    for (const auto& image: images)
+        inputMb += image.total() * image.elemSize() / (1024.0 * 1024.0);
+
+    resetPeakRss();
+    double startRssMb = readStatusKb("VmRSS:") / 1024.0;
+
+    for (int i = 0; i < repeat && success; i++) {
+        output.release();
+        int64 start = getTickCount();
+        success = mode.run(images, output) && !output.empty();
+        totalMs += (double)(getTickCount() - start) * 1000.0 / getTickFrequency();
+    }
+
+    double peakMb = peakRssMb();
+    StageRecorder::setCurrent(nullptr);
+
+    printf("%-14s %-10s %5.1f MP %2d frames  %s  wall %9.1f ms  peak RSS %8.1f MB (start %8.1f MB, inputs %7.1f MB)\n",
+           mode.name, source.c_str(), megaPixels, (int)images.size(),
+           success ? "ok    " : "FAILED",
+           totalMs / repeat, peakMb, startRssMb, inputMb);
+
+    for (const auto& stage: recorder.stages())
+        printf("    %-20s %9.1f ms\n", stage.name.c_str(), stage.ms / repeat);
+
+    fflush(stdout);
+    return success;
+}
+
+
+static
+bool verifyNearest() {
+    bool success = true;
+
+    // odd widths to exercise the scalar tail after the vector loop
+    for (int width: {1, 15, 16, 17, 63, 1021}) {
+        RNG rng(width);
+        std::vector<Mat> images;
+        for (int i = 0; i < 5; i++) {
+            Mat noise(Size(width, 37), CV_8UC3);
+            rng.fill(noise, RNG::UNIFORM, Scalar::all(0), Scalar::all(256));
+            images.push_back(noise);
+        }
+        images[3] = images[1].clone(); // ties
+
+        Mat average, simd, scalar, reference;
+        makeLongExposureAverage(images, average);
+        makeLongExposureNearest(images, average, simd, nullptr, true);
+        makeLongExposureNearest(images, average, scalar, nullptr, false);
+        makeLongExposureNearestReference(images, average, reference);
+
+        Mat diff;
+        absdiff(simd, scalar, diff);
+        bool exact = 0 == countNonZero(diff.reshape(1));
+        absdiff(scalar, reference, diff);
+        int referenceDiffs = countNonZero(diff.reshape(1));
+
+        printf("verify nearest width %4d: simd vs scalar %s, scalar vs sqrt reference: %d values differ (truncated sqrt ties)\n",
+               width, exact ? "bit exact" : "MISMATCH", referenceDiffs);
+        success = exact && success;
+    }
+
+    return success;
+}
+
+
+// Light / Dark: simd must match scalar, the kept pixel must be the lightest / darkest (luma) of the stack,
+// and the banded running best must match the whole stack
+static
+bool verifyLightDark() {
+    bool success = true;
+
+    for (int width: {1, 15, 16, 17, 63, 1021}) {
+        RNG rng(width + 100);
+        std::vector<Mat> images;
+        for (int i = 0; i < 5; i++) {
+            Mat noise(Size(width, 37), CV_8UC3);
+            rng.fill(noise, RNG::UNIFORM, Scalar::all(0), Scalar::all(256));
+            images.push_back(noise);
+        }
+        images[3] = images[1].clone(); // ties
+
+        // same luma as the kernel, in float: up to 65280, it would saturate in 8 bits
+        auto luma = [](const Mat& image) {
+            Mat image32F, result;
+            image.convertTo(image32F, CV_32F);
+            transform(image32F, result, Matx13f(77, 150, 29));
+            return result;
+        };
+
+        std::vector<Mat> lumas(images.size());
+        for (size_t i = 0; i < images.size(); i++)
+            lumas[i] = luma(images[i]);
+
+        std::vector<Ptr<FrameSource>> frames;
+        for (const auto& image: images)
+            frames.push_back(makePtr<MatFrameSource>(image));
+
+        for (bool light: {true, false}) {
+            Mat simd, scalar, banded, diff;
+            makeLongExposureLightOrDark(images, simd, light, nullptr, true);
+            makeLongExposureLightOrDark(images, scalar, light, nullptr, false);
+            makeLongExposureBanded(frames, light ? LONG_EXPOSURE_LIGHT : LONG_EXPOSURE_DARK, banded, 8);
+
+            absdiff(simd, scalar, diff);
+            bool exact = 0 == countNonZero(diff.reshape(1));
+            absdiff(banded, scalar, diff);
+            bool bandedExact = 0 == countNonZero(diff.reshape(1));
+
+            const Mat outputLuma = luma(scalar);
+            int wrong = 0;
+            for (const auto& other: lumas) {
+                Mat bad;
+                compare(outputLuma, other, bad, light ? CMP_LT : CMP_GT);
+                wrong += countNonZero(bad);
+            }
+
+            printf("verify %s width %4d: simd vs scalar %s, banded %s, %d pixels not the %s\n",
+                   light ? "light" : "dark ", width, exact ? "bit exact" : "MISMATCH",
+                   bandedExact ? "bit exact" : "MISMATCH", wrong, light ? "lightest" : "darkest");
+            success = exact && bandedExact && 0 == wrong && success;
+        }
+    }
+
+    return success;
+}
+
+
+// Removing a frame from the accumulator must give the same result as never adding it
+static
+bool verifyAccumulator() {
+    RNG rng(5);
+    std::vector<Mat> images;
+    for (int i = 0; i < 6; i++) {
+        Mat image(Size(1021, 37), CV_8UC3);
+        rng.fill(image, RNG::UNIFORM, Scalar::all(0), Scalar::all(256));
+        images.push_back(image);
+    }
+
+    LongExposureAccumulator accumulator;
+    for (const auto& image: images)
+        accumulator.add(image);
+    accumulator.remove(images[2]);
+
+    std::vector<Mat> expectedImages = images;
+    expectedImages.erase(expectedImages.begin() + 2);
+
+    Mat result, expected, diff;
+    accumulator.result(result);
+    makeLongExposureAverage(expectedImages, expected);
+    absdiff(result, expected, diff);
+
+    bool exact = 0 == countNonZero(diff.reshape(1));
+    printf("verify accumulator remove: %s\n", exact ? "bit exact" : "MISMATCH");
+    return exact;
+}
+
+
+// Frames spilled to raw files must merge like the in-memory frames, and the spill must drop each image it read
+static
+bool verifySpill() {
+    const char* tmp = std::getenv("TMPDIR");
+    const std::string directory = tmp ? tmp : "/tmp";
+
+    std::vector<Mat> images = makeSyntheticStack(Size(640, 480), 5, false);
+    std::vector<Ptr<FrameSource>> inMemory = frameSources(images);
+    std::vector<Mat> transforms;
+    for (size_t i = 0; i < images.size(); i++) {
+        transforms.push_back(0 == i ? Mat()
+                             : getRotationMatrix2D(Point2f(images[i].cols / 2.0f, images[i].rows / 2.0f), 0.2 * i, 1.0));
+    }
+
+    std::vector<Mat> spilledImages;
+    for (const auto& image: images)
+        spilledImages.push_back(image.clone());
+
+    std::vector<Ptr<FrameSource>> spilled;
+    bool success = spillFrames((int)spilledImages.size(), [&spilledImages](int index, Mat& image) {
+        image = spilledImages[index];
+        spilledImages[index].release();
+        return !image.empty();
+    }, transforms, directory, spilled);
+
+    for (const auto& image: spilledImages)
+        success = success && image.empty();
+
+    for (int mode: {LONG_EXPOSURE_AVERAGE, LONG_EXPOSURE_NEAREST_TO_AVERAGE, LONG_EXPOSURE_LIGHT}) {
+        Mat expected, result, diff;
+        success = success && makeLongExposureBanded(inMemory, mode, expected, 64)
+                  && makeLongExposureBanded(spilled, mode, result, 64);
+        if (success) {
+            absdiff(result, expected, diff);
+            success = 0 == countNonZero(diff.reshape(1));
+        }
+    }
+
+    printf("verify spilled frames: %s\n", success ? "bit exact" : "MISMATCH");
+    return success;
+}
+
+
+// The tiles must blend like the full canvas: no seams at the tile edges, whatever the tile size
+static
+bool verifyTiles() {
+    PanoramaSession session(makeSyntheticStack(Size(1200, 900), 4, true));
+
+    CompositorOptions single;
+    single.tileSize = 1 << 20;
+    Mat expected;
+    bool success = session.composeTiled(PANORAMA_SPHERICAL, PANORAMA_QUALITY_BEST, expected, single);
+
+    double maxDiff = 0;
+    for (int tileSize: {PANORAMA_TILE_SIZE, 300}) {
+        CompositorOptions tiled;
+        tiled.tileSize = tileSize;
+        Mat result, diff;
+        success = success && session.composeTiled(PANORAMA_SPHERICAL, PANORAMA_QUALITY_BEST, result, tiled)
+                  && result.size() == expected.size();
+        if (!success) break;
+
+        double tileMaxDiff = 0;
+        absdiff(result, expected, diff);
+        minMaxLoc(diff.reshape(1), nullptr, &tileMaxDiff);
+        maxDiff = std::max(maxDiff, tileMaxDiff);
+    }
+
+    success = success && maxDiff <= 3;
+    printf("verify tiles: max diff %.0f %s\n", maxDiff, success ? "ok" : "MISMATCH");
+    return success;
+}
+
+
+// The cached fixed point maps must warp like the stitching warper and match the uncached ones; another part
+// of the same image (other tile, other margin) must hit the cached blocks; and a cache smaller than a compose
+// must still hit on the next compose
+static
+bool verifyWarpMaps() {
+    Mat image = makeSyntheticScene(Size(800, 600), 3);
+    Mat K = (Mat_<float>(3, 3) << 700, 0, 400, 0, 700, 300, 0, 0, 1);
+    const float c = std::cos(0.3f), s = std::sin(0.3f);
+    Mat R = (Mat_<float>(3, 3) << c, 0, s, 0, 1, 0, -s, 0, c);
+
+    detail::SphericalWarper warper(700.0f);
+    Mat expected;
+    const Point corner = warper.warp(image, K, R, INTER_LINEAR, BORDER_REFLECT, expected);
+    const Rect roi(corner, expected.size());
+
+    WarpMapCache cache;
+    WarpMaps maps, uncached, part;
+    bool success = cache.maps(PANORAMA_SPHERICAL, K, R, 700.0f, image.size(), roi, maps)
+                   && panoramaWarpMaps(PANORAMA_SPHERICAL, K, R, 700.0f, image.size(), roi, uncached)
+                   && !maps.map1.empty();
+    const int misses = cache.stats().misses;
+
+    bool exact = false;
+    if (success) {
+        Mat diff1, diff2, diffMask;
+        absdiff(maps.map1, uncached.map1, diff1);
+        absdiff(maps.map2, uncached.map2, diff2);
+        absdiff(maps.mask, uncached.mask, diffMask);
+        exact = 0 == countNonZero(diff1.reshape(1)) && 0 == countNonZero(diff2) && 0 == countNonZero(diffMask);
+    }
+
+    const Rect inner(roi.x + 37, roi.y + 51, roi.width / 2, roi.height / 2);
+    success = success && cache.maps(PANORAMA_SPHERICAL, K, R, 700.0f, image.size(), inner, part);
+    const bool hit = success && misses == cache.stats().misses && cache.stats().hits > 0;
+
+    double meanDiff = 1e9;
+    if (success) {
+        Mat warped, diff;
+        remap(image, warped, maps.map1, maps.map2, INTER_LINEAR, BORDER_REFLECT);
+        absdiff(warped, expected, diff);
+        const Scalar channels = mean(diff, maps.mask);
+        meanDiff = (channels[0] + channels[1] + channels[2]) / 3.0;
+    }
+
+    // about a third of the blocks fit: the second compose must reuse them instead of evicting them in order
+    WarpMapCache small(1);
+    small.beginCompose();
+    for (int y = roi.y; y < roi.br().y; y += 100)
+        success = small.maps(PANORAMA_SPHERICAL, K, R, 700.0f, image.size(), Rect(roi.x, y, roi.width, 100), part) && success;
+    const int firstMisses = small.stats().misses;
+    small.beginCompose();
+    for (int y = roi.y; y < roi.br().y; y += 100)
+        success = small.maps(PANORAMA_SPHERICAL, K, R, 700.0f, image.size(), Rect(roi.x, y, roi.width, 100), part) && success;
+    const int secondHits = small.stats().hits;
+    const bool scanResistant = success && secondHits > 0 && small.stats().bytes <= 1024 * 1024;
+
+    // the fixed point maps are 1/32 pixel precise
+    const bool close = meanDiff < 1.0;
+    printf("verify warp maps: mean diff %.3f %s, blocks vs uncached %s, cache %s, small cache %d / %d blocks hit %s\n",
+           meanDiff, close ? "ok" : "MISMATCH", exact ? "bit exact" : "MISMATCH", hit ? "ok" : "FAILED",
+           secondHits, firstMisses, scanResistant ? "ok" : "FAILED");
+    return close && exact && hit && scanResistant;
+}
+
+
+// The fixed point fusion must give about the same image as cv::MergeMertens
+static
+bool verifyHdr() {
+    Mat scene = makeSyntheticScene(Size(640, 480), 6);
+    std::vector<Mat> images;
+    for (double exposure: {0.4, 1.0, 2.2}) {
+        Mat image;
+        scene.convertTo(image, CV_8U, exposure);
+        images.push_back(image);
+    }
+
+    Mat output, fused, expected, diff;
+    bool success = makeHdr(images, output, false);
+    createMergeMertens()->process(images, fused);
+    fused.convertTo(expected, CV_8U, 255.0);
+
+    // the fixed point pyramids must not drift from the float ones anywhere (banding in smooth gradients)
+    double meanDiff = 1e9, maxDiff = 1e9;
+    if (success && output.size() == expected.size()) {
+        absdiff(output, expected, diff);
+        meanDiff = mean(diff.reshape(1))[0];
+        minMaxLoc(diff.reshape(1), nullptr, &maxDiff);
+    }
+
+    const bool close = maxDiff <= 3;
+    printf("verify hdr: mean diff %.3f, max diff %.0f %s\n", meanDiff, maxDiff, close ? "ok" : "MISMATCH");
+    return close;
+}
+
+
+// The alignment stage of the merge jobs must give the same frames as the separate calls, and stop when cancelled
+static
+bool verifyAlignStage() {
+    std::vector<Mat> images = makeSyntheticStack(Size(640, 480), 4, false);
+
+    std::vector<Mat> transforms, alignedImages, stageTransforms, stageImages, warpedImages;
+    bool success = alignImages(images, Mat(), transforms, alignedImages)
+                   && alignForMerge(images, Mat(), Mat(), Mat(), {}, false, stageTransforms, &stageImages)
+                   && stageImages.size() == alignedImages.size();
+    for (size_t i = 0; success && i < alignedImages.size(); i++)
+        success = alignedImages[i].empty() == stageImages[i].empty()
+                  && (alignedImages[i].empty() || 0 == norm(alignedImages[i], stageImages[i], NORM_INF));
+
+    // known transforms: only warped
+    success = success && alignForMerge(images, Mat(), Mat(), Mat(), {}, false, transforms, &warpedImages)
+              && !warpedImages.back().empty() && 0 == norm(warpedImages.back(), alignedImages.back(), NORM_INF);
+
+    JobControl control;
+    control.cancel();
+    std::vector<Mat> cancelledTransforms;
+    const bool cancelled = !alignForMerge(images, Mat(), Mat(), Mat(), {}, false, cancelledTransforms, nullptr, &control);
+
+    printf("verify align stage: %s\n", success && cancelled ? "ok" : "MISMATCH");
+    return success && cancelled;
+}
+
+
+// An object that moved in one exposure must (mostly) disappear from the fused image
+static
+bool verifyDeghost() {
+    Mat scene = makeSyntheticScene(Size(640, 480), 7);
+    std::vector<Mat> images, ghostImages;
+    for (double exposure: {0.5, 1.0, 1.8}) {
+        Mat image;
+        scene.convertTo(image, CV_8U, exposure);
+        images.push_back(image);
+        ghostImages.push_back(image.clone());
+    }
+    const Rect object(200, 150, 120, 100);
+    ghostImages[0](object).setTo(Scalar(20, 110, 60));
+
+    Mat expected, ghost, deghosted;
+    bool success = makeHdr(images, expected, false) && makeHdr(ghostImages, ghost, false)
+                   && makeHdr(ghostImages, deghosted, true);
+
+    double ghostDiff = 0.0, deghostedDiff = 1e9;
+    if (success) {
+        Mat diff;
+        absdiff(ghost(object), expected(object), diff);
+        ghostDiff = mean(diff.reshape(1))[0];
+        absdiff(deghosted(object), expected(object), diff);
+        deghostedDiff = mean(diff.reshape(1))[0];
+    }
+
+    const bool better = deghostedDiff < 0.5 * ghostDiff;
+    printf("verify hdr deghost: object diff %.2f -> %.2f %s\n", ghostDiff, deghostedDiff, better ? "ok" : "FAILED");
+    return better;
+}
+
+
+// The histogram stack search must find the area of the brute force search, and the crop must stay valid
+static
+bool verifyLargestRect() {
+    RNG rng(11);
+    bool success = true;
+
+    for (int test = 0; test < 50 && success; test++) {
+        Mat mask(Size(rng.uniform(1, 40), rng.uniform(1, 30)), CV_8U);
+        rng.fill(mask, RNG::UNIFORM, Scalar::all(0), Scalar::all(100));
+        compare(mask, test % 10 + 5, mask, CMP_LT);   // a few mask pixels, more and more
+
+        int bestArea = 0;
+        for (int y0 = 0; y0 < mask.rows; y0++)
+            for (int x0 = 0; x0 < mask.cols; x0++)
+                for (int y1 = y0 + 1; y1 <= mask.rows; y1++)
+                    for (int x1 = x0 + 1; x1 <= mask.cols; x1++)
+                        if ((x1 - x0) * (y1 - y0) > bestArea && 0 == countNonZero(mask(Rect(x0, y0, x1 - x0, y1 - y0))))
+                            bestArea = (x1 - x0) * (y1 - y0);
+
+        const Rect rect = largestValidRect(mask);
+        success = rect.area() == bestArea && (rect.empty() || 0 == countNonZero(mask(rect)));
+    }
+
+    // a lone mask pixel of a very wide panorama (downscaled ~23x for the search) must still be avoided
+    Mat mask = Mat::zeros(Size(24000, 200), CV_8U);
+    mask.rowRange(0, 10).setTo(255);
+    mask.colRange(0, 50).setTo(255);
+    mask.at<uchar>(100, 12000) = 255;
+    Mat image(mask.size(), CV_8UC3, Scalar::all(128));
+    bool cropped = cropBorders(image, mask) && image.size() != mask.size() && !image.empty();
+    if (cropped) {
+        Size wholeSize;
+        Point offset;
+        image.locateROI(wholeSize, offset);
+        cropped = 0 == countNonZero(mask(Rect(offset, image.size())));
+    }
+
+    printf("verify largest rectangle: %s, wide crop %s\n", success ? "ok" : "MISMATCH", cropped ? "ok" : "FAILED");
+    return success && cropped;
+}
+
+
+// A cancelled job must stop, a finished one must give its output
+static
+bool verifyJobs() {
+    RNG rng(9);
+    std::vector<Mat> images;
+    for (int i = 0; i < 4; i++) {
+        Mat image(Size(640, 480), CV_8UC3);
+        rng.fill(image, RNG::UNIFORM, Scalar::all(0), Scalar::all(256));
+        images.push_back(image);
+    }
+
+    auto blocked = MergeJob::start([](JobControl* control, Mat& output) {
+        while (!isCancelled(control))
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        output.create(1, 1, CV_8UC3);
+        return true;
+    });
+    blocked->cancel();
+    blocked->wait();
+    bool cancelled = MergeJob::CANCELLED == blocked->state();
+
+    auto job = MergeJob::start([images](JobControl* control, Mat& output) {
+        return makeLongExposureLightOrDark(images, output, true, control);
+    });
+    job->wait();
+    Mat result, expected, diff;
+    bool done = job->result(result) && 1.0f == job->progress();
+    makeLongExposureLightOrDark(images, expected, true);
+    done = done && result.size() == expected.size();
+    if (done) {
+        absdiff(result, expected, diff);
+        done = 0 == countNonZero(diff.reshape(1));
+    }
+
+    // a job with several outputs gives them all (empty ones too), and fails without any
+    auto list = MergeJob::start([images](JobControl*, std::vector<Mat>& outputs) {
+        outputs = { images[0], Mat(), images[2] };
+        return true;
+    });
+    auto none = MergeJob::start([](JobControl*, std::vector<Mat>& outputs) {
+        outputs.clear();
+        return true;
+    });
+    list->wait();
+    none->wait();
+    std::vector<Mat> results;
+    bool outputs = list->results(results) && 3 == results.size() && results[1].empty()
+                   && results[2].data == images[2].data && MergeJob::FAILED == none->state();
+
+    // the merges give up right away when the control is already cancelled
+    JobControl control;
+    control.cancel();
+    Mat output;
+    bool stopped = !makeLongExposureLightOrDark(images, output, false, &control)
+                   && !makeFocusStack(images, output, FOCUS_STACK_PYRAMID, &control)
+                   && !makeFocusStack(images, output, FOCUS_STACK_SHARPEST, &control);
+
+    printf("verify jobs: cancel %s, result %s, outputs %s, pre-cancelled merges %s\n",
+           cancelled ? "ok" : "FAILED", done ? "ok" : "FAILED", outputs ? "ok" : "FAILED", stopped ? "ok" : "FAILED");
+    return cancelled && done && outputs && stopped;
+}
+
+
+// Preview jobs coalesce, full jobs preempt the preview (that runs again after)
+static
+bool verifyScheduler() {
+    std::atomic<int> previewRuns{0};
+    auto waitCancel = [&previewRuns](JobControl* control, Mat& output) {
+        previewRuns++;
+        while (!isCancelled(control))
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        output.create(1, 1, CV_8UC3);
+        return true;
+    };
+    auto waitRuns = [&previewRuns](int runs) {
+        for (int i = 0; i < 1000 && previewRuns < runs; i++)
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        return previewRuns >= runs;
+    };
+
+    auto preview = MergeJob::start(waitCancel, MergeJob::PREVIEW);
+    bool preempted = waitRuns(1);
+
+    const int64 start = getTickCount();
+    std::atomic<double> fullQueuedMs{-1.0};
+    auto full = MergeJob::start([start, &fullQueuedMs](JobControl*, Mat& output) {
+        fullQueuedMs = (double)(getTickCount() - start) * 1000.0 / getTickFrequency();
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        output.create(1, 1, CV_8UC3);
+        return true;
+    }, MergeJob::FULL);
+    full->wait();
+    preempted = preempted && MergeJob::DONE == full->state() && waitRuns(2) && MergeJob::RUNNING == preview->state();
+
+    // a newer preview replaces the running one and the queued one
+    auto newer = MergeJob::start(waitCancel, MergeJob::PREVIEW);
+    auto newest = MergeJob::start(waitCancel, MergeJob::PREVIEW);
+    preview->wait();
+    newer->wait();
+    bool coalesced = MergeJob::CANCELLED == preview->state() && MergeJob::CANCELLED == newer->state() && waitRuns(3);
+    newest->cancel();
+    newest->wait();
+    coalesced = coalesced && MergeJob::CANCELLED == newest->state();
+
+    printf("verify scheduler: preempt %s (full job queued %.1f ms), coalesce %s\n",
+           preempted ? "ok" : "FAILED", fullQueuedMs.load(), coalesced ? "ok" : "FAILED");
+    return preempted && coalesced;
+}
+
+
+// Panorama border fill against cv::inpaint: wall time, peak RSS and, on the synthetic panorama where
+// the pixels under the borders are known, the mean error of the filled pixels
+static
+bool benchBorderFill(const Options& options, double megaPixels) {
+    struct Input {
+        const char* source;
+        Mat image, mask, truth;
+    };
+    std::vector<Input> inputs;
+
+    if (contains(options.sources, "synthetic")) {
+        Input input = { "synthetic" };
+        const Size size = sizeForMegaPixels(Size(2, 1), megaPixels);
+        input.truth = makeSyntheticScene(size, 4);
+        // warped panorama outline: the corners are pulled in by different amounts
+        std::vector<Point> outline = {
+            Point(size.width * 5 / 100, size.height * 12 / 100), Point(size.width * 95 / 100, size.height * 3 / 100),
+            Point(size.width * 97 / 100, size.height * 90 / 100), Point(size.width * 2 / 100, size.height * 96 / 100) };
+        input.mask = Mat(size, CV_8U, Scalar::all(255));
+        fillConvexPoly(input.mask, outline, Scalar::all(0));
+        input.image = input.truth.clone();
+        input.image.setTo(Scalar::all(0), input.mask);
+        inputs.push_back(input);
+    }
+
+    if (contains(options.sources, "examples")) {
+        const std::string folder = options.examples + "/inpaint";
+        Mat image = imread(folder + "/panorama.jpg", IMREAD_COLOR);
+        Mat mask = imread(folder + "/mask.jpg", IMREAD_GRAYSCALE);
+        if (image.empty() || mask.size() != image.size()) {
+            printf("%-14s %-10s: no panorama / mask found in %s\n", "border-fill", "examples", folder.c_str());
+        } else {
+            Input input = { "examples" };
+            const Size size = sizeForMegaPixels(image.size(), megaPixels);
+            cvtColor(image, image, COLOR_BGR2RGB);
+            resize(image, input.image, size, 0.0, 0.0, size.area() > image.size().area() ? INTER_CUBIC : INTER_AREA);
+            resize(mask, input.mask, size, 0.0, 0.0, INTER_NEAREST);
+            compare(input.mask, 127, input.mask, CMP_GT);
+            inputs.push_back(input);
+        }
+    }
+
+    const std::vector<std::pair<const char*, std::function<bool (Mat&, const Mat&)>>> methods = {
+        { "border-fill", [](Mat& image, const Mat& mask) { return fillBorders(image, mask); }},
+        { "inpaint-ns", [](Mat& image, const Mat& mask) { inpaint(image.clone(), mask, image, 3.0, INPAINT_NS); return true; }},
+        { "inpaint-telea", [](Mat& image, const Mat& mask) { inpaint(image.clone(), mask, image, 3.0, INPAINT_TELEA); return true; }},
+        { "border-crop", [](Mat& image, const Mat& mask) { return cropBorders(image, mask); }},
+    };
+
+    bool success = true;
+    for (const auto& input: inputs) {
+        for (const auto& method: methods) {
+            StageRecorder recorder;
+            StageRecorder::setCurrent(&recorder);
+            Mat output = input.image.clone();
+
+            resetPeakRss();
+            int64 start = getTickCount();
+            bool ok = method.second(output, input.mask);
+            double ms = (double)(getTickCount() - start) * 1000.0 / getTickFrequency();
+            double peakMb = peakRssMb();
+            StageRecorder::setCurrent(nullptr);
+
+            std::string error = "-";
+            if (ok && !input.truth.empty() && output.size() == input.truth.size()) {
+                Mat diff;
+                absdiff(output, input.truth, diff);
+                const Scalar channels = mean(diff, input.mask);
+                error = format("%.1f", (channels[0] + channels[1] + channels[2]) / 3.0);
+            }
+
+            printf("%-14s %-10s %5.1f MP  %s  wall %9.1f ms  peak RSS %8.1f MB  fill error %s\n",
+                   method.first, input.source, megaPixels, ok ? "ok    " : "FAILED", ms, peakMb, error.c_str());
+            for (const auto& stage: recorder.stages())
+                printf("    %-20s %9.1f ms\n", stage.name.c_str(), stage.ms);
+            fflush(stdout);
+            success = ok && success;
+        }
+    }
+
+    return success;
+}
+
+
+// Loading a burst: one file at a time (what the app did, minus the RGBA bitmap) against readImages,
+// and the previews from the reduced decode. The stack is saved as JPEG files first, so all read the same files.
+static
+bool benchDecode(const Options& options, double megaPixels) {
+    const char* tmp = std::getenv("TMPDIR");
+    const std::string directory = tmp ? tmp : "/tmp";
+    bool success = true;
+
+    for (const char* source: {"synthetic", "examples"}) {
+        if (!contains(options.sources, source)) continue;
+
+        std::vector<Mat> images = 0 == strcmp("synthetic", source)
+            ? makeSyntheticStack(sizeForMegaPixels(Size(4, 3), megaPixels), std::max(options.frames, 10), false)
+            : loadExampleStack(options.examples + "/longexposure", megaPixels);
+        if (images.empty()) {
+            printf("%-14s %-10s: no images found in %s/longexposure\n", "decode", source, options.examples.c_str());
+            continue;
+        }
+
+        std::vector<std::string> paths;
+        std::vector<int> fds;
+        for (size_t i = 0; i < images.size(); i++) {
+            Mat bgr;
+            cvtColor(images[i], bgr, COLOR_RGB2BGR);
+            paths.push_back(directory + "/mergephotos-bench-" + std::to_string(i) + ".jpg");
+            imwrite(paths.back(), bgr, { IMWRITE_JPEG_QUALITY, 95 });
+            fds.push_back(open(paths.back().c_str(), O_RDONLY));
+        }
+
+        std::vector<Mat> serial, parallel;
+        int64 start = getTickCount();
+        for (const auto& path: paths) {
+            Mat image = imread(path, IMREAD_COLOR | IMREAD_IGNORE_ORIENTATION);
+            if (!image.empty()) cvtColor(image, image, COLOR_BGR2RGB);
+            serial.push_back(image);
+        }
+        const double serialMs = (double)(getTickCount() - start) * 1000.0 / getTickFrequency();
+
+        start = getTickCount();
+        bool ok = readImages(fds, parallel);
+        const double parallelMs = (double)(getTickCount() - start) * 1000.0 / getTickFrequency();
+
+        // previews: what the app did (full decode + resize) against the reduced decode
+        const int previewMaxSize = 1024;
+        std::vector<Mat> previews;
+        start = getTickCount();
+        bool previewOk = readImagePreviews(fds, previewMaxSize, previews);
+        const double previewMs = (double)(getTickCount() - start) * 1000.0 / getTickFrequency();
+
+        double previewError = 0.0;
+        for (size_t i = 0; i < paths.size(); i++) {
+            Mat diff;
+            ok = ok && !parallel[i].empty() && parallel[i].size() == serial[i].size();
+            if (ok) absdiff(parallel[i], serial[i], diff);
+            ok = ok && 0 == countNonZero(diff.reshape(1));
+
+            Mat expected;
+            resize(serial[i], expected, previewSize(serial[i].size(), previewMaxSize), 0.0, 0.0, INTER_LANCZOS4);
+            previewOk = previewOk && previews[i].size() == expected.size();
+            if (previewOk) {
+                absdiff(previews[i], expected, diff);
+                const Scalar channels = mean(diff);
+                previewError += (channels[0] + channels[1] + channels[2]) / 3.0 / paths.size();
+            }
+
+            close(fds[i]);
+            unlink(paths[i].c_str());
+        }
+
+        printf("%-14s %-10s %5.1f MP  %s  %2d files  serial %9.1f ms  parallel %9.1f ms (%d threads)\n",
+               "decode", source, megaPixels, ok ? "ok    " : "FAILED", (int)paths.size(), serialMs, parallelMs,
+               getNumThreads());
+        printf("%-14s %-10s %5.1f MP  %s  %2d files  reduced decode %9.1f ms  mean error vs full decode + resize %.2f\n",
+               "decode-preview", source, megaPixels, previewOk ? "ok    " : "FAILED", (int)paths.size(), previewMs,
+               previewError);
+        fflush(stdout);
+        success = ok && previewOk && success;
+    }
+
+    return success;
+}
+
+
+static
+void usage(const char* name) {
+    printf("Usage: %s [options]\n"
+           "  --examples <folder>    examples folder (default: examples)\n"
+           "  --mp <list>            resolutions in mega pixels (default: 12,24,48)\n"
+           "  --mode <list>          modes to run (default: all)\n"
+           "  --source <list>        synthetic,examples (default: both)\n"
+           "  --frames <n>           frames in synthetic stacks (default: 3)\n"
+           "  --repeat <n>           runs per measurement (default: 1)\n"
+           "  --verify               check the optimized kernels against the scalar ones and exit\n",
+           name);
+}
+
+
+int main(int argc, char** argv) {
+    Options options;
+
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+
+        if ("--examples" == arg && hasValue) {
+            options.examples = argv[++i];
+        } else if ("--mp" == arg && hasValue) {
+            options.megaPixels.clear();
+            for (const auto& item: split(argv[++i]))
+                options.megaPixels.push_back(atof(item.c_str()));
+        } else if ("--mode" == arg && hasValue) {
+            options.modes = split(argv[++i]);
+        } else if ("--source" == arg && hasValue) {
+            options.sources = split(argv[++i]);
+        } else if ("--frames" == arg && hasValue) {
+            options.frames = std::max(2, atoi(argv[++i]));
+        } else if ("--repeat" == arg && hasValue) {
+            options.repeat = std::max(1, atoi(argv[++i]));
+        } else if ("--verify" == arg) {
+            options.verify = true;
+        } else {
+            usage(argv[0]);
+            return "--help" == arg ? 0 : 1;
+        }
+    }
+
+    if (options.verify) {
+        bool success = verifyNearest();
+        success = verifyLightDark() && success;
+        success = verifyAccumulator() && success;
+        success = verifySpill() && success;
+        success = verifyWarpMaps() && success;
+        success = verifyTiles() && success;
+        success = verifyLargestRect() && success;
+        success = verifyHdr() && success;
+        success = verifyAlignStage() && success;
+        success = verifyDeghost() && success;
+        success = verifyJobs() && success;
+        success = verifyScheduler() && success;
+        printf("verify: %s\n", success ? "ok" : "FAILED");
+        return success ? 0 : 1;
+    }
+
+    const std::vector<BenchMode> modes = {
+        { "panorama", "panorama", true,
+            [](const std::vector<Mat>& images, Mat& output) {
+                return makePanorama(images, output, PANORAMA_SPHERICAL);
+            }},
+        { "panorama-projections", "panorama", true,
+            [](const std::vector<Mat>& images, Mat& output) {
+                // what the app does when the projection spinner moves: register once, compose each projection
+                PanoramaSession session(images);
+                for (int projection: {PANORAMA_PLANE, PANORAMA_CYLINDRICAL, PANORAMA_SPHERICAL}) {
+                    if (!session.compose(projection, PANORAMA_QUALITY_BALANCED, output)) return false;
+                }
+                return true;
+            }},
+        { "panorama-preview", "panorama", true,
+            [](const std::vector<Mat>& images, Mat& output) {
+                // what the app does on save: register the previews, compose the full size images
+                std::vector<Mat> previews;
+                for (const auto& image: images) {
+                    Mat preview;
+                    resize(image, preview, scaledSize(image.size(), 1024), 0.0, 0.0, INTER_AREA);
+                    previews.push_back(preview);
+                }
+                Mat previewOutput;
+                auto previewSession = std::make_shared<PanoramaSession>(previews);
+                if (!previewSession->compose(PANORAMA_SPHERICAL, PANORAMA_QUALITY_BALANCED, previewOutput)) return false;
+                PanoramaSession session(images, previewSession);
+                return session.compose(PANORAMA_SPHERICAL, PANORAMA_QUALITY_BALANCED, output);
+            }},
+        { "panorama-fast", "panorama", true,
+            [](const std::vector<Mat>& images, Mat& output) {
+                return makePanorama(images, output, PANORAMA_SPHERICAL, PANORAMA_QUALITY_FAST);
+            }},
+        { "panorama-best", "panorama", true,
+            [](const std::vector<Mat>& images, Mat& output) {
+                return makePanorama(images, output, PANORAMA_SPHERICAL, PANORAMA_QUALITY_BEST);
+            }},
+        { "panorama-tiled", "panorama", true,
+            [](const std::vector<Mat>& images, Mat& output) {
+                // what the app does on save for panoramas: tiled compose in a file-backed buffer
+                const char* tmp = std::getenv("TMPDIR");
+                CompositorOptions options;
+                options.spillDirectory = tmp ? tmp : "/tmp";
+                PanoramaSession session(images);
+                return session.composeTiled(PANORAMA_SPHERICAL, PANORAMA_QUALITY_BALANCED, output, options);
+            }},
+        { "panorama-recompose", "panorama", true,
+            [](const std::vector<Mat>& images, Mat& output) {
+                // what the app does when the quality changes: the second compose reuses the warp maps of the session
+                PanoramaSession session(images);
+                return session.compose(PANORAMA_SPHERICAL, PANORAMA_QUALITY_BALANCED, output)
+                       && session.compose(PANORAMA_SPHERICAL, PANORAMA_QUALITY_BEST, output);
+            }},
+        { "panorama-register", "panorama", true,
+            [](const std::vector<Mat>& images, Mat& output) {
+                // registration only: parallel features, neighbour pairs + loop closure
+                std::vector<detail::CameraParams> cameras;
+                std::vector<int> component;
+                if (!registerPanorama(images, cameras, component, RegistrationOptions())) return false;
+                output.create(1, 1, CV_8UC3);
+                return true;
+            }},
+        { "panorama-register-allpairs", "panorama", true,
+            [](const std::vector<Mat>& images, Mat& output) {
+                // registration only, every pair matched (the Stitcher default)
+                std::vector<detail::CameraParams> cameras;
+                std::vector<int> component;
+                RegistrationOptions options;
+                options.neighbours = 0;
+                if (!registerPanorama(images, cameras, component, options)) return false;
+                output.create(1, 1, CV_8UC3);
+                return true;
+            }},
+        { "panorama-register-akaze", "panorama", true,
+            [](const std::vector<Mat>& images, Mat& output) {
+                std::vector<detail::CameraParams> cameras;
+                std::vector<int> component;
+                RegistrationOptions options;
+                options.features = PANORAMA_FEATURES_AKAZE;
+                if (!registerPanorama(images, cameras, component, options)) return false;
+                output.create(1, 1, CV_8UC3);
+                return true;
+            }},
+        { "panorama-incremental", "panorama", true,
+            [](const std::vector<Mat>& images, Mat& output) {
+                // sweeping panorama: the frames are added one at a time
+                IncrementalPanorama panorama(PANORAMA_SPHERICAL, PANORAMA_QUALITY_BALANCED);
+                for (const auto& image: images) {
+                    if (!panorama.add(image)) return false;
+                }
+                return panorama.panorama(output);
+            }},
+        { "align", "aligned", false,
+            [](const std::vector<Mat>& images, Mat& output) {
+                std::vector<Mat> transforms, alignedImages;
+                if (!alignImages(images, Mat(), transforms, alignedImages)) return false;
+                output = alignedImages.back();
+                return true;
+            }},
+        { "align-preview", "aligned", false,
+            [](const std::vector<Mat>& images, Mat& output) {
+                // what the app does on save: estimate on the previews, upscale + refine, then only warp
+                std::vector<Mat> previews, previewTransforms, transforms, alignedImages;
+                for (const auto& image: images) {
+                    Mat preview;
+                    resize(image, preview, scaledSize(image.size(), 1024), 0.0, 0.0, INTER_AREA);
+                    previews.push_back(preview);
+                }
+                if (!estimateAlignment(previews, Mat(), previewTransforms)) return false;
+                if (!alignForMerge(images, Mat(), previews[0], Mat(), previewTransforms, true, transforms, &alignedImages)) return false;
+                output = alignedImages.back();
+                return true;
+            }},
+        { "average", "longexposure", false,
+            [](const std::vector<Mat>& images, Mat& output) {
+                return makeLongExposureAverage(images, output);
+            }},
+        { "nearest", "longexposure", false,
+            [](const std::vector<Mat>& images, Mat& output) {
+                Mat average;
+                return makeLongExposureAverage(images, average)
+                    && makeLongExposureNearest(images, average, output);
+            }},
+        { "light", "longexposure", false,
+            [](const std::vector<Mat>& images, Mat& output) {
+                return makeLongExposureLightOrDark(images, output, true);
+            }},
+        { "dark", "longexposure", false,
+            [](const std::vector<Mat>& images, Mat& output) {
+                return makeLongExposureLightOrDark(images, output, false);
+            }},
+        { "average-banded", "longexposure", false,
+            [](const std::vector<Mat>& images, Mat& output) {
+                return makeLongExposureBanded(frameSources(images), LONG_EXPOSURE_AVERAGE, output);
+            }},
+        { "nearest-banded", "longexposure", false,
+            [](const std::vector<Mat>& images, Mat& output) {
+                return makeLongExposureBanded(frameSources(images), LONG_EXPOSURE_NEAREST_TO_AVERAGE, output);
+            }},
+        { "light-banded", "longexposure", false,
+            [](const std::vector<Mat>& images, Mat& output) {
+                return makeLongExposureBanded(frameSources(images), LONG_EXPOSURE_LIGHT, output);
+            }},
+        { "dark-banded", "longexposure", false,
+            [](const std::vector<Mat>& images, Mat& output) {
+                return makeLongExposureBanded(frameSources(images), LONG_EXPOSURE_DARK, output);
+            }},
+        { "hdr", "hdr", false,
+            [](const std::vector<Mat>& images, Mat& output) {
+                return makeHdr(images, output);
+            }},
+        { "hdr-ghosts", "hdr", false,
+            [](const std::vector<Mat>& images, Mat& output) {
+                return makeHdr(images, output, false);
+            }},
+        { "hdr-mertens", "hdr", false,
+            [](const std::vector<Mat>& images, Mat& output) {
+                // what the app did: cv::MergeMertens on all the frames, then the float result to 8 bits
+                Mat fused;
+                createMergeMertens()->process(images, fused);
+                fused.convertTo(output, CV_8U, 255.0);
+                return true;
+            }},
+        { "focusstack", "aligned", false,
+            [](const std::vector<Mat>& images, Mat& output) {
+                return makeFocusStack(images, output, FOCUS_STACK_PYRAMID);
+            }},
+        { "focusstack-sharpest", "aligned", false,
+            [](const std::vector<Mat>& images, Mat& output) {
+                return makeFocusStack(images, output, FOCUS_STACK_SHARPEST);
+            }},
+    };
+
+    bool success = true;
+
+    for (double megaPixels: options.megaPixels) {
+        Size size = sizeForMegaPixels(Size(4, 3), megaPixels);
+
+        if (contains(options.modes, "border-fill"))
+            success = benchBorderFill(options, megaPixels) && success;
+
+        if (contains(options.modes, "decode"))
+            success = benchDecode(options, megaPixels) && success;
+
+        for (const auto& mode: modes) {
+            if (!contains(options.modes, mode.name)) continue;
+
+            if (contains(options.sources, "synthetic")) {
+                std::vector<Mat> images = makeSyntheticStack(size, options.frames, mode.panorama);
+                success = runOne(mode, "synthetic", megaPixels, images, options.repeat) && success;
+            }
+
+            if (contains(options.sources, "examples")) {
+                std::vector<Mat> images = loadExampleStack(options.examples + "/" + mode.examplesFolder, megaPixels);
+                if (images.size() < 2) {
+                    printf("%-14s %-10s: no images found in %s/%s\n", mode.name, "examples", options.examples.c_str(), mode.examplesFolder);
+                    continue;
+                }
+                success = runOne(mode, "examples", megaPixels, images, options.repeat) && success;
+            }
+        }
+    }
+
+    return success ? 0 : 1;
+}
@@ -0,0 +1,381 @@
+#include "align.h"
+#include "profile.h"
+#include "opencv2/calib3d.hpp"
+#include "opencv2/imgproc.hpp"
+
+
+using namespace cv;
+
+
+#define ALIGN_MAX_FEATURES      200
+#define ALIGN_QUALITY_LEVEL     0.01
+#define ALIGN_MIN_DISTANCE      30.0
+
+#define LK_WIN_SIZE             21
+#define LK_MAX_LEVEL            3
+#define LK_MAX_ITERATIONS       30
+#define LK_EPSILON              0.01f
+#define LK_MIN_EIGEN_THRESHOLD  1e-4f
+
+// Refinement at full resolution: one level, small window, the preview transform is a good initial guess
+#define REFINE_WIN_SIZE         11
+#define REFINE_SEARCH_RADIUS    8
+
+// Frames tracked at the same time: their gray pyramids (~1.33 bytes per pixel) must fit in this budget
+#define ALIGN_FRAMES_MEGABYTES  192
+
+
+// 8 bits pyramid, like cv::calcOpticalFlowPyrLK: the derivatives are only computed on the tracking windows
+struct LKPyramid {
+    std::vector<Mat> levels;
+};
+
+
+static
+void buildLKPyramid(const Mat& gray, LKPyramid& pyramid, int maxLevel = LK_MAX_LEVEL) {
+    buildPyramid(gray, pyramid.levels, maxLevel);
+}
+
+
+// Intensity in [0, 1]
+static inline
+float sampleBilinear(const Mat& image, float x, float y) {
+    x = std::min(std::max(x, 0.0f), (float)image.cols - 1.001f);
+    y = std::min(std::max(y, 0.0f), (float)image.rows - 1.001f);
+    const int ix = (int)x;
+    const int iy = (int)y;
+    const float ax = x - ix;
+    const float ay = y - iy;
+    const uchar* row0 = image.ptr<uchar>(iy) + ix;
+    const uchar* row1 = image.ptr<uchar>(iy + 1) + ix;
+    return ((row0[0] * (1.0f - ax) + row0[1] * ax) * (1.0f - ay) + (row1[0] * (1.0f - ax) + row1[1] * ax) * ay)
+           * (1.0f / 255.0f);
+}
+
+
+// Pyramidal Lucas-Kanade for one point (same idea and defaults as cv::calcOpticalFlowPyrLK,
+// which is in the video module that the native build doesn't include).
+// initialFlow: expected displacement at level 0
+static
+bool trackPoint(const LKPyramid& reference, const LKPyramid& frame, const Point2f& point, Point2f& tracked,
+                int winSize = LK_WIN_SIZE, const Point2f& initialFlow = Point2f(0.0f, 0.0f)) {
+    const int half = winSize / 2;
+    const int windowArea = winSize * winSize;
+    const int patchSize = winSize + 2;  // the window and the 1 pixel border of the Scharr kernel
+    float I[LK_WIN_SIZE * LK_WIN_SIZE], Ix[LK_WIN_SIZE * LK_WIN_SIZE], Iy[LK_WIN_SIZE * LK_WIN_SIZE];
+    float patch[(LK_WIN_SIZE + 2) * (LK_WIN_SIZE + 2)];
+    const int maxLevel = (int)reference.levels.size() - 1;
+    Point2f guess = initialFlow * (1.0f / (float)(1 << maxLevel));
+
+    CV_Assert(winSize <= LK_WIN_SIZE);
+
+    for (int level = maxLevel; level >= 0; level--) {
+        const float scale = 1.0f / (float)(1 << level);
+        const Point2f prevPoint = point * scale;
+        Point2f nextPoint = prevPoint + guess;
+        const Mat& levelReference = reference.levels[level];
+        const Mat& levelFrame = frame.levels[level];
+
+        for (int py = 0, k = 0; py < patchSize; py++) {
+            for (int px = 0; px < patchSize; px++, k++)
+                patch[k] = sampleBilinear(levelReference, prevPoint.x + px - half - 1, prevPoint.y + py - half - 1);
+        }
+
+        // Scharr derivatives of the interpolated window (same as interpolating the derivatives of the level)
+        float a11 = 0.0f, a12 = 0.0f, a22 = 0.0f;
+        for (int wy = 0, k = 0; wy < winSize; wy++) {
+            for (int wx = 0; wx < winSize; wx++, k++) {
+                const float* p = patch + (wy + 1) * patchSize + wx + 1;
+                I[k] = p[0];
+                Ix[k] = (3.0f * (p[-patchSize + 1] - p[-patchSize - 1] + p[patchSize + 1] - p[patchSize - 1])
+                         + 10.0f * (p[1] - p[-1])) * (1.0f / 32.0f);
+                Iy[k] = (3.0f * (p[patchSize - 1] - p[-patchSize - 1] + p[patchSize + 1] - p[-patchSize + 1])
+                         + 10.0f * (p[patchSize] - p[-patchSize])) * (1.0f / 32.0f);
+                a11 += Ix[k] * Ix[k];
+                a12 += Ix[k] * Iy[k];
+                a22 += Iy[k] * Iy[k];
+            }
+        }
+
+        const float det = a11 * a22 - a12 * a12;
+        const float minEigen = (a11 + a22 - std::sqrt((a11 - a22) * (a11 - a22) + 4.0f * a12 * a12)) / (2.0f * windowArea);
+        if (minEigen < LK_MIN_EIGEN_THRESHOLD || det < FLT_EPSILON) return false;
+
+        for (int iteration = 0; iteration < LK_MAX_ITERATIONS; iteration++) {
+            if (nextPoint.x < -half || nextPoint.y < -half
+                    || nextPoint.x >= levelFrame.cols + half || nextPoint.y >= levelFrame.rows + half)
+                return false;
+
+            float b1 = 0.0f, b2 = 0.0f;
+            for (int wy = -half, k = 0; wy <= half; wy++) {
+                for (int wx = -half; wx <= half; wx++, k++) {
+                    const float diff = I[k] - sampleBilinear(levelFrame, nextPoint.x + wx, nextPoint.y + wy);
+                    b1 += diff * Ix[k];
+                    b2 += diff * Iy[k];
+                }
+            }
+
+            const Point2f delta((a22 * b1 - a12 * b2) / det, (a11 * b2 - a12 * b1) / det);
+            nextPoint += delta;
+            if (delta.dot(delta) <= LK_EPSILON * LK_EPSILON) break;
+        }
+
+        guess = (nextPoint - prevPoint) * (level > 0 ? 2.0f : 1.0f);
+        if (0 == level) tracked = nextPoint;
+    }
+
+    return tracked.x >= 0 && tracked.y >= 0 && tracked.x < reference.levels[0].cols && tracked.y < reference.levels[0].rows;
+}
+
+
+static
+Mat estimateFrameTransform(const LKPyramid& reference, const std::vector<Point2f>& referencePoints, const Mat& image) {
+    Mat gray;
+    LKPyramid frame;
+    cvtColor(image, gray, COLOR_RGB2GRAY);
+    buildLKPyramid(gray, frame);
+
+    // Keep only the points that were tracked
+    std::vector<Point2f> fromPoints, toPoints;
+    fromPoints.reserve(referencePoints.size());
+    toPoints.reserve(referencePoints.size());
+
+    for (const auto& point: referencePoints) {
+        Point2f tracked;
+        if (trackPoint(reference, frame, point, tracked)) {
+            fromPoints.push_back(tracked);
+            toPoints.push_back(point);
+        }
+    }
+
+    if (fromPoints.size() < 3) return Mat();
+    return estimateAffinePartial2D(fromPoints, toPoints);
+}
+
+
+// Estimates the transforms and, if alignedImages is not null, warps the frames in the same parallel pass
+static
+bool estimateAndWarp(const std::vector<Mat>& images, const Mat& mask,
+                     std::vector<Mat>& transforms, std::vector<Mat>* alignedImages,
+                     JobControl* control, JobProgress& progress) {
+    ScopedStage stage("align");
+
+    if (images.size() < 2) return false;
+
+    for (const auto& image: images) {
+        if (image.empty() || CV_8UC3 != image.type()) return false;
+    }
+
+    Mat referenceGray;
+    std::vector<Point2f> referencePoints;
+    LKPyramid reference;
+
+    cvtColor(images[0], referenceGray, COLOR_RGB2GRAY);
+    goodFeaturesToTrack(referenceGray, referencePoints, ALIGN_MAX_FEATURES, ALIGN_QUALITY_LEVEL, ALIGN_MIN_DISTANCE,
+                        mask.size() == referenceGray.size() ? mask : noArray());
+    buildLKPyramid(referenceGray, reference);
+
+    transforms.assign(images.size(), Mat());
+    transforms[0] = Mat::eye(2, 3, CV_64F);
+
+    if (alignedImages) {
+        alignedImages->assign(images.size(), Mat());
+        (*alignedImages)[0] = images[0];
+    }
+
+    // full size frames: only as many frames at the same time as their pyramids fit in the budget
+    const double frameMegabytes = referenceGray.total() * 4.0 / 3.0 / (1024.0 * 1024.0);
+    const int frames = (int)images.size() - 1;
+    const int stripes = std::max(1, std::min(frames, (int)(ALIGN_FRAMES_MEGABYTES / frameMegabytes)));
+
+    parallel_for_(Range(1, (int)images.size()), [&](const Range& range) {
+        for (int i = range.start; i < range.end && !isCancelled(control); i++) {
+            transforms[i] = estimateFrameTransform(reference, referencePoints, images[i]);
+            if (alignedImages && !transforms[i].empty())
+                warpAffine(images[i], (*alignedImages)[i], transforms[i], images[i].size(), INTER_LANCZOS4);
+            progress.advance();
+        }
+    }, (double)stripes);
+
+    return !isCancelled(control);
+}
+
+
+bool estimateAlignment(const std::vector<Mat>& images, const Mat& mask, std::vector<Mat>& transforms, JobControl* control) {
+    JobProgress progress(control, (int)images.size() - 1);
+    return estimateAndWarp(images, mask, transforms, nullptr, control, progress);
+}
+
+
+bool alignImages(const std::vector<Mat>& images, const Mat& mask,
+                 std::vector<Mat>& transforms, std::vector<Mat>& alignedImages, JobControl* control) {
+    JobProgress progress(control, (int)images.size() - 1);
+    return estimateAndWarp(images, mask, transforms, &alignedImages, control, progress);
+}
+
+
+static
+bool warpFrames(const std::vector<Mat>& images, const std::vector<Mat>& transforms, std::vector<Mat>& alignedImages,
+                JobControl* control, JobProgress& progress) {
+    ScopedStage stage("warp");
+
+    if (images.size() != transforms.size()) return false;
+
+    alignedImages.assign(images.size(), Mat());
+
+    parallel_for_(Range(0, (int)images.size()), [&](const Range& range) {
+        for (int i = range.start; i < range.end && !isCancelled(control); i++) {
+            if (transforms[i].empty()) continue;
+            if (0 == i) {
+                alignedImages[i] = images[i];
+                continue;
+            }
+            warpAffine(images[i], alignedImages[i], transforms[i], images[i].size(), INTER_LANCZOS4);
+            progress.advance();
+        }
+    });
+
+    return !isCancelled(control);
+}
+
+
+bool warpAlignment(const std::vector<Mat>& images, const std::vector<Mat>& transforms, std::vector<Mat>& alignedImages,
+                   JobControl* control) {
+    JobProgress progress(control, (int)images.size() - 1);
+    return warpFrames(images, transforms, alignedImages, control, progress);
+}
+
+
+// Scales a transform estimated on images scaled by (sx, sy)
+static
+Mat scaleTransform(const Mat& transform, double sx, double sy) {
+    if (transform.empty()) return Mat();
+
+    // T' = S * T * S^-1
+    Matx23d t(transform);
+    Matx23d scaled(
+            t(0, 0), t(0, 1) * sx / sy, t(0, 2) * sx,
+            t(1, 0) * sy / sx, t(1, 1), t(1, 2) * sy);
+    return Mat(scaled);
+}
+
+
+static
+Mat grayPatch(const Mat& image, const Rect& rect) {
+    Mat gray;
+    cvtColor(image(rect), gray, COLOR_RGB2GRAY);
+    return gray;
+}
+
+
+// One Lucas-Kanade pass (single level, small window) at full resolution, starting from the predicted position,
+// using only small patches around the features: the full resolution frames are never converted to gray.
+static
+Mat refineFrameTransform(const Mat& reference, const Mat& image, const std::vector<Point2f>& referencePoints, const Mat& transform) {
+    const int half = REFINE_WIN_SIZE / 2 + REFINE_SEARCH_RADIUS + 2;
+    const Rect bounds(0, 0, image.cols, image.rows);
+
+    Mat inverse;
+    invertAffineTransform(transform, inverse);
+    const Matx23d t(inverse);
+
+    std::vector<Point2f> fromPoints, toPoints;
+    fromPoints.reserve(referencePoints.size());
+    toPoints.reserve(referencePoints.size());
+
+    for (const auto& point: referencePoints) {
+        const Point2f predicted(
+                (float)(t(0, 0) * point.x + t(0, 1) * point.y + t(0, 2)),
+                (float)(t(1, 0) * point.x + t(1, 1) * point.y + t(1, 2)));
+
+        const Rect referenceRect = Rect(cvRound(point.x) - half, cvRound(point.y) - half, 2 * half + 1, 2 * half + 1) & bounds;
+        const Rect frameRect = Rect(cvRound(predicted.x) - half, cvRound(predicted.y) - half, 2 * half + 1, 2 * half + 1) & bounds;
+        if (referenceRect.area() <= 0 || frameRect.area() <= 0) continue;
+
+        LKPyramid referencePatch, framePatch;
+        buildLKPyramid(grayPatch(reference, referenceRect), referencePatch, 0);
+        buildLKPyramid(grayPatch(image, frameRect), framePatch, 0);
+
+        const Point2f patchPoint = point - Point2f(referenceRect.tl());
+        const Point2f patchFlow = (predicted - Point2f(frameRect.tl())) - patchPoint;
+        Point2f tracked;
+        if (!trackPoint(referencePatch, framePatch, patchPoint, tracked, REFINE_WIN_SIZE, patchFlow)) continue;
+
+        fromPoints.push_back(tracked + Point2f(frameRect.tl()));
+        toPoints.push_back(point);
+    }
+
+    if (fromPoints.size() < 3) return transform;
+
+    Mat refined = estimateAffinePartial2D(fromPoints, toPoints);
+    return refined.empty() ? transform : refined;
+}
+
+
+static
+bool upscaleFrames(const std::vector<Mat>& images, const Mat& previewReference, const Mat& previewMask,
+                   const std::vector<Mat>& previewTransforms, bool refine, std::vector<Mat>& transforms,
+                   JobControl* control, JobProgress& progress) {
+    ScopedStage stage("align-upscale");
+
+    if (images.size() < 2 || images.size() != previewTransforms.size() || previewReference.empty()) return false;
+
+    const double sx = (double)images[0].cols / previewReference.cols;
+    const double sy = (double)images[0].rows / previewReference.rows;
+
+    transforms.resize(images.size());
+    for (size_t i = 0; i < images.size(); i++)
+        transforms[i] = scaleTransform(previewTransforms[i], sx, sy);
+
+    if (!refine) return true;
+
+    // The features are searched on the preview (cheap) and scaled
+    Mat previewGray;
+    std::vector<Point2f> referencePoints;
+    cvtColor(previewReference, previewGray, COLOR_RGB2GRAY);
+    goodFeaturesToTrack(previewGray, referencePoints, ALIGN_MAX_FEATURES, ALIGN_QUALITY_LEVEL, ALIGN_MIN_DISTANCE,
+                        previewMask.size() == previewGray.size() ? previewMask : noArray());
+    for (auto& point: referencePoints) {
+        point.x = (float)(point.x * sx);
+        point.y = (float)(point.y * sy);
+    }
+
+    parallel_for_(Range(1, (int)images.size()), [&](const Range& range) {
+        for (int i = range.start; i < range.end && !isCancelled(control); i++) {
+            if (!transforms[i].empty())
+                transforms[i] = refineFrameTransform(images[0], images[i], referencePoints, transforms[i]);
+            progress.advance();
+        }
+    });
+
+    return !isCancelled(control);
+}
+
+
+bool upscaleAlignment(const std::vector<Mat>& images, const Mat& previewReference, const Mat& previewMask,
+                      const std::vector<Mat>& previewTransforms, bool refine, std::vector<Mat>& transforms,
+                      JobControl* control) {
+    JobProgress progress(control, (int)images.size() - 1);
+    return upscaleFrames(images, previewReference, previewMask, previewTransforms, refine, transforms, control, progress);
+}
+
+
+bool alignForMerge(const std::vector<Mat>& images, const Mat& mask,
+                   const Mat& previewReference, const Mat& previewMask, const std::vector<Mat>& previewTransforms, bool refine,
+                   std::vector<Mat>& transforms, std::vector<Mat>* alignedImages, JobControl* control) {
+    const bool known = images.size() == transforms.size();
+    const bool upscale = !known && !previewTransforms.empty();
+    const bool estimate = !known && !upscale;
+
+    // one progress for all the stages, each one goes through the frames once
+    const int frames = (int)images.size() - 1;
+    int stages = (upscale && refine ? 1 : 0) + (estimate || alignedImages ? 1 : 0);
+    JobProgress progress(control, std::max(stages, 1) * frames);
+
+    if (estimate) return estimateAndWarp(images, mask, transforms, alignedImages, control, progress);
+
+    if (upscale && !upscaleFrames(images, previewReference, previewMask, previewTransforms, refine, transforms, control, progress))
+        return false;
+
+    return !alignedImages || warpFrames(images, transforms, *alignedImages, control, progress);
+}
@@ -0,0 +1,38 @@
+#ifndef MERGEPHOTOS_ALIGN_H
+#define MERGEPHOTOS_ALIGN_H
+
+#include <vector>
+#include "opencv2/core.hpp"
+#include "job.h"
+
+
+// Estimates for each image the affine transform (2x3 CV_64F, as used by warpAffine) that aligns it to images[0].
+// mask (optional, CV_8UC1) limits where the features are searched on images[0].
+// Frames that can't be aligned get an empty transform. Frames are processed in parallel.
+bool estimateAlignment(const std::vector<cv::Mat>& images, const cv::Mat& mask, std::vector<cv::Mat>& transforms,
+                       JobControl* control = nullptr);
+
+// Warps each image with its transform (in parallel). Frames with an empty transform get an empty image.
+bool warpAlignment(const std::vector<cv::Mat>& images, const std::vector<cv::Mat>& transforms, std::vector<cv::Mat>& alignedImages,
+                   JobControl* control = nullptr);
+
+// Both in a single parallel pass
+bool alignImages(const std::vector<cv::Mat>& images, const cv::Mat& mask,
+                 std::vector<cv::Mat>& transforms, std::vector<cv::Mat>& alignedImages, JobControl* control = nullptr);
+
+// Transforms for full resolution images from the transforms estimated on their previews (smaller copies).
+// Only the translation needs scaling. If refine is true each transform is refined with one Lucas-Kanade pass
+// on small windows at full resolution (features are searched on previewReference, with previewMask).
+bool upscaleAlignment(const std::vector<cv::Mat>& images, const cv::Mat& previewReference, const cv::Mat& previewMask,
+                      const std::vector<cv::Mat>& previewTransforms, bool refine, std::vector<cv::Mat>& transforms,
+                      JobControl* control = nullptr);
+
+// The alignment stage of a merge, in one job: transforms are used as they are if there is one per image,
+// else scaled from previewTransforms if any (see upscaleAlignment), else estimated.
+// If alignedImages is not null the frames are warped too.
+bool alignForMerge(const std::vector<cv::Mat>& images, const cv::Mat& mask,
+                   const cv::Mat& previewReference, const cv::Mat& previewMask, const std::vector<cv::Mat>& previewTransforms, bool refine,
+                   std::vector<cv::Mat>& transforms, std::vector<cv::Mat>* alignedImages, JobControl* control = nullptr);
+
+
+#endif //MERGEPHOTOS_ALIGN_H
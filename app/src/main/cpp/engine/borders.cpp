@@ -0,0 +1,260 @@
+#include "borders.h"
+#include <algorithm>
+#include "profile.h"
+#include "opencv2/imgproc.hpp"
+#include "opencv2/photo.hpp"
+
+
+using namespace cv;
+
+
+void panoramaBorderMask(const Mat& panorama, Mat& mask) {
+    inRange(panorama, Scalar::all(0), Scalar::all(0), mask);
+
+    // black pixels inside the panorama are image content: keep only the regions touching the border
+    auto fillFrom = [&mask](int x, int y) {
+        if (255 == mask.at<uchar>(y, x)) floodFill(mask, Point(x, y), Scalar(128), nullptr, Scalar(), Scalar(), 4);
+    };
+    for (int x = 0; x < mask.cols; x++) {
+        fillFrom(x, 0);
+        fillFrom(x, mask.rows - 1);
+    }
+    for (int y = 0; y < mask.rows; y++) {
+        fillFrom(0, y);
+        fillFrom(mask.cols - 1, y);
+    }
+
+    compare(mask, 128, mask, CMP_EQ);
+}
+
+
+// Mask pixels of the rows [y, y + rows) of image: the upsampled coarse fill, smoothed along the mask edge
+static
+void refineStrip(const Mat& coarse, Mat& image, const Mat& mask, int y, int rows) {
+    const int band = BORDER_FILL_BAND;
+    const int margin = 2 * band;
+    const int top = std::max(0, y - margin);
+    const int bottom = std::min(image.rows, y + rows + margin);
+    const Rect extended(0, top, image.cols, bottom - top);
+    const Mat extendedMask = mask(extended);
+
+    // same as resizing the coarse level to the image size (INTER_LINEAR) and cropping
+    const double sx = (double)coarse.cols / image.cols;
+    const double sy = (double)coarse.rows / image.rows;
+    const Matx23d transform(sx, 0.0, 0.5 * sx - 0.5,
+                            0.0, sy, (top + 0.5) * sy - 0.5);
+    Mat composite;
+    image(extended).copyTo(composite);
+    Mat upsampled;
+    warpAffine(coarse, upsampled, transform, extended.size(), INTER_LINEAR | WARP_INVERSE_MAP, BORDER_REPLICATE);
+    upsampled.copyTo(composite, extendedMask);
+
+    // band: mask pixels near an image pixel
+    Mat valid, bandMask;
+    compare(extendedMask, 0, valid, CMP_EQ);
+    dilate(valid, bandMask, getStructuringElement(MORPH_RECT, Size(2 * band + 1, 2 * band + 1)));
+    bitwise_and(bandMask, extendedMask, bandMask);
+
+    Mat smooth;
+    GaussianBlur(composite, smooth, Size(2 * band + 1, 2 * band + 1), 0.0);
+    smooth.copyTo(composite, bandMask);
+
+    const Rect strip(0, y - top, image.cols, rows);
+    composite(strip).copyTo(image.rowRange(y, y + rows), mask.rowRange(y, y + rows));
+}
+
+
+static
+void refineLevel(const Mat& coarse, Mat& image, const Mat& mask) {
+    const int strips = (image.rows + BORDER_FILL_STRIP - 1) / BORDER_FILL_STRIP;
+
+    // a strip reads the rows of its neighbours: even strips first, then odd ones
+    for (int parity = 0; parity < 2; parity++) {
+        parallel_for_(Range(0, (strips + 1 - parity) / 2), [&](const Range& range) {
+            for (int i = range.start; i < range.end; i++) {
+                const int y = (2 * i + parity) * BORDER_FILL_STRIP;
+                const int rows = std::min(BORDER_FILL_STRIP, image.rows - y);
+                if (0 == countNonZero(mask.rowRange(y, y + rows))) continue;
+                refineStrip(coarse, image, mask, y, rows);
+            }
+        });
+    }
+}
+
+
+bool fillBorders(Mat& image, const Mat& mask, JobControl* control) {
+    if (image.empty() || CV_8UC3 != image.type() || mask.size() != image.size() || CV_8UC1 != mask.type()) return false;
+    if (0 == countNonZero(mask)) return true;
+
+    ScopedStage stage("border-fill");
+
+    // a level pixel is a mask pixel if any of its image pixels is: the black borders never leak in
+    std::vector<Mat> images = {image}, masks = {mask};
+    while (std::max(images.back().cols, images.back().rows) > BORDER_FILL_LOW_SIZE) {
+        const Size half((images.back().cols + 1) / 2, (images.back().rows + 1) / 2);
+        Mat levelImage, levelMask;
+        resize(images.back(), levelImage, half, 0.0, 0.0, INTER_AREA);
+        resize(masks.back(), levelMask, half, 0.0, 0.0, INTER_AREA);
+        compare(levelMask, 0, levelMask, CMP_GT);
+        images.push_back(levelImage);
+        masks.push_back(levelMask);
+    }
+
+    const int levels = (int)images.size();
+    JobProgress progress(control, levels);
+    if (isCancelled(control)) return false;
+
+    Mat filled;
+    inpaint(images.back(), masks.back(), filled, 3.0, INPAINT_NS);
+    progress.advance();
+
+    for (int level = levels - 2; level >= 0; level--) {
+        if (isCancelled(control)) return false;
+        refineLevel(filled, images[level], masks[level]);
+        filled = images[level];
+        progress.advance();
+    }
+
+    return true;
+}
+
+
+Rect largestValidRect(const Mat& mask) {
+    std::vector<int> heights(mask.cols + 1, 0);    // the last column stays 0: it flushes the stack
+    std::vector<int> stack;
+    stack.reserve(mask.cols + 1);
+    Rect best;
+
+    for (int y = 0; y < mask.rows; y++) {
+        const uchar* m = mask.ptr<uchar>(y);
+        for (int x = 0; x < mask.cols; x++)
+            heights[x] = m[x] ? 0 : heights[x] + 1;
+
+        // the stack holds columns of increasing heights: a column pops the higher ones, each of them
+        // being the height of a rectangle from the column under it in the stack to this one
+        stack.clear();
+        for (int x = 0; x <= mask.cols; x++) {
+            while (!stack.empty() && heights[stack.back()] >= heights[x]) {
+                const int height = heights[stack.back()];
+                stack.pop_back();
+                const int left = stack.empty() ? 0 : stack.back() + 1;
+                if (height * (x - left) > best.area())
+                    best = Rect(left, y - height + 1, x - left, height);
+            }
+            stack.push_back(x);
+        }
+    }
+
+    return best;
+}
+
+
+// True if mask has no pixel in rect
+static
+bool isValid(const Mat& mask, const Rect& rect) {
+    return 0 == countNonZero(mask(rect));
+}
+
+
+// Max pooling: a low resolution pixel is a mask pixel if any of the full resolution pixels it touches is
+// (INTER_AREA averages them: in 8 bits a lone mask pixel rounds to 0 once a low pixel covers ~510 of them)
+static
+void downscaleMask(const Mat& mask, const Size& lowSize, Mat& lowMask) {
+    const double sx = (double)mask.cols / lowSize.width;
+    const double sy = (double)mask.rows / lowSize.height;
+
+    std::vector<int> columnStart(lowSize.width), columnEnd(lowSize.width);
+    for (int x = 0; x < lowSize.width; x++) {
+        columnStart[x] = std::max(0, (int)std::floor(x * sx));
+        columnEnd[x] = std::max(columnStart[x] + 1, std::min(mask.cols, (int)std::ceil((x + 1) * sx)));
+    }
+
+    lowMask.create(lowSize, CV_8U);
+    parallel_for_(Range(0, lowSize.height), [&](const Range& range) {
+        Mat rows(1, mask.cols, CV_8U);
+        for (int y = range.start; y < range.end; y++) {
+            const int start = std::max(0, (int)std::floor(y * sy));
+            const int end = std::max(start + 1, std::min(mask.rows, (int)std::ceil((y + 1) * sy)));
+
+            mask.row(start).copyTo(rows);
+            for (int row = start + 1; row < end; row++)
+                max(rows, mask.row(row), rows);
+
+            const uchar* r = rows.ptr<uchar>();
+            uchar* low = lowMask.ptr<uchar>(y);
+            for (int x = 0; x < lowSize.width; x++)
+                low[x] = std::any_of(r + columnStart[x], r + columnEnd[x], [](uchar value) { return 0 != value; }) ? 255 : 0;
+        }
+    });
+}
+
+
+bool cropBorders(Mat& image, const Mat& mask) {
+    if (image.empty() || mask.size() != image.size() || CV_8UC1 != mask.type()) return false;
+
+    ScopedStage stage("border-crop");
+
+    // a low resolution pixel is a mask pixel if any of its pixels is: the rectangle is valid at full resolution
+    const double scale = std::min(1.0, (double)BORDER_CROP_LOW_SIZE / std::max(mask.cols, mask.rows));
+    Mat lowMask;
+    if (scale < 1.0) {
+        downscaleMask(mask, Size(std::max(1, cvRound(mask.cols * scale)), std::max(1, cvRound(mask.rows * scale))),
+                      lowMask);
+    } else {
+        lowMask = mask;
+    }
+
+    // nothing valid at low resolution: the image is kept as it is
+    const Rect low = largestValidRect(lowMask);
+    if (low.empty()) return true;
+
+    // inner full resolution rectangle (the low resolution pixels may not fall on full resolution pixels)
+    const double sx = (double)mask.cols / lowMask.cols;
+    const double sy = (double)mask.rows / lowMask.rows;
+    const int x0 = (int)std::ceil(low.x * sx), x1 = (int)std::floor(low.br().x * sx);
+    const int y0 = (int)std::ceil(low.y * sy), y1 = (int)std::floor(low.br().y * sy);
+    Rect rect(x0, y0, x1 - x0, y1 - y0);
+    rect &= Rect(Point(), mask.size());
+    if (rect.empty() || !isValid(mask, rect)) return true;
+
+    // grow each side while the next full resolution row / column is valid
+    bool grown = true;
+    while (grown) {
+        grown = false;
+        if (rect.x > 0 && isValid(mask, Rect(rect.x - 1, rect.y, 1, rect.height))) {
+            rect.x--;
+            rect.width++;
+            grown = true;
+        }
+        if (rect.br().x < mask.cols && isValid(mask, Rect(rect.br().x, rect.y, 1, rect.height))) {
+            rect.width++;
+            grown = true;
+        }
+        if (rect.y > 0 && isValid(mask, Rect(rect.x, rect.y - 1, rect.width, 1))) {
+            rect.y--;
+            rect.height++;
+            grown = true;
+        }
+        if (rect.br().y < mask.rows && isValid(mask, Rect(rect.x, rect.br().y, rect.width, 1))) {
+            rect.height++;
+            grown = true;
+        }
+    }
+
+    image = image(rect);
+    return true;
+}
+
+
+bool finishPanoramaBorders(Mat& panorama, int borders, JobControl* control) {
+    if (PANORAMA_BORDERS_FILL != borders && PANORAMA_BORDERS_CROP != borders) return true;
+
+    Mat mask;
+    {
+        ScopedStage stage("border-mask");
+        panoramaBorderMask(panorama, mask);
+    }
+
+    if (PANORAMA_BORDERS_CROP == borders) return !isCancelled(control) && cropBorders(panorama, mask);
+    return fillBorders(panorama, mask, control);
+}
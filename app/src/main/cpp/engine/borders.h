@@ -0,0 +1,44 @@
+#ifndef MERGEPHOTOS_BORDERS_H
+#define MERGEPHOTOS_BORDERS_H
+
+#include "opencv2/core.hpp"
+#include "job.h"
+
+
+#define BORDER_FILL_LOW_SIZE        512     // the coarsest level is inpainted (largest side, in pixels)
+#define BORDER_FILL_BAND            8       // refined band along the mask edge, in pixels of each level
+#define BORDER_FILL_STRIP           256     // rows refined together
+#define BORDER_CROP_LOW_SIZE        1024    // the crop is searched on a mask this small (largest side, in pixels)
+
+
+// Same values as Settings.PANORAMA_BORDERS_*
+enum PanoramaBorders {
+    PANORAMA_BORDERS_BLACK = 0,
+    PANORAMA_BORDERS_FILL,
+    PANORAMA_BORDERS_CROP
+};
+
+
+// Black pixels (CV_8UC3) connected to the image border: the parts of a panorama no image covers
+void panoramaBorderMask(const cv::Mat& panorama, cv::Mat& mask);
+
+// Fills the mask pixels of image (CV_8UC3, in place), coarse to fine:
+// the image is halved until it's small, the smallest level is inpainted (Navier-Stokes), then each finer level
+// takes the upsampled fill for its mask pixels and smooths the band along the mask edge, so the fill continues
+// the image without a seam. Only the mask rows are touched and the cost is linear in the image size.
+bool fillBorders(cv::Mat& image, const cv::Mat& mask, JobControl* control = nullptr);
+
+// Largest axis-aligned rectangle of zero pixels in mask (CV_8U), in O(width x height):
+// each row updates the column heights of the zero runs ending on it, and a stack finds the largest
+// rectangle under that histogram
+cv::Rect largestValidRect(const cv::Mat& mask);
+
+// Crops image (zero-copy: image becomes a ROI of itself) to the largest rectangle without mask pixels.
+// The rectangle is searched on a downscaled mask, then grown at full resolution.
+bool cropBorders(cv::Mat& image, const cv::Mat& mask);
+
+// Applies the borders setting (PanoramaBorders) to a composed panorama
+bool finishPanoramaBorders(cv::Mat& panorama, int borders, JobControl* control = nullptr);
+
+
+#endif //MERGEPHOTOS_BORDERS_H
@@ -0,0 +1,39 @@
+#ifndef MERGEPHOTOS_COMMON_H
+#define MERGEPHOTOS_COMMON_H
+
+#include <algorithm>
+#include <vector>
+#include "opencv2/core.hpp"
+
+
+typedef cv::Point3_<uchar> Pixel;
+
+
+// Size that fits inside maxSize x maxSize keeping the aspect ratio
+static inline
+cv::Size scaledSize(const cv::Size& size, int maxSize) {
+    if (size.height > size.width)
+        return cv::Size(maxSize * size.width / size.height, maxSize);
+    return cv::Size(maxSize, maxSize * size.height / size.width);
+}
+
+
+
+// Source coordinate (integer part clamped so that index + 1 is valid, and fraction) of each destination pixel,
+// same pixel center convention as resize
+static inline
+void bilinearCoordinates(int dstSize, int srcSize, std::vector<int>& index, std::vector<float>& fraction) {
+    index.resize(dstSize);
+    fraction.resize(dstSize);
+    const float scale = (float)srcSize / dstSize;
+
+    for (int i = 0; i < dstSize; i++) {
+        float position = std::min(std::max((i + 0.5f) * scale - 0.5f, 0.0f), (float)(srcSize - 1));
+        int integer = std::min((int)position, std::max(srcSize - 2, 0));
+        index[i] = integer;
+        fraction[i] = srcSize > 1 ? position - integer : 0.0f;
+    }
+}
+
+
+#endif //MERGEPHOTOS_COMMON_H
@@ -0,0 +1,264 @@
+#include "compositor.h"
+#include <algorithm>
+#include <cmath>
+#include "filebuffer.h"
+#include "panorama.h"
+#include "profile.h"
+#include "warpmaps.h"
+#include "opencv2/imgproc.hpp"
+
+
+using namespace cv;
+
+
+Ptr<WarperCreator> createPanoramaWarper(int projection) {
+    switch (projection) {
+        case PANORAMA_PLANE:
+            return makePtr<cv::PlaneWarper>();
+
+        case PANORAMA_CYLINDRICAL:
+            return makePtr<cv::CylindricalWarper>();
+
+        case PANORAMA_SPHERICAL:
+            return makePtr<cv::SphericalWarper>();
+    }
+
+    return Ptr<WarperCreator>();
+}
+
+
+PanoramaQualityProfile panoramaQualityProfile(int quality) {
+    switch (quality) {
+        case PANORAMA_QUALITY_FAST:
+            return { 0.05, 8.0, 64, 3 };
+
+        case PANORAMA_QUALITY_BEST:
+            return { 0.3, 0.0, 16, 7 };
+    }
+
+    return { 0.1, 0.0, 32, 5 };
+}
+
+
+static
+void scaleCamera(Mat& K, double scale) {
+    K.at<float>(0, 0) *= (float)scale;
+    K.at<float>(0, 2) *= (float)scale;
+    K.at<float>(1, 1) *= (float)scale;
+    K.at<float>(1, 2) *= (float)scale;
+}
+
+
+// A map estimated for a whole warped image (at any resolution) resampled for the pixels of a part of it.
+// Same as resizing the map to the warped image size (INTER_LINEAR) and cropping, without the full size map.
+static
+void resampleForRect(const Mat& map, const Size& warpedSize, const Point& offset, const Size& size, Mat& output) {
+    const double sx = (double)map.cols / warpedSize.width;
+    const double sy = (double)map.rows / warpedSize.height;
+    const Matx23d transform(sx, 0.0, (offset.x + 0.5) * sx - 0.5,
+                            0.0, sy, (offset.y + 0.5) * sy - 0.5);
+    warpAffine(map, output, transform, size, INTER_LINEAR | WARP_INVERSE_MAP, BORDER_REPLICATE);
+}
+
+
+// gain: CV_32F with 1 (same gain for all channels) or 3 channels
+static
+void applyGain(Mat& image, const Mat& gain) {
+    const int gainChannels = gain.channels();
+
+    parallel_for_(Range(0, image.rows), [&](const Range& range) {
+        for (int y = range.start; y < range.end; y++) {
+            uchar* pixels = image.ptr<uchar>(y);
+            const float* gains = gain.ptr<float>(y);
+            for (int x = 0; x < image.cols * 3; x++)
+                pixels[x] = saturate_cast<uchar>(pixels[x] * gains[3 == gainChannels ? x : x / 3]);
+        }
+    });
+}
+
+
+int panoramaBlendBands(const Rect& dst, const PanoramaQualityProfile& profile) {
+    // Same as the stitching sample (blend strength 5%), limited by the profile so the tile margin stays small
+    const double blendWidth = std::sqrt((double)dst.area()) * 5.0 / 100.0;
+    if (blendWidth < 1.0) return 0;
+    return std::min(profile.maxBands, std::max(0, (int)std::ceil(std::log2(blendWidth)) - 1));
+}
+
+
+bool composePanoramaRegion(const std::vector<CompositorImage>& images, int projection, float warpedScale, int bands,
+                           const Rect& dst, const Rect& region, Mat& panorama, int tileSize, JobControl* control,
+                           WarpMapCache* warpMaps) {
+    if (panorama.size() != dst.size() || CV_8UC3 != panorama.type()) return false;
+
+    // A bands levels pyramid reaches ~4 << bands pixels around a pixel (5 taps at each level, down then up):
+    // with that margin the tile matches the full canvas blend. The blended rectangle starts on the pyramid
+    // grid of dst (multiples of 1 << bands from dst.tl()), so the levels sample the same pixels as dst's.
+    const int step = 1 << bands;
+    const int margin = 4 << bands;
+    tileSize = std::max(tileSize, 64);
+
+    const Rect area = region & dst;
+    if (area.empty()) return true;
+    const int firstX = (area.x - dst.x) / tileSize, lastX = (area.br().x - 1 - dst.x) / tileSize;
+    const int firstY = (area.y - dst.y) / tileSize, lastY = (area.br().y - 1 - dst.y) / tileSize;
+    JobProgress progress(control, (lastX - firstX + 1) * (lastY - firstY + 1));
+    if (warpMaps) warpMaps->beginCompose();
+
+    WarpMaps maps;
+    Mat warped, warped16, mask, seam, gain, blended, blendedMask;
+
+    for (int tileY = firstY; tileY <= lastY; tileY++) {
+        for (int tileX = firstX; tileX <= lastX; tileX++) {
+            if (isCancelled(control)) return false;
+
+            const Rect tile = Rect(dst.x + tileX * tileSize, dst.y + tileY * tileSize, tileSize, tileSize) & dst;
+            const Point blendTl(std::max(0, tile.x - dst.x - margin) / step * step,
+                                std::max(0, tile.y - dst.y - margin) / step * step);
+            const Rect blendRoi = Rect(dst.tl() + blendTl, tile.br() + Point(margin, margin)) & dst;
+            Mat output = panorama(tile - dst.tl());
+
+            detail::MultiBandBlender blender(false, bands);
+            blender.prepare(blendRoi);
+            bool fed = false;
+
+            for (const auto& image: images) {
+                const Rect rect = image.roi & blendRoi;
+                if (rect.empty()) continue;
+
+                const bool mapped = warpMaps
+                    ? warpMaps->maps(projection, image.K, image.R, warpedScale, image.image.size(), rect, maps)
+                    : panoramaWarpMaps(projection, image.K, image.R, warpedScale, image.image.size(), rect, maps);
+                if (!mapped) return false;
+                if (maps.map1.empty()) continue;
+
+                remap(image.image, warped, maps.map1, maps.map2, INTER_LANCZOS4, BORDER_REFLECT);
+                mask = maps.mask;
+
+                const Point offset = rect.tl() - image.roi.tl();
+                if (!image.gain.empty()) {
+                    resampleForRect(image.gain, image.roi.size(), offset, rect.size(), gain);
+                    applyGain(warped, gain);
+                }
+
+                if (!image.seamMask.empty()) {
+                    resampleForRect(image.seamMask, image.roi.size(), offset, rect.size(), seam);
+                    bitwise_and(seam, mask, mask);
+                }
+
+                warped.convertTo(warped16, CV_16S);
+                blender.feed(warped16, mask, rect.tl());
+                fed = true;
+            }
+
+            if (fed) {
+                blender.blend(blended, blendedMask);
+                blended(Rect(tile.tl() - blendRoi.tl(), tile.size())).convertTo(output, CV_8U);
+            } else {
+                output.setTo(Scalar::all(0));
+            }
+
+            progress.advance();
+        }
+    }
+
+    return true;
+}
+
+
+bool composePanoramaTiled(const std::vector<Mat>& images, const std::vector<detail::CameraParams>& cameras,
+                          const std::vector<int>& component, int projection, const PanoramaQualityProfile& profile,
+                          Mat& panorama, const CompositorOptions& options, JobControl* control) {
+    const int count = (int)component.size();
+    if (count < 2 || cameras.size() != component.size()) return false;
+
+    Ptr<WarperCreator> creator = createPanoramaWarper(projection);
+    if (!creator) return false;
+
+    std::vector<CompositorImage> sources(count);
+    std::vector<double> focals(count);
+    for (int i = 0; i < count; i++) {
+        if (component[i] < 0 || component[i] >= (int)images.size()) return false;
+        sources[i].image = images[component[i]];
+        if (sources[i].image.empty() || CV_8UC3 != sources[i].image.type()) return false;
+        cameras[i].K().convertTo(sources[i].K, CV_32F);
+        cameras[i].R.convertTo(sources[i].R, CV_32F);
+        focals[i] = cameras[i].focal;
+    }
+
+    // Same as Stitcher: the warped scale is the median focal
+    std::sort(focals.begin(), focals.end());
+    float warpedScale = (float)(count % 2 ? focals[count / 2] : (focals[count / 2 - 1] + focals[count / 2]) * 0.5);
+
+    if (profile.composeMegapixels > 0.0) {
+        const double composeScale = std::sqrt(profile.composeMegapixels * 1e6 / sources[0].image.size().area());
+        if (composeScale < 1.0) {
+            ScopedStage stage("compose-resize");
+            for (auto& source: sources) {
+                if (isCancelled(control)) return false;
+                Mat image;
+                resize(source.image, image, Size(), composeScale, composeScale, INTER_AREA);
+                source.image = image;
+                scaleCamera(source.K, composeScale);
+            }
+            warpedScale *= (float)composeScale;
+        }
+    }
+
+    {
+        ScopedStage stage("seams");
+
+        const double seamScale = std::min(1.0, std::sqrt(profile.seamMegapixels * 1e6 / sources[0].image.size().area()));
+        Ptr<detail::RotationWarper> warper = creator->create((float)(warpedScale * seamScale));
+        std::vector<Point> corners(count);
+        std::vector<UMat> warpedImages(count), warpedImagesF(count), warpedMasks(count);
+
+        for (int i = 0; i < count; i++) {
+            if (isCancelled(control)) return false;
+
+            Mat image, K = sources[i].K.clone();
+            resize(sources[i].image, image, Size(), seamScale, seamScale, INTER_LINEAR_EXACT);
+            scaleCamera(K, seamScale);
+
+            corners[i] = warper->warp(image, K, sources[i].R, INTER_LINEAR, BORDER_REFLECT, warpedImages[i]);
+            warper->warp(Mat(image.size(), CV_8U, Scalar::all(255)), K, sources[i].R, INTER_NEAREST, BORDER_CONSTANT, warpedMasks[i]);
+            warpedImages[i].convertTo(warpedImagesF[i], CV_32F);
+        }
+
+        std::vector<Mat> gains;
+        Ptr<detail::ExposureCompensator> compensator =
+                makePtr<detail::BlocksGainCompensator>(profile.gainBlockSize, profile.gainBlockSize);
+        compensator->feed(corners, warpedImages, warpedMasks);
+        compensator->getMatGains(gains);
+        if (!gains.empty() && (int)gains.size() != count) return false;
+
+        if (isCancelled(control)) return false;
+
+        detail::GraphCutSeamFinder seamFinder(detail::GraphCutSeamFinderBase::COST_COLOR);
+        seamFinder.find(warpedImagesF, corners, warpedMasks);
+
+        for (int i = 0; i < count; i++) {
+            if (!gains.empty()) sources[i].gain = gains[i];
+            dilate(warpedMasks[i], sources[i].seamMask, Mat());
+        }
+    }
+
+    Ptr<detail::RotationWarper> warper = creator->create(warpedScale);
+    std::vector<Point> corners(count);
+    std::vector<Size> sizes(count);
+    for (int i = 0; i < count; i++) {
+        sources[i].roi = warper->warpRoi(sources[i].image.size(), sources[i].K, sources[i].R);
+        corners[i] = sources[i].roi.tl();
+        sizes[i] = sources[i].roi.size();
+    }
+
+    const Rect dst = detail::resultRoi(corners, sizes);
+
+    if (!options.spillDirectory.empty())
+        panorama.allocator = fileBackedAllocator(options.spillDirectory);
+    panorama.create(dst.size(), CV_8UC3);
+    if (panorama.empty()) return false;
+
+    ScopedStage stage("tiles");
+    return composePanoramaRegion(sources, projection, warpedScale, panoramaBlendBands(dst, profile), dst, dst,
+                                 panorama, options.tileSize, control, options.warpMaps);
+}
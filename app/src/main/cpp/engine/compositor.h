@@ -0,0 +1,81 @@
+#ifndef MERGEPHOTOS_COMPOSITOR_H
+#define MERGEPHOTOS_COMPOSITOR_H
+
+#include <string>
+#include <vector>
+#include "opencv2/core.hpp"
+#include "opencv2/stitching.hpp"
+#include "job.h"
+#include "warpmaps.h"
+
+
+#define PANORAMA_TILE_SIZE          1024
+
+
+// Same values as Settings.PANORAMA_QUALITY_*
+enum PanoramaQuality {
+    PANORAMA_QUALITY_FAST = 0,
+    PANORAMA_QUALITY_BALANCED,  // Stitcher defaults
+    PANORAMA_QUALITY_BEST
+};
+
+
+// Settings of the stages that dominate the compositing time, tuned together
+struct PanoramaQualityProfile {
+    double seamMegapixels;      // resolution of the seams and exposure estimation
+    double composeMegapixels;   // output resolution (<= 0: full resolution)
+    int gainBlockSize;          // exposure compensation blocks, in pixels at the seam resolution
+    int maxBands;               // multi-band blender bands (fewer for small outputs)
+};
+
+
+struct CompositorOptions {
+    // The output is blended in tileSize x tileSize tiles (plus the blending margin)
+    int tileSize = PANORAMA_TILE_SIZE;
+    // If not empty the panorama is allocated in a file-backed buffer in this directory
+    std::string spillDirectory;
+    // Projection maps of the panorama kept between composes (optional)
+    WarpMapCache* warpMaps = nullptr;
+};
+
+
+// Same warpers as Stitcher (projection: PanoramaProjection)
+cv::Ptr<cv::WarperCreator> createPanoramaWarper(int projection);
+
+// quality: PanoramaQuality (unknown values give the balanced profile)
+PanoramaQualityProfile panoramaQualityProfile(int quality);
+
+// One image of the panorama, ready to be composed tile by tile
+struct CompositorImage {
+    cv::Mat image;      // CV_8UC3
+    cv::Mat K, R;       // CV_32F
+    cv::Rect roi;       // warped image, in panorama coordinates
+    cv::Mat gain;       // optional: gain map of roi (any resolution, CV_32F, 1 or 3 channels)
+    cv::Mat seamMask;   // optional: seam mask of roi (any resolution, CV_8U)
+};
+
+// Multi-band bands for a panorama of dst size
+int panoramaBlendBands(const cv::Rect& dst, const PanoramaQualityProfile& profile);
+
+// Re-composes the tiles of panorama (CV_8UC3, dst: its rectangle in warped coordinates) that intersect region.
+// The tiles are aligned on the dst grid and blended with the support of the pyramid around them (4 << bands),
+// on the pyramid grid of dst: the result doesn't depend on region or on the tile size.
+// warpMaps (optional): projection maps kept by the panorama between composes
+bool composePanoramaRegion(const std::vector<CompositorImage>& images, int projection, float warpedScale, int bands,
+                           const cv::Rect& dst, const cv::Rect& region, cv::Mat& panorama,
+                           int tileSize = PANORAMA_TILE_SIZE, JobControl* control = nullptr,
+                           WarpMapCache* warpMaps = nullptr);
+
+// Same pipeline as Stitcher::composePanorama (gain compensation, graph cut seams, multi-band blending)
+// but the full resolution part runs one output tile at a time: for each tile only the overlapping part
+// of each image is warped and blended. Peak memory depends on the tile size, not on the panorama size.
+// The seams and the gains are estimated once on low resolution images.
+//
+// cameras: for the images in component, in full resolution pixels
+bool composePanoramaTiled(const std::vector<cv::Mat>& images, const std::vector<cv::detail::CameraParams>& cameras,
+                          const std::vector<int>& component, int projection, const PanoramaQualityProfile& profile,
+                          cv::Mat& panorama,
+                          const CompositorOptions& options = CompositorOptions(), JobControl* control = nullptr);
+
+
+#endif //MERGEPHOTOS_COMPOSITOR_H
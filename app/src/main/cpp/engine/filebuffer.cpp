@@ -0,0 +1,79 @@
+#include "filebuffer.h"
+#include <map>
+#include <mutex>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+
+using namespace cv;
+
+
+namespace {
+
+class FileBackedAllocator : public MatAllocator {
+public:
+    explicit FileBackedAllocator(const std::string& directory) : directory_(directory) {}
+
+    UMatData* allocate(int dims, const int* sizes, int type, void* data, size_t* step,
+                       AccessFlag flags, UMatUsageFlags usageFlags) const override {
+        // user data: nothing to map
+        if (data) return Mat::getDefaultAllocator()->allocate(dims, sizes, type, data, step, flags, usageFlags);
+
+        size_t total = CV_ELEM_SIZE(type);
+        for (int i = dims - 1; i >= 0; i--) {
+            if (step) step[i] = total;
+            total *= sizes[i];
+        }
+
+        uchar* mapped = mapFile(total);
+        if (!mapped) return Mat::getDefaultAllocator()->allocate(dims, sizes, type, data, step, flags, usageFlags);
+
+        UMatData* u = new UMatData(this);
+        u->data = u->origdata = mapped;
+        u->size = total;
+        return u;
+    }
+
+    bool allocate(UMatData* u, AccessFlag /*accessFlags*/, UMatUsageFlags /*usageFlags*/) const override {
+        return nullptr != u;
+    }
+
+    void deallocate(UMatData* u) const override {
+        if (!u) return;
+        munmap(u->origdata, u->size);
+        delete u;
+    }
+
+private:
+    uchar* mapFile(size_t size) const {
+        std::string path = directory_ + "/buffer_XXXXXX";
+        int fd = mkstemp(&path[0]);
+        if (fd < 0) return nullptr;
+
+        // the file disappears with the last reference to it (the mapping)
+        unlink(path.c_str());
+
+        void* mapped = MAP_FAILED;
+        if (0 == ftruncate(fd, (off_t)size))
+            mapped = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+
+        return MAP_FAILED == mapped ? nullptr : (uchar*)mapped;
+    }
+
+    std::string directory_;
+};
+
+}
+
+
+MatAllocator* fileBackedAllocator(const std::string& directory) {
+    static std::mutex mutex;
+    static std::map<std::string, MatAllocator*> allocators;
+
+    std::lock_guard<std::mutex> lock(mutex);
+    MatAllocator*& allocator = allocators[directory];
+    if (!allocator) allocator = new FileBackedAllocator(directory);
+    return allocator;
+}
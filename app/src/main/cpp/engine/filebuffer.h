@@ -0,0 +1,14 @@
+#ifndef MERGEPHOTOS_FILEBUFFER_H
+#define MERGEPHOTOS_FILEBUFFER_H
+
+#include <string>
+#include "opencv2/core.hpp"
+
+
+// Mat allocator backed by memory mapped files created (and immediately unlinked) in directory.
+// The kernel can write the pages back to the file instead of keeping them in RAM, so very large
+// outputs don't count as anonymous memory. The allocator lives as long as the process.
+cv::MatAllocator* fileBackedAllocator(const std::string& directory);
+
+
+#endif //MERGEPHOTOS_FILEBUFFER_H
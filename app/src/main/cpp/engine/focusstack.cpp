@@ -0,0 +1,237 @@
+#include "focusstack.h"
+#include "common.h"
+#include "profile.h"
+#include "pyramid.h"
+#include "opencv2/imgproc.hpp"
+#include "opencv2/core/hal/intrin.hpp"
+
+
+using namespace cv;
+
+
+#define FOCUS_STACK_WORKING_SIZE    800
+
+
+// Sharpness map at working resolution (CV_32F)
+static
+void sharpnessMap(const Mat& image, Mat& sharpness) {
+    Size scaled = scaledSize(image.size(), FOCUS_STACK_WORKING_SIZE);
+
+    Mat tmp, gray, laplace;
+    cvtColor(image, tmp, COLOR_RGB2GRAY);
+    resize(tmp, gray, scaled, 0.0, 0.0, INTER_AREA);
+
+    GaussianBlur(gray, tmp, Size(3,3), 0.0);
+    Laplacian(tmp, laplace, CV_16S, 1);
+    laplace = abs(laplace);
+    laplace.convertTo(tmp, CV_32F);
+    GaussianBlur(tmp, sharpness, Size(31,31), 0.0); //It's huge but really reduce out of focus halo
+}
+
+
+bool makeFocusStackSharpest(const std::vector<Mat>& images, Mat& outputImage, JobControl* control) {
+    if (images.size() < 2) return false;
+
+    for (const auto& image: images) {
+        if (image.empty() || CV_8UC3 != image.type() || image.size() != images[0].size()) return false;
+    }
+
+    // Only the small maps are kept: they are sampled (bilinear) for each full resolution row,
+    // instead of being upscaled to full resolution
+    std::vector<Mat> sharpness(images.size());
+
+    {
+        ScopedStage stage("sharpness");
+        JobProgress progress(control, (int)images.size(), 0.0f, 0.5f);
+        parallel_for_(Range(0, (int)images.size()), [&](const Range& range) {
+            for (int i = range.start; i < range.end; i++) {
+                if (isCancelled(control)) return;
+                sharpnessMap(images[i], sharpness[i]);
+                progress.advance();
+            }
+        });
+    }
+
+    if (isCancelled(control)) return false;
+
+    ScopedStage stage("select");
+
+    const Size size = images[0].size();
+    const Size mapSize = sharpness[0].size();
+    const int mapStep = mapSize.width > 1 ? 1 : 0;
+
+    outputImage.create(size, images[0].type());
+    if (outputImage.empty()) return false;
+
+    std::vector<int> mapX, mapY;
+    std::vector<float> fractionX, fractionY;
+    bilinearCoordinates(size.width, mapSize.width, mapX, fractionX);
+    bilinearCoordinates(size.height, mapSize.height, mapY, fractionY);
+
+    JobProgress progress(control, size.height, 0.5f, 1.0f);
+
+    parallel_for_(Range(0, size.height), [&](const Range& range) {
+        std::vector<float> mapRow(mapSize.width), bestValue(size.width);
+        std::vector<int> bestIndex(size.width);
+
+        for (int y = range.start; y < range.end; y++) {
+            if (isCancelled(control)) return;
+
+            const int y0 = mapY[y];
+            const int y1 = std::min(y0 + 1, mapSize.height - 1);
+            const float fy = fractionY[y];
+
+            for (int i = 0; i < (int)sharpness.size(); i++) {
+                // vertical interpolation once per map row, then horizontal per pixel
+                const float* row0 = sharpness[i].ptr<float>(y0);
+                const float* row1 = sharpness[i].ptr<float>(y1);
+                for (int x = 0; x < mapSize.width; x++)
+                    mapRow[x] = row0[x] + (row1[x] - row0[x]) * fy;
+
+                for (int x = 0; x < size.width; x++) {
+                    const float* value = mapRow.data() + mapX[x];
+                    float interpolated = value[0] + (value[mapStep] - value[0]) * fractionX[x];
+                    if (0 == i || bestValue[x] < interpolated) {
+                        bestValue[x] = interpolated;
+                        bestIndex[x] = i;
+                    }
+                }
+            }
+
+            Pixel* output = outputImage.ptr<Pixel>(y);
+            for (int x = 0; x < size.width; x++)
+                output[x] = images[bestIndex[x]].ptr<Pixel>(y)[x];
+        }
+
+        progress.advance(range.end - range.start);
+    });
+
+    return !isCancelled(control);
+}
+
+
+// Number of levels so the coarsest level is still at least 16 pixels
+static
+int pyramidLevels(const Size& size, int maxLevels) {
+    int levels = 0;
+    int minSize = std::min(size.width, size.height);
+    while (levels < maxLevels && (minSize >> (levels + 1)) >= 16)
+        levels++;
+    return levels;
+}
+
+
+// Local energy: sum of the absolute values of the channels, smoothed
+static
+void localEnergy(const Mat& laplacian, Mat& energy) {
+    Mat absolute, sum;
+    absolute = abs(laplacian);
+    transform(absolute, sum, Matx13f(1.0f, 1.0f, 1.0f));
+    sum.convertTo(energy, CV_16U);
+    GaussianBlur(energy, energy, Size(5, 5), 0.0);
+}
+
+
+// Where energy > bestEnergy take the coefficients of laplacian
+static
+void selectRow(const short* laplacian, const ushort* energy, short* fused, ushort* bestEnergy, int width) {
+    int x = 0;
+
+#if CV_SIMD
+    const int step = v_int16::nlanes;
+    for (; x <= width - step; x += step) {
+        v_uint16 e = vx_load(energy + x);
+        v_uint16 best = vx_load(bestEnergy + x);
+        v_int16 mask = v_reinterpret_as_s16(e > best);
+
+        v_int16 l0, l1, l2, f0, f1, f2;
+        v_load_deinterleave(laplacian + 3 * x, l0, l1, l2);
+        v_load_deinterleave(fused + 3 * x, f0, f1, f2);
+        v_store_interleave(fused + 3 * x, v_select(mask, l0, f0), v_select(mask, l1, f1), v_select(mask, l2, f2));
+        v_store(bestEnergy + x, v_max(e, best));
+    }
+#endif
+
+    for (; x < width; x++) {
+        if (energy[x] > bestEnergy[x]) {
+            bestEnergy[x] = energy[x];
+            fused[3 * x] = laplacian[3 * x];
+            fused[3 * x + 1] = laplacian[3 * x + 1];
+            fused[3 * x + 2] = laplacian[3 * x + 2];
+        }
+    }
+}
+
+
+bool FocusStackFusion::add(const Mat& frame) {
+    if (frame.empty() || CV_8UC3 != frame.type()) return false;
+    if (count_ > 0 && frame.size() != fused_[0].size()) return false;
+
+    const int levels = pyramidLevels(frame.size(), levels_);
+    std::vector<Mat> laplacian;
+    Mat residual;
+    buildLaplacianPyramid(frame, levels, laplacian, residual);
+
+    if (0 == count_) {
+        fused_ = laplacian;
+        energy_.resize(levels);
+        for (int level = 0; level < levels; level++)
+            localEnergy(laplacian[level], energy_[level]);
+        residual.convertTo(residualSum_, CV_32S);
+        count_ = 1;
+        return true;
+    }
+
+    for (int level = 0; level < levels; level++) {
+        Mat energy;
+        localEnergy(laplacian[level], energy);
+
+        const Mat& levelLaplacian = laplacian[level];
+        Mat& levelFused = fused_[level];
+        Mat& levelBestEnergy = energy_[level];
+
+        parallel_for_(Range(0, levelLaplacian.rows), [&](const Range& range) {
+            for (int y = range.start; y < range.end; y++)
+                selectRow(levelLaplacian.ptr<short>(y), energy.ptr<ushort>(y),
+                          levelFused.ptr<short>(y), levelBestEnergy.ptr<ushort>(y), levelLaplacian.cols);
+        });
+    }
+
+    cv::add(residualSum_, residual, residualSum_, noArray(), CV_32S);
+    count_++;
+    return true;
+}
+
+
+bool FocusStackFusion::result(Mat& output) const {
+    if (count_ <= 0) return false;
+
+    Mat residual;
+    residualSum_.convertTo(residual, CV_16S, 1.0 / count_);
+    collapseLaplacianPyramid(fused_, residual, output);
+    return !output.empty();
+}
+
+
+bool makeFocusStack(const std::vector<Mat>& images, Mat& outputImage, int algorithm, JobControl* control) {
+    if (FOCUS_STACK_SHARPEST == algorithm)
+        return makeFocusStackSharpest(images, outputImage, control);
+
+    if (FOCUS_STACK_PYRAMID != algorithm || images.size() < 2) return false;
+
+    FocusStackFusion fusion;
+
+    {
+        ScopedStage stage("pyramid-fuse");
+        // the collapse is about one more frame
+        JobProgress progress(control, (int)images.size() + 1);
+        for (const auto& image: images) {
+            if (isCancelled(control) || !fusion.add(image))
+                return false;
+            progress.advance();
+        }
+    }
+
+    ScopedStage stage("pyramid-collapse");
+    return !isCancelled(control) && fusion.result(outputImage);
+}
@@ -0,0 +1,48 @@
+#ifndef MERGEPHOTOS_FOCUSSTACK_H
+#define MERGEPHOTOS_FOCUSSTACK_H
+
+#include <vector>
+#include "opencv2/core.hpp"
+#include "job.h"
+
+
+// Same values as Settings.FOCUS_STACK_*
+enum FocusStackAlgorithm {
+    FOCUS_STACK_PYRAMID = 0,
+    FOCUS_STACK_SHARPEST
+};
+
+
+#define FOCUS_STACK_PYRAMID_LEVELS  6
+
+
+// Multi-scale focus stacking: the Laplacian pyramids of the frames are fused, at each level and for each
+// coefficient the frame with the highest local energy wins (no seams, the pyramid blends the transitions).
+// Frames are added one at a time: memory is one frame pyramid + the fused pyramid, whatever the number of frames.
+class FocusStackFusion {
+public:
+    explicit FocusStackFusion(int levels = FOCUS_STACK_PYRAMID_LEVELS) : levels_(levels) {}
+
+    // frame: CV_8UC3, same size for all the frames
+    bool add(const cv::Mat& frame);
+    bool result(cv::Mat& output) const;
+
+    int count() const { return count_; }
+
+private:
+    int levels_;
+    int count_ = 0;
+    std::vector<cv::Mat> fused_;        // Laplacian levels (CV_16SC3)
+    std::vector<cv::Mat> energy_;       // best local energy for each level (CV_16UC1)
+    cv::Mat residualSum_;               // sum of the coarsest Gaussian levels (CV_32SC3)
+};
+
+
+bool makeFocusStack(const std::vector<cv::Mat>& images, cv::Mat& outputImage, int algorithm = FOCUS_STACK_PYRAMID,
+                    JobControl* control = nullptr);
+
+// For each pixel keep the pixel from the sharpest image
+bool makeFocusStackSharpest(const std::vector<cv::Mat>& images, cv::Mat& outputImage, JobControl* control = nullptr);
+
+
+#endif //MERGEPHOTOS_FOCUSSTACK_H
@@ -0,0 +1,140 @@
+#include "framesource.h"
+#include <unistd.h>
+
+
+using namespace cv;
+
+
+// Extra source rows so the interpolation kernel (up to 8 taps for Lanczos4) has all its inputs
+#define BAND_WARP_MARGIN    5
+
+
+// Source rows needed to warp output rows [y, y + rows).
+// Also returns the transform that maps these source rows to the band.
+static
+Range sourceRowsForBand(const Mat& transform, const Size& size, int y, int rows, Mat& bandTransform) {
+    Mat inverse;
+    invertAffineTransform(transform, inverse);
+
+    const Matx23d t(inverse);
+    double minY = size.height, maxY = 0;
+    const double xs[] = {0.0, (double)size.width};
+    const double ys[] = {(double)y, (double)(y + rows)};
+
+    for (double x: xs) {
+        for (double yy: ys) {
+            double sy = t(1, 0) * x + t(1, 1) * yy + t(1, 2);
+            minY = std::min(minY, sy);
+            maxY = std::max(maxY, sy);
+        }
+    }
+
+    int start = std::max(0, cvFloor(minY) - BAND_WARP_MARGIN);
+    int end = std::min(size.height, cvCeil(maxY) + BAND_WARP_MARGIN);
+    if (start >= end) {
+        start = 0;
+        end = 0;
+    }
+
+    // band(x, v) = frame(T^-1(x, v + y)) and source rows start at 'start'
+    Matx23d bt(transform);
+    bt(0, 2) += bt(0, 1) * start;
+    bt(1, 2) += bt(1, 1) * start - y;
+    bandTransform = Mat(bt);
+
+    return Range(start, end);
+}
+
+
+static
+bool warpBand(const Mat& sourceRows, const Mat& bandTransform, const Size& size, int rows, int interpolation, Mat& band) {
+    if (sourceRows.empty()) {
+        band.create(rows, size.width, sourceRows.type());
+        band.setTo(Scalar::all(0));
+        return true;
+    }
+
+    warpAffine(sourceRows, band, bandTransform, Size(size.width, rows), interpolation, BORDER_CONSTANT);
+    return !band.empty();
+}
+
+
+MatFrameSource::MatFrameSource(const Mat& image, const Mat& transform, int interpolation)
+    : image_(image), transform_(transform), interpolation_(interpolation) {
+}
+
+
+bool MatFrameSource::readBand(int y, int rows, Mat& band) {
+    if (y < 0 || rows <= 0 || y + rows > image_.rows) return false;
+
+    if (transform_.empty()) {
+        image_.rowRange(y, y + rows).copyTo(band);
+        return true;
+    }
+
+    Mat bandTransform;
+    Range sourceRows = sourceRowsForBand(transform_, image_.size(), y, rows, bandTransform);
+    Mat source = sourceRows.empty() ? Mat(0, image_.cols, image_.type()) : image_.rowRange(sourceRows);
+    return warpBand(source, bandTransform, image_.size(), rows, interpolation_, band);
+}
+
+
+Ptr<RawFileFrameSource> RawFileFrameSource::create(const Mat& image, const std::string& directory, const Mat& transform, int interpolation) {
+    if (image.empty()) return Ptr<RawFileFrameSource>();
+
+    std::string path = directory + "/frame_XXXXXX";
+    int fd = mkstemp(&path[0]);
+    if (fd < 0) return Ptr<RawFileFrameSource>();
+    unlink(path.c_str());
+
+    FILE* file = fdopen(fd, "w+b");
+    if (nullptr == file) {
+        close(fd);
+        return Ptr<RawFileFrameSource>();
+    }
+
+    const size_t rowSize = image.cols * image.elemSize();
+    for (int y = 0; y < image.rows; y++) {
+        if (rowSize != fwrite(image.ptr(y), 1, rowSize, file)) {
+            fclose(file);
+            return Ptr<RawFileFrameSource>();
+        }
+    }
+
+    return Ptr<RawFileFrameSource>(new RawFileFrameSource(file, image.size(), image.type(), transform, interpolation));
+}
+
+
+RawFileFrameSource::RawFileFrameSource(FILE* file, const Size& size, int type, const Mat& transform, int interpolation)
+    : file_(file), size_(size), type_(type), transform_(transform), interpolation_(interpolation) {
+}
+
+
+RawFileFrameSource::~RawFileFrameSource() {
+    fclose(file_);
+}
+
+
+bool RawFileFrameSource::readRows(int y, int rows, Mat& output) {
+    output.create(rows, size_.width, type_);
+    if (0 == rows) return true;
+
+    const size_t rowSize = size_.width * output.elemSize();
+    if (0 != fseeko(file_, (off_t)y * rowSize, SEEK_SET)) return false;
+
+    // output is continuous: read all rows at once
+    return rows * rowSize == fread(output.ptr(), 1, rows * rowSize, file_);
+}
+
+
+bool RawFileFrameSource::readBand(int y, int rows, Mat& band) {
+    if (y < 0 || rows <= 0 || y + rows > size_.height) return false;
+
+    if (transform_.empty())
+        return readRows(y, rows, band);
+
+    Mat bandTransform, source;
+    Range sourceRows = sourceRowsForBand(transform_, size_, y, rows, bandTransform);
+    if (!readRows(sourceRows.start, sourceRows.size(), source)) return false;
+    return warpBand(source, bandTransform, size_, rows, interpolation_, band);
+}
@@ -0,0 +1,66 @@
+#ifndef MERGEPHOTOS_FRAMESOURCE_H
+#define MERGEPHOTOS_FRAMESOURCE_H
+
+#include <cstdio>
+#include <string>
+#include "opencv2/core.hpp"
+#include "opencv2/imgproc.hpp"
+
+
+// A frame that can be read one horizontal band at a time.
+// If the frame has an alignment transform the band is returned already aligned.
+class FrameSource {
+public:
+    virtual ~FrameSource() {}
+
+    virtual cv::Size size() const = 0;
+    virtual int type() const = 0;
+
+    // Reads rows [y, y + rows) of the (aligned) frame
+    virtual bool readBand(int y, int rows, cv::Mat& band) = 0;
+};
+
+
+// Reads bands from an in-memory image. Only the band is warped, the aligned frame is never allocated.
+class MatFrameSource : public FrameSource {
+public:
+    // transform: 2x3 affine transform as used by warpAffine (empty = not aligned)
+    explicit MatFrameSource(const cv::Mat& image, const cv::Mat& transform = cv::Mat(), int interpolation = cv::INTER_LANCZOS4);
+
+    cv::Size size() const override { return image_.size(); }
+    int type() const override { return image_.type(); }
+    bool readBand(int y, int rows, cv::Mat& band) override;
+
+private:
+    cv::Mat image_;
+    cv::Mat transform_;
+    int interpolation_;
+};
+
+
+// The frame is spilled to a raw file and only the rows needed by a band are read back.
+// The image can be released as soon as the source is created.
+class RawFileFrameSource : public FrameSource {
+public:
+    // The file is created in directory and unlinked right away: it disappears with the source (or the process)
+    static cv::Ptr<RawFileFrameSource> create(const cv::Mat& image, const std::string& directory,
+                                              const cv::Mat& transform = cv::Mat(), int interpolation = cv::INTER_LANCZOS4);
+    ~RawFileFrameSource() override;
+
+    cv::Size size() const override { return size_; }
+    int type() const override { return type_; }
+    bool readBand(int y, int rows, cv::Mat& band) override;
+
+private:
+    RawFileFrameSource(FILE* file, const cv::Size& size, int type, const cv::Mat& transform, int interpolation);
+    bool readRows(int y, int rows, cv::Mat& output);
+
+    FILE* file_;
+    cv::Size size_;
+    int type_;
+    cv::Mat transform_;
+    int interpolation_;
+};
+
+
+#endif //MERGEPHOTOS_FRAMESOURCE_H
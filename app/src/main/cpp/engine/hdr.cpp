@@ -0,0 +1,295 @@
+#include "hdr.h"
+#include <algorithm>
+#include <cmath>
+#include "common.h"
+#include "profile.h"
+#include "pyramid.h"
+#include "opencv2/imgproc.hpp"
+#include "opencv2/core/hal/intrin.hpp"
+
+
+using namespace cv;
+
+
+// Same as cv::MergeMertens
+#define HDR_WELL_EXPOSED_SIGMA      0.2f
+#define HDR_MIN_WEIGHT              1e-12f
+
+
+static inline
+int reflect101(int index, int size) {
+    if (size <= 1) return 0;
+    if (index < 0) return -index;
+    if (index >= size) return 2 * size - 2 - index;
+    return index;
+}
+
+
+static
+void grayRow(const Pixel* pixels, int width, float* gray) {
+    for (int x = 0; x < width; x++)
+        gray[x] = (0.299f * pixels[x].x + 0.587f * pixels[x].y + 0.114f * pixels[x].z) * (1.0f / 255.0f);
+}
+
+
+// Intensity of the reference frame with the same rank as each intensity of the frame
+static
+void matchHistogram(const Mat& gray, const Mat& referenceGray, Mat& lut) {
+    const int channels[] = {0};
+    const int histSize[] = {256};
+    const float range[] = {0.0f, 256.0f};
+    const float* ranges[] = {range};
+    Mat hist, referenceHist;
+    calcHist(&gray, 1, channels, Mat(), hist, 1, histSize, ranges);
+    calcHist(&referenceGray, 1, channels, Mat(), referenceHist, 1, histSize, ranges);
+
+    lut.create(1, 256, CV_8U);
+    double cdf = 0.0, referenceCdf = referenceHist.at<float>(0);
+    for (int v = 0, u = 0; v < 256; v++) {
+        cdf += hist.at<float>(v);
+        while (u < 255 && referenceCdf < cdf) referenceCdf += referenceHist.at<float>(++u);
+        lut.at<uchar>(v) = (uchar)u;
+    }
+}
+
+
+void consistencyMasks(const std::vector<Mat>& images, std::vector<Mat>& masks) {
+    const int count = (int)images.size();
+    masks.assign(count, Mat());
+    if (count < 2) return;
+
+    const Size size = images[0].cols > HDR_DEGHOST_SIZE || images[0].rows > HDR_DEGHOST_SIZE
+                      ? scaledSize(images[0].size(), HDR_DEGHOST_SIZE) : images[0].size();
+    std::vector<Mat> grays(count);
+    std::vector<double> exposed(count);
+
+    parallel_for_(Range(0, count), [&](const Range& range) {
+        for (int i = range.start; i < range.end; i++) {
+            Mat small, intensity;
+            resize(images[i], small, size, 0.0, 0.0, INTER_AREA);
+            cvtColor(small, grays[i], COLOR_RGB2GRAY);
+
+            // well-exposedness of the whole frame
+            grays[i].convertTo(intensity, CV_32F, 1.0 / 255.0, -0.5);
+            multiply(intensity, intensity, intensity, -1.0 / (2.0 * HDR_WELL_EXPOSED_SIGMA * HDR_WELL_EXPOSED_SIGMA));
+            exp(intensity, intensity);
+            exposed[i] = sum(intensity)[0];
+        }
+    });
+
+    const int reference = (int)(std::max_element(exposed.begin(), exposed.end()) - exposed.begin());
+    const Mat& referenceGray = grays[reference];
+    const float differenceScale = -1.0f / (2.0f * HDR_DEGHOST_SIGMA * HDR_DEGHOST_SIGMA);
+
+    parallel_for_(Range(0, count), [&](const Range& range) {
+        for (int i = range.start; i < range.end; i++) {
+            if (reference == i) continue;
+
+            Mat lut, matched;
+            matchHistogram(grays[i], referenceGray, lut);
+            LUT(grays[i], lut, matched);
+
+            Mat& mask = masks[i];
+            mask.create(size, CV_32F);
+            for (int y = 0; y < size.height; y++) {
+                const uchar* frame = grays[i].ptr<uchar>(y);
+                const uchar* normalized = matched.ptr<uchar>(y);
+                const uchar* ref = referenceGray.ptr<uchar>(y);
+                float* m = mask.ptr<float>(y);
+                for (int x = 0; x < size.width; x++) {
+                    const bool comparable = frame[x] >= HDR_DEGHOST_CLIP && frame[x] <= 255 - HDR_DEGHOST_CLIP
+                                            && ref[x] >= HDR_DEGHOST_CLIP && ref[x] <= 255 - HDR_DEGHOST_CLIP;
+                    const float difference = (normalized[x] - ref[x]) * (1.0f / 255.0f);
+                    m[x] = comparable ? std::exp(difference * difference * differenceScale) : 1.0f;
+                }
+            }
+
+            // a moving object is rejected with its edges, and without a hard transition
+            erode(mask, mask, getStructuringElement(MORPH_RECT, Size(5, 5)));
+            GaussianBlur(mask, mask, Size(7, 7), 0.0);
+        }
+    });
+}
+
+
+void exposureWeights(const Mat& frame, Mat& weight, const Mat& consistency) {
+    weight.create(frame.size(), CV_32F);
+    const int width = frame.cols, height = frame.rows;
+    const float exposedScale = -1.0f / (2.0f * HDR_WELL_EXPOSED_SIGMA * HDR_WELL_EXPOSED_SIGMA);
+
+    // the low resolution mask is sampled for each row, never upscaled
+    const Size maskSize = consistency.size();
+    const int maskStep = maskSize.width > 1 ? 1 : 0;
+    std::vector<int> maskX, maskY;
+    std::vector<float> fractionX, fractionY;
+    if (!consistency.empty()) {
+        bilinearCoordinates(width, maskSize.width, maskX, fractionX);
+        bilinearCoordinates(height, maskSize.height, maskY, fractionY);
+    }
+
+    parallel_for_(Range(0, height), [&](const Range& range) {
+        std::vector<float> above(width), center(width), below(width), maskRow(maskSize.width);
+
+        for (int y = range.start; y < range.end; y++) {
+            // contrast: Laplacian (3x3, BORDER_REFLECT_101) of the gray image, as cv::Laplacian with ksize 1
+            const Pixel* pixels = frame.ptr<Pixel>(y);
+            grayRow(frame.ptr<Pixel>(reflect101(y - 1, height)), width, above.data());
+            grayRow(pixels, width, center.data());
+            grayRow(frame.ptr<Pixel>(reflect101(y + 1, height)), width, below.data());
+
+            float* w = weight.ptr<float>(y);
+            for (int x = 0; x < width; x++) {
+                const float laplacian = above[x] + below[x] + center[reflect101(x - 1, width)]
+                                        + center[reflect101(x + 1, width)] - 4.0f * center[x];
+
+                const float r = pixels[x].x * (1.0f / 255.0f);
+                const float g = pixels[x].y * (1.0f / 255.0f);
+                const float b = pixels[x].z * (1.0f / 255.0f);
+                const float mean = (r + g + b) * (1.0f / 3.0f);
+                const float saturation = std::sqrt((r - mean) * (r - mean) + (g - mean) * (g - mean) + (b - mean) * (b - mean));
+                const float exposed = std::exp(((r - 0.5f) * (r - 0.5f) + (g - 0.5f) * (g - 0.5f) + (b - 0.5f) * (b - 0.5f))
+                                               * exposedScale);
+
+                w[x] = std::fabs(laplacian) * saturation * exposed + HDR_MIN_WEIGHT;
+            }
+
+            if (consistency.empty()) continue;
+
+            const float* row0 = consistency.ptr<float>(maskY[y]);
+            const float* row1 = consistency.ptr<float>(std::min(maskY[y] + 1, maskSize.height - 1));
+            for (int x = 0; x < maskSize.width; x++)
+                maskRow[x] = row0[x] + (row1[x] - row0[x]) * fractionY[y];
+
+            for (int x = 0; x < width; x++) {
+                const float* value = maskRow.data() + maskX[x];
+                w[x] *= value[0] + (value[maskStep] - value[0]) * fractionX[x];
+            }
+        }
+    });
+}
+
+
+// fused += laplacian * weight, weight in HDR_WEIGHT_BITS fixed point (one weight for the 3 channels)
+static
+void accumulateRow(const short* laplacian, const short* weight, short* fused, int width) {
+    const int half = 1 << (HDR_WEIGHT_BITS - 1);
+    int x = 0;
+
+#if CV_SIMD
+    const int step = v_int16::nlanes;
+    const v_int32 vHalf = vx_setall_s32(half);
+    auto weighted = [&vHalf](const v_int16& l, const v_int16& w) {
+        v_int32 low, high;
+        v_mul_expand(l, w, low, high);
+        return v_pack((low + vHalf) >> HDR_WEIGHT_BITS, (high + vHalf) >> HDR_WEIGHT_BITS);
+    };
+
+    for (; x <= width - step; x += step) {
+        v_int16 w = vx_load(weight + x);
+        v_int16 l0, l1, l2, f0, f1, f2;
+        v_load_deinterleave(laplacian + 3 * x, l0, l1, l2);
+        v_load_deinterleave(fused + 3 * x, f0, f1, f2);
+        v_store_interleave(fused + 3 * x, f0 + weighted(l0, w), f1 + weighted(l1, w), f2 + weighted(l2, w));
+    }
+#endif
+
+    for (; x < width; x++) {
+        const int w = weight[x];
+        for (int c = 0; c < 3; c++) {
+            const int product = saturate_cast<short>((laplacian[3 * x + c] * w + half) >> HDR_WEIGHT_BITS);
+            fused[3 * x + c] = saturate_cast<short>(fused[3 * x + c] + product);
+        }
+    }
+}
+
+
+static
+void accumulateLevel(const Mat& laplacian, const Mat& weight, Mat& fused) {
+    parallel_for_(Range(0, laplacian.rows), [&](const Range& range) {
+        for (int y = range.start; y < range.end; y++)
+            accumulateRow(laplacian.ptr<short>(y), weight.ptr<short>(y), fused.ptr<short>(y), laplacian.cols);
+    });
+}
+
+
+bool ExposureFusion::add(const Mat& frame, const Mat& weight) {
+    if (frame.empty() || CV_8UC3 != frame.type() || CV_16SC1 != weight.type() || weight.size() != frame.size())
+        return false;
+    if (count_ > 0 && frame.size() != fused_[0].size()) return false;
+
+    // as deep as cv::MergeMertens: the coarsest levels blend the exposures globally
+    const int levels = std::max(0, (int)std::log2((double)std::min(frame.cols, frame.rows)));
+
+    std::vector<Mat> laplacian, weights;
+    Mat residual;
+    buildLaplacianPyramid(frame, levels, laplacian, residual, HDR_PYRAMID_BITS);
+    buildPyramid(weight, weights, levels);
+
+    if (0 == count_) {
+        fused_.resize(levels);
+        for (int level = 0; level < levels; level++)
+            fused_[level] = Mat::zeros(laplacian[level].size(), CV_16SC3);
+        residual_ = Mat::zeros(residual.size(), CV_16SC3);
+    }
+
+    for (int level = 0; level < levels; level++)
+        accumulateLevel(laplacian[level], weights[level], fused_[level]);
+    accumulateLevel(residual, weights[levels], residual_);
+
+    count_++;
+    return true;
+}
+
+
+bool ExposureFusion::result(Mat& output) const {
+    if (count_ <= 0) return false;
+    collapseLaplacianPyramid(fused_, residual_, output, HDR_PYRAMID_BITS);
+    return !output.empty();
+}
+
+
+bool makeHdr(const std::vector<Mat>& images, Mat& outputImage, bool deghost, JobControl* control) {
+    if (images.size() < 2) return false;
+
+    for (const auto& image: images) {
+        if (image.empty() || CV_8UC3 != image.type() || image.size() != images[0].size()) return false;
+    }
+
+    // the weights are computed twice instead of keeping one float map per frame
+    JobProgress progress(control, 3 * (int)images.size() + 1);
+    Mat weight, weightSum = Mat::zeros(images[0].size(), CV_32F);
+
+    // low resolution only: the masks modulate the weights when they are computed
+    std::vector<Mat> consistency(images.size());
+    if (deghost) {
+        ScopedStage stage("hdr-deghost");
+        consistencyMasks(images, consistency);
+    }
+
+    {
+        ScopedStage stage("hdr-weights");
+        for (size_t i = 0; i < images.size(); i++) {
+            if (isCancelled(control)) return false;
+            exposureWeights(images[i], weight, consistency[i]);
+            weightSum += weight;
+            progress.advance();
+        }
+    }
+
+    ExposureFusion fusion;
+
+    {
+        ScopedStage stage("hdr-fuse");
+        Mat normalized;
+        for (size_t i = 0; i < images.size(); i++) {
+            if (isCancelled(control)) return false;
+            exposureWeights(images[i], weight, consistency[i]);
+            divide(weight, weightSum, normalized, (double)(1 << HDR_WEIGHT_BITS), CV_16S);
+            if (!fusion.add(images[i], normalized)) return false;
+            progress.advance(2);
+        }
+    }
+
+    ScopedStage stage("hdr-collapse");
+    return !isCancelled(control) && fusion.result(outputImage);
+}
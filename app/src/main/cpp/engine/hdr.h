@@ -0,0 +1,51 @@
+#ifndef MERGEPHOTOS_HDR_H
+#define MERGEPHOTOS_HDR_H
+
+#include <vector>
+#include "opencv2/core.hpp"
+#include "job.h"
+
+
+#define HDR_WEIGHT_BITS     14      // fixed point weights: 1 << HDR_WEIGHT_BITS is 1.0
+#define HDR_PYRAMID_BITS    4       // fraction bits of the pyramids: each frame rounds its weighted levels
+#define HDR_DEGHOST_SIZE    400     // consistency masks resolution (largest side, in pixels)
+#define HDR_DEGHOST_SIGMA   0.1f    // tolerated difference after exposure normalization (intensities 0 .. 1)
+#define HDR_DEGHOST_CLIP    10      // darker / brighter (255 - HDR_DEGHOST_CLIP) pixels can't be compared
+
+
+// Consistency of each frame with the reference frame (the best exposed one), at low resolution:
+// the frame intensities are mapped on the reference ones (histogram matching) and compared.
+// CV_32F in [0, 1] (1: same content as the reference), empty for the reference frame.
+void consistencyMasks(const std::vector<cv::Mat>& images, std::vector<cv::Mat>& masks);
+
+// Mertens exposure weight of each pixel (contrast x saturation x well-exposedness, same as cv::MergeMertens
+// with unit exponents): CV_32F, not normalized.
+// If consistency is not empty (any resolution, CV_32F) the weights are multiplied by it (upsampled, bilinear).
+void exposureWeights(const cv::Mat& frame, cv::Mat& weight, const cv::Mat& consistency = cv::Mat());
+
+// Exposure fusion (Mertens) into a running pyramid: the Laplacian pyramid of each frame is weighted by the
+// Gaussian pyramid of its normalized weight and added to the fused pyramid.
+// Frames are added one at a time: memory is one frame pyramid + the fused pyramid, whatever the number of frames.
+// Everything is fixed point: CV_16S pyramids with HDR_PYRAMID_BITS fraction bits and HDR_WEIGHT_BITS weights.
+class ExposureFusion {
+public:
+    // frame: CV_8UC3, weight: CV_16S normalized weight (the weights of a pixel add up to 1 << HDR_WEIGHT_BITS)
+    bool add(const cv::Mat& frame, const cv::Mat& weight);
+    bool result(cv::Mat& output) const;
+
+    int count() const { return count_; }
+
+private:
+    int count_ = 0;
+    std::vector<cv::Mat> fused_;        // Laplacian levels (CV_16SC3)
+    cv::Mat residual_;                  // coarsest Gaussian level (CV_16SC3)
+};
+
+
+// The frames are read twice: once for the weight sum, once to fuse them with their normalized weights.
+// deghost: the pixels that moved compared to the reference frame get (almost) no weight
+bool makeHdr(const std::vector<cv::Mat>& images, cv::Mat& outputImage, bool deghost = true,
+             JobControl* control = nullptr);
+
+
+#endif //MERGEPHOTOS_HDR_H
@@ -0,0 +1,204 @@
+#include "imageio.h"
+#include <cerrno>
+#include <functional>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "profile.h"
+#include "opencv2/imgcodecs.hpp"
+#include "opencv2/imgproc.hpp"
+
+
+using namespace cv;
+
+
+static
+void swapRedBlue(Mat& image) {
+    parallel_for_(Range(0, image.rows), [&](const Range& range) {
+        for (int y = range.start; y < range.end; y++) {
+            uchar* pixel = image.ptr<uchar>(y);
+            for (int x = 0; x < image.cols; x++, pixel += 3)
+                std::swap(pixel[0], pixel[2]);
+        }
+    });
+}
+
+
+bool writeJpeg(const std::string& path, Mat& image, int quality) {
+    if (image.empty() || CV_8UC3 != image.type()) return false;
+
+    ScopedStage stage("write-jpeg");
+    swapRedBlue(image);
+
+    bool success = false;
+    try {
+        success = imwrite(path, image, { IMWRITE_JPEG_QUALITY, quality });
+    } catch (const cv::Exception&) {
+        success = false;
+    }
+
+    swapRedBlue(image);
+    return success;
+}
+
+
+// The whole (compressed) file: imdecode needs it in memory
+static
+bool readFile(int fd, std::vector<uchar>& data) {
+    struct stat info;
+    if (fd < 0 || 0 != fstat(fd, &info) || info.st_size <= 0) return false;
+
+    data.resize((size_t)info.st_size);
+    size_t offset = 0;
+    while (offset < data.size()) {
+        const ssize_t count = pread(fd, data.data() + offset, data.size() - offset, (off_t)offset);
+        if (count < 0 && EINTR == errno) continue;
+        if (count <= 0) return false;
+        offset += (size_t)count;
+    }
+
+    return true;
+}
+
+
+static
+bool decodeImage(const std::vector<uchar>& data, int flags, Mat& image) {
+    try {
+        image = imdecode(data, flags | IMREAD_IGNORE_ORIENTATION);
+    } catch (const cv::Exception&) {
+        image.release();
+    }
+
+    if (image.empty() || CV_8UC3 != image.type()) {
+        image.release();
+        return false;
+    }
+
+    swapRedBlue(image);
+    return true;
+}
+
+
+bool readImage(int fd, Mat& image) {
+    image.release();
+
+    std::vector<uchar> data;
+    return readFile(fd, data) && decodeImage(data, IMREAD_COLOR, image);
+}
+
+
+// Decodes the files in parallel, one per stripe: the decoder is sequential, the files are independent
+static
+bool readFiles(const std::vector<int>& fds, std::vector<Mat>& images, JobControl* control,
+               const std::function<void (int fd, Mat& image)>& read) {
+    images.assign(fds.size(), Mat());
+    JobProgress progress(control, (int)fds.size());
+
+    parallel_for_(Range(0, (int)fds.size()), [&](const Range& range) {
+        for (int i = range.start; i < range.end; i++) {
+            if (isCancelled(control)) return;
+            read(fds[i], images[i]);
+            progress.advance();
+        }
+    }, (double)fds.size());
+
+    return !isCancelled(control);
+}
+
+
+bool readImages(const std::vector<int>& fds, std::vector<Mat>& images, JobControl* control) {
+    ScopedStage stage("read-images");
+    return readFiles(fds, images, control, [](int fd, Mat& image) { readImage(fd, image); });
+}
+
+
+Size previewSize(const Size& size, int maxSize) {
+    Size preview = size.height < size.width
+                   ? Size(maxSize, maxSize * size.height / size.width)
+                   : Size(maxSize * size.width / size.height, maxSize);
+    return size.width <= preview.width && size.height <= preview.height ? size : preview;
+}
+
+
+static inline
+int bigEndian16(const uchar* data) {
+    return (data[0] << 8) | data[1];
+}
+
+
+// Image size from the JPEG frame header (SOFn), without decoding anything.
+// False if data is not a JPEG file.
+static
+bool jpegSize(const std::vector<uchar>& data, Size& size) {
+    if (data.size() < 4 || 0xFF != data[0] || 0xD8 != data[1]) return false;
+
+    size_t position = 2;
+    while (position + 4 <= data.size()) {
+        if (0xFF != data[position]) return false;
+        const uchar marker = data[position + 1];
+
+        // fill bytes and markers without a segment
+        if (0xFF == marker || 0x01 == marker || (marker >= 0xD0 && marker <= 0xD7)) {
+            position += 0xFF == marker ? 1 : 2;
+            continue;
+        }
+
+        // the frame header comes before the scan
+        if (0xD9 == marker || 0xDA == marker) return false;
+
+        const int length = bigEndian16(&data[position + 2]);
+        const bool frame = marker >= 0xC0 && marker <= 0xCF && 0xC4 != marker && 0xC8 != marker && 0xCC != marker;
+        if (frame) {
+            if (length < 7 || position + 9 > data.size()) return false;
+            size = Size(bigEndian16(&data[position + 7]), bigEndian16(&data[position + 5]));
+            return size.width > 0 && size.height > 0;
+        }
+
+        position += 2 + length;
+    }
+
+    return false;
+}
+
+
+bool readImagePreview(int fd, int maxSize, Mat& preview) {
+    preview.release();
+
+    std::vector<uchar> data;
+    if (!readFile(fd, data)) return false;
+
+    // the largest IDCT scale that still gives at least the preview size (the decoder rounds up)
+    Size size;
+    int flags = IMREAD_COLOR;
+    if (jpegSize(data, size)) {
+        const Size target = previewSize(size, maxSize);
+        const std::pair<int, int> reductions[] = {
+            {8, IMREAD_REDUCED_COLOR_8}, {4, IMREAD_REDUCED_COLOR_4}, {2, IMREAD_REDUCED_COLOR_2} };
+        for (const auto& reduction: reductions) {
+            const int scale = reduction.first;
+            if ((size.width + scale - 1) / scale >= target.width && (size.height + scale - 1) / scale >= target.height) {
+                flags = reduction.second;
+                break;
+            }
+        }
+    }
+
+    Mat image;
+    if (!decodeImage(data, flags, image)) return false;
+    data = std::vector<uchar>();
+
+    // the ratio of the full size image, not of the (rounded up) reduced one
+    const Size target = previewSize(size.area() > 0 ? size : image.size(), maxSize);
+    if (target == image.size()) {
+        preview = image;
+    } else {
+        resize(image, preview, target, 0.0, 0.0, INTER_LANCZOS4);
+    }
+
+    return true;
+}
+
+
+bool readImagePreviews(const std::vector<int>& fds, int maxSize, std::vector<Mat>& previews, JobControl* control) {
+    ScopedStage stage("read-previews");
+    return readFiles(fds, previews, control, [maxSize](int fd, Mat& preview) { readImagePreview(fd, maxSize, preview); });
+}
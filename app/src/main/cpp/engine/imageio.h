@@ -0,0 +1,38 @@
+#ifndef MERGEPHOTOS_IMAGEIO_H
+#define MERGEPHOTOS_IMAGEIO_H
+
+#include <string>
+#include <vector>
+#include "opencv2/core.hpp"
+#include "job.h"
+
+
+// Saves an RGB image (the app channel order) as JPEG without a converted copy: the channels are
+// swapped in place for the encoder, which reads the image one scanline at a time, and swapped back.
+// Works for file-backed images much larger than the available memory.
+bool writeJpeg(const std::string& path, cv::Mat& image, int quality);
+
+// Decodes an image file (any format imgcodecs reads) from an open file descriptor straight to RGB CV_8UC3:
+// no RGBA bitmap, the channels are swapped in place. The EXIF orientation is ignored (same as BitmapFactory).
+// The descriptor is read with pread: its offset doesn't change and it stays open.
+bool readImage(int fd, cv::Mat& image);
+
+// readImage for each descriptor, the files decoded in parallel (one per thread).
+// images has one Mat per descriptor, empty if the file can't be read or decoded.
+bool readImages(const std::vector<int>& fds, std::vector<cv::Mat>& images, JobControl* control = nullptr);
+
+// Size of the preview of an image: the largest side becomes maxSize (never upscaled), the other one is rounded down.
+// Same as MainFragment.createSmallImage, so the preview and the full size image keep the same ratio.
+cv::Size previewSize(const cv::Size& size, int maxSize);
+
+// Decodes the preview (previewSize) of an image file. JPEG files are decoded with the scaled IDCT
+// (1/2, 1/4 or 1/8, the smallest still at least the preview size, from the frame header) and only this
+// small image is resized (Lanczos4); other formats are decoded at full size, then resized.
+bool readImagePreview(int fd, int maxSize, cv::Mat& preview);
+
+// readImagePreview for each descriptor, in parallel (same as readImages)
+bool readImagePreviews(const std::vector<int>& fds, int maxSize, std::vector<cv::Mat>& previews,
+                       JobControl* control = nullptr);
+
+
+#endif //MERGEPHOTOS_IMAGEIO_H
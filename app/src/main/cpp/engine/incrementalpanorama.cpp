@@ -0,0 +1,379 @@
+#include "incrementalpanorama.h"
+#include <algorithm>
+#include <cmath>
+#include "profile.h"
+#include "opencv2/imgproc.hpp"
+
+
+using namespace cv;
+
+
+static
+void scaleK(Mat& K, double scale) {
+    K.at<float>(0, 0) *= (float)scale;
+    K.at<float>(0, 2) *= (float)scale;
+    K.at<float>(1, 1) *= (float)scale;
+    K.at<float>(1, 2) *= (float)scale;
+}
+
+
+static
+Rect expand(const Rect& rect, int border) {
+    return Rect(rect.x - border, rect.y - border, rect.width + 2 * border, rect.height + 2 * border);
+}
+
+
+static
+Rect unite(const Rect& a, const Rect& b) {
+    if (a.empty()) return b;
+    if (b.empty()) return a;
+    return a | b;
+}
+
+
+IncrementalPanorama::IncrementalPanorama(int projection, int quality)
+    : projection_(projection), profile_(panoramaQualityProfile(quality)) {
+    // same as the Stitcher panorama preset
+    finder_ = ORB::create();
+    matcher_ = makePtr<detail::BestOf2NearestMatcher>(false);
+}
+
+
+int IncrementalPanorama::count() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return (int)frames_.size();
+}
+
+
+bool IncrementalPanorama::panorama(Mat& output) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (canvas_.empty()) return false;
+    canvas_.copyTo(output);
+    return true;
+}
+
+
+Rect IncrementalPanorama::updated() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return updated_;
+}
+
+
+bool IncrementalPanorama::add(const Mat& image, JobControl* control) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return addFrame(image, control) && composePending(control);
+}
+
+
+bool IncrementalPanorama::update(const std::vector<Mat>& images, JobControl* control) {
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    for (size_t i = frames_.size(); i < images.size(); i++) {
+        if (!addFrame(images[i], control)) return false;
+    }
+
+    // the regions of all the new frames are composed once
+    return composePending(control);
+}
+
+
+std::vector<detail::MatchesInfo> IncrementalPanorama::pairwiseMatches(
+        const std::vector<int>& frames, const std::map<std::pair<int, int>, detail::MatchesInfo>& newMatches) const {
+    // Same layout as FeaturesMatcher: n x n, the (j, i) matches are the dual of the (i, j) ones
+    const int n = (int)frames.size();
+    std::vector<detail::MatchesInfo> pairwise(n * n);
+
+    for (int a = 0; a < n; a++) {
+        for (int b = 0; b < n; b++) {
+            if (a == b) continue;
+
+            const bool dual = frames[a] > frames[b];
+            const std::pair<int, int> key = dual ? std::make_pair(frames[b], frames[a]) : std::make_pair(frames[a], frames[b]);
+            auto it = matches_.find(key);
+            if (matches_.end() == it) {
+                it = newMatches.find(key);
+                if (newMatches.end() == it) continue;
+            }
+
+            detail::MatchesInfo& info = pairwise[a * n + b];
+            info = it->second;
+            info.src_img_idx = a;
+            info.dst_img_idx = b;
+
+            if (dual) {
+                if (!info.H.empty()) info.H = info.H.inv();
+                for (auto& match: info.matches)
+                    std::swap(match.queryIdx, match.trainIdx);
+            }
+        }
+    }
+
+    return pairwise;
+}
+
+
+bool IncrementalPanorama::addFrame(const Mat& image, JobControl* control) {
+    if (image.empty() || CV_8UC3 != image.type()) return false;
+    if (!frames_.empty() && image.size() != frames_[0].image.size()) return false;
+    if (isCancelled(control)) return false;
+
+    if (frames_.empty()) {
+        workScale_ = std::min(1.0, std::sqrt(PANORAMA_REGISTRATION_MEGAPIXELS * 1e6 / image.size().area()));
+        seamScale_ = std::min(1.0, std::sqrt(profile_.seamMegapixels * 1e6 / image.size().area()));
+    }
+
+    const int index = (int)frames_.size();
+    Frame frame;
+    frame.image = image;
+
+    {
+        ScopedStage stage("incremental-features");
+        Mat work;
+        resize(image, work, Size(), workScale_, workScale_, INTER_LINEAR_EXACT);
+        detail::computeImageFeatures(finder_, work, frame.features);
+        frame.features.img_idx = index;
+    }
+
+    if (0 == index) {
+        frames_.push_back(frame);
+        return true;
+    }
+
+    // only against the last frames: the cost doesn't depend on the number of frames
+    std::map<std::pair<int, int>, detail::MatchesInfo> matches;
+    int best = -1;
+    double bestConfidence = 0.0;
+
+    {
+        ScopedStage stage("incremental-match");
+        for (int i = std::max(0, index - INCREMENTAL_PANORAMA_NEIGHBOURS); i < index; i++) {
+            if (isCancelled(control)) return false;
+
+            detail::MatchesInfo info;
+            (*matcher_)(frames_[i].features, frame.features, info);
+            info.src_img_idx = i;
+            info.dst_img_idx = index;
+            if (info.confidence < PANORAMA_CONFIDENCE) continue;
+
+            if (info.confidence > bestConfidence) {
+                best = i;
+                bestConfidence = info.confidence;
+            }
+            matches[std::make_pair(i, index)] = info;
+        }
+    }
+
+    if (best < 0) return false;     // doesn't overlap the last frames
+
+    const int first = std::max(0, index - INCREMENTAL_PANORAMA_WINDOW + 1);
+    std::vector<int> window;
+    std::vector<detail::ImageFeatures> features;
+    for (int i = first; i < index; i++) {
+        window.push_back(i);
+        features.push_back(frames_[i].features);
+    }
+    window.push_back(index);
+    features.push_back(frame.features);
+
+    const std::vector<detail::MatchesInfo> pairwise = pairwiseMatches(window, matches);
+    std::vector<detail::CameraParams> cameras;
+
+    {
+        ScopedStage stage("incremental-adjust");
+
+        if (1 == index) {
+            // first pair: same initial estimation as Stitcher
+            detail::HomographyBasedEstimator estimator;
+            if (!estimator(features, pairwise, cameras)) return false;
+            for (auto& camera: cameras) {
+                Mat R;
+                camera.R.convertTo(R, CV_32F);
+                camera.R = R;
+            }
+        } else {
+            for (int i = first; i < index; i++)
+                cameras.push_back(frames_[i].camera);
+
+            // Same as HomographyBasedEstimator (the homographies are estimated on centered points)
+            const detail::CameraParams& from = frames_[best].camera;
+            const detail::MatchesInfo& info = matches[std::make_pair(best, index)];
+            Mat_<double> K = Mat::eye(3, 3, CV_64F);
+            K(0, 0) = from.focal;
+            K(1, 1) = from.focal * from.aspect;
+
+            Mat_<double> fromR;
+            from.R.convertTo(fromR, CV_64F);
+            Mat R;
+            Mat(fromR * K.inv() * info.H.inv() * K).convertTo(R, CV_32F);
+
+            detail::CameraParams camera = from;
+            camera.R = R;
+            camera.ppx = frame.features.img_size.width * 0.5;
+            camera.ppy = frame.features.img_size.height * 0.5;
+            cameras.push_back(camera);
+        }
+
+        if (isCancelled(control)) return false;
+
+        const Mat anchorR = cameras[0].R.clone();
+
+        detail::BundleAdjusterRay adjuster;
+        adjuster.setConfThresh(PANORAMA_CONFIDENCE);
+        if (!adjuster(features, pairwise, cameras)) return false;
+
+        // The adjustment is free to rotate the whole window: rotate it back on the anchor
+        Mat anchorAdjustedR;
+        cameras[0].R.convertTo(anchorAdjustedR, CV_32F);
+        const Mat correction = anchorR * anchorAdjustedR.t();
+        for (auto& camera: cameras) {
+            Mat R;
+            camera.R.convertTo(R, CV_32F);
+            camera.R = correction * R;
+        }
+
+        if (index > 1) cameras[0] = frames_[first].camera;
+    }
+
+    if (isCancelled(control)) return false;
+
+    // commit
+    matches_.insert(matches.begin(), matches.end());
+    frames_.push_back(frame);
+
+    if (1 == index) {
+        const double focal0 = cameras[0].focal / workScale_;
+        const double focal1 = cameras[1].focal / workScale_;
+        warpedScale_ = (float)((focal0 + focal1) * 0.5);    // same as Stitcher: median focal
+
+        Ptr<WarperCreator> creator = createPanoramaWarper(projection_);
+        if (!creator) return false;
+        warper_ = creator->create(warpedScale_);
+        lowWarper_ = creator->create((float)(warpedScale_ * seamScale_));
+    }
+
+    for (size_t i = 0; i < window.size(); i++) {
+        Frame& windowFrame = frames_[window[i]];
+        pending_ = unite(pending_, windowFrame.roi);        // where it was
+        windowFrame.camera = cameras[i];
+        updateGeometry(windowFrame);
+        pending_ = unite(pending_, windowFrame.roi);        // where it is now
+    }
+
+    return true;
+}
+
+
+void IncrementalPanorama::updateGeometry(Frame& frame) {
+    frame.camera.K().convertTo(frame.K, CV_32F);
+    scaleK(frame.K, 1.0 / workScale_);
+    frame.camera.R.convertTo(frame.R, CV_32F);
+    frame.roi = warper_->warpRoi(frame.image.size(), frame.K, frame.R);
+
+    Mat lowK = frame.K.clone();
+    scaleK(lowK, seamScale_);
+    const Size lowSize(std::max(1, cvRound(frame.image.cols * seamScale_)), std::max(1, cvRound(frame.image.rows * seamScale_)));
+    frame.lowCorner = lowWarper_->warp(Mat(lowSize, CV_8U, Scalar::all(255)), lowK, frame.R,
+                                       INTER_NEAREST, BORDER_CONSTANT, frame.lowMask);
+}
+
+
+void IncrementalPanorama::updateSeam(int index) {
+    Frame& frame = frames_[index];
+    const Rect lowRect(frame.lowCorner, frame.lowMask.size());
+
+    std::vector<int> others;
+    for (int i = 0; i < (int)frames_.size(); i++) {
+        if (i != index && !(Rect(frames_[i].lowCorner, frames_[i].lowMask.size()) & lowRect).empty())
+            others.push_back(i);
+    }
+
+    auto center = [](const Frame& f) {
+        return Point2f(f.lowCorner.x + f.lowMask.cols * 0.5f, f.lowCorner.y + f.lowMask.rows * 0.5f);
+    };
+
+    // Voronoi cell of the frame center: only depends on the frames around it
+    Mat owned(frame.lowMask.size(), CV_8U, Scalar::all(0));
+    const Point2f frameCenter = center(frame);
+
+    parallel_for_(Range(0, owned.rows), [&](const Range& range) {
+        for (int y = range.start; y < range.end; y++) {
+            const uchar* mask = frame.lowMask.ptr<uchar>(y);
+            uchar* out = owned.ptr<uchar>(y);
+
+            for (int x = 0; x < owned.cols; x++) {
+                if (!mask[x]) continue;
+
+                const Point q(frame.lowCorner.x + x, frame.lowCorner.y + y);
+                const Point2f d = Point2f(q) - frameCenter;
+                const float distance = d.dot(d);
+                bool owner = true;
+
+                for (int i: others) {
+                    const Frame& other = frames_[i];
+                    const Point local = q - other.lowCorner;
+                    if (local.x < 0 || local.y < 0 || local.x >= other.lowMask.cols || local.y >= other.lowMask.rows) continue;
+                    if (!other.lowMask.at<uchar>(local)) continue;
+
+                    const Point2f otherD = Point2f(q) - center(other);
+                    if (otherD.dot(otherD) < distance) {
+                        owner = false;
+                        break;
+                    }
+                }
+
+                out[x] = owner ? 255 : 0;
+            }
+        }
+    });
+
+    // same as the Stitcher seam masks
+    dilate(owned, frame.seamMask, Mat());
+}
+
+
+bool IncrementalPanorama::composePending(JobControl* control) {
+    if (frames_.size() < 2 || !warper_) return true;    // nothing to compose yet
+    if (pending_.empty()) return true;
+
+    ScopedStage stage("incremental-compose");
+
+    Rect dst;
+    for (const auto& frame: frames_)
+        dst = unite(dst, frame.roi);
+
+    if (canvas_.empty())
+        bands_ = panoramaBlendBands(dst, profile_);
+
+    if (dst != dst_) {
+        // the canvas grows: keep the part already composed
+        Mat canvas(dst.size(), CV_8UC3, Scalar::all(0));
+        const Rect common = dst_ & dst;
+        if (!canvas_.empty() && !common.empty())
+            canvas_(common - dst_.tl()).copyTo(canvas(common - dst.tl()));
+        canvas_ = canvas;
+        dst_ = dst;
+    }
+
+    // a frame changes the blending up to the pyramid margin around it
+    const Rect region = expand(pending_, 2 << bands_) & dst_;
+
+    std::vector<CompositorImage> images(frames_.size());
+    for (int i = 0; i < (int)frames_.size(); i++) {
+        if (!(frames_[i].roi & region).empty())
+            updateSeam(i);
+
+        images[i].image = frames_[i].image;
+        images[i].K = frames_[i].K;
+        images[i].R = frames_[i].R;
+        images[i].roi = frames_[i].roi;
+        images[i].seamMask = frames_[i].seamMask;
+    }
+
+    if (!composePanoramaRegion(images, projection_, warpedScale_, bands_, dst_, region, canvas_,
+                               PANORAMA_TILE_SIZE, control, &warpMaps_))
+        return false;   // still pending: composed by the next add / update
+
+    updated_ = region - dst_.tl();
+    pending_ = Rect();
+    return true;
+}
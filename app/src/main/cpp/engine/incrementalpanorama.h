@@ -0,0 +1,95 @@
+#ifndef MERGEPHOTOS_INCREMENTALPANORAMA_H
+#define MERGEPHOTOS_INCREMENTALPANORAMA_H
+
+#include <map>
+#include <mutex>
+#include <utility>
+#include <vector>
+#include "opencv2/core.hpp"
+#include "opencv2/features2d.hpp"
+#include "opencv2/stitching.hpp"
+#include "compositor.h"
+#include "job.h"
+#include "registration.h"
+
+
+#define INCREMENTAL_PANORAMA_NEIGHBOURS         2       // a new frame is only matched against the last frames
+#define INCREMENTAL_PANORAMA_WINDOW             4       // frames refined by the local bundle adjustment
+
+
+// Panorama built one frame at a time (sweeping panorama).
+//
+// The features, the pairwise matches and the cameras of the frames are kept. A new frame is only matched
+// against the last frames, then a bundle adjustment refines the cameras of the last frames only.
+// The oldest frame of that window is the anchor: the adjusted window is rotated back on it, so the cameras
+// of the other frames and the panorama already composed stay valid. Only the canvas part covered by the
+// frames that moved is composed again, so the cost of a new frame doesn't depend on the number of frames.
+//
+// Compared to PanoramaSession there is no wave correction and no exposure compensation, and the seams
+// are the (local) Voronoi cells of the frame centers instead of graph cuts.
+class IncrementalPanorama {
+public:
+    // projection: PanoramaProjection, quality: PanoramaQuality
+    IncrementalPanorama(int projection, int quality);
+
+    // Registers the image and composes the part of the panorama it changes.
+    // Fails (and the frame is not added) if the image doesn't overlap the last frames.
+    bool add(const cv::Mat& image, JobControl* control = nullptr);
+
+    // Adds images[count() ..]: the caller can pass the whole list each time it grows
+    bool update(const std::vector<cv::Mat>& images, JobControl* control = nullptr);
+
+    int count();
+
+    // Copy of the current panorama (false until 2 frames are registered)
+    bool panorama(cv::Mat& output);
+
+    // Part of the panorama composed by the last add / update (in panorama pixels)
+    cv::Rect updated();
+
+private:
+    struct Frame {
+        cv::Mat image;
+        cv::detail::ImageFeatures features;     // at work scale
+        cv::detail::CameraParams camera;        // at work scale
+        cv::Mat K, R;                           // full resolution, CV_32F
+        cv::Rect roi;                           // warped image, in panorama coordinates
+        cv::Point lowCorner;                    // warped mask at seam resolution
+        cv::Mat lowMask;
+        cv::Mat seamMask;
+    };
+
+    // Must be called with the mutex locked
+    bool addFrame(const cv::Mat& image, JobControl* control);
+    bool composePending(JobControl* control);
+    // FeaturesMatcher layout for the frames, from matches_ and the matches of the frame being added
+    std::vector<cv::detail::MatchesInfo> pairwiseMatches(const std::vector<int>& frames,
+                                                         const std::map<std::pair<int, int>, cv::detail::MatchesInfo>& newMatches) const;
+    void updateGeometry(Frame& frame);
+    void updateSeam(int index);
+
+    std::mutex mutex_;
+    int projection_;
+    PanoramaQualityProfile profile_;
+    cv::Ptr<cv::Feature2D> finder_;
+    cv::Ptr<cv::detail::FeaturesMatcher> matcher_;
+
+    std::vector<Frame> frames_;
+    std::map<std::pair<int, int>, cv::detail::MatchesInfo> matches_;    // (i, j), i < j: matches from i to j
+    double workScale_ = 1.0;
+    double seamScale_ = 1.0;
+
+    // Fixed by the first pair, so the canvas coordinates don't move
+    float warpedScale_ = 0.0f;
+    int bands_ = 0;
+    cv::Ptr<cv::detail::RotationWarper> warper_, lowWarper_;
+
+    cv::Mat canvas_;
+    cv::Rect dst_;          // canvas rectangle in warped coordinates
+    cv::Rect pending_;      // warped rectangle to compose again
+    cv::Rect updated_;
+    WarpMapCache warpMaps_;     // the frames that didn't move keep their maps
+};
+
+
+#endif //MERGEPHOTOS_INCREMENTALPANORAMA_H
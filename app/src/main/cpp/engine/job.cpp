@@ -0,0 +1,208 @@
+#include "job.h"
+#include <algorithm>
+#include <deque>
+#include <thread>
+#include <vector>
+
+
+using namespace cv;
+
+
+// The merges use all the cores through parallel_for_, so only one job runs at a time.
+// The second thread lets the next job start while a cancelled / preempted one unwinds.
+#define JOB_SCHEDULER_THREADS   2
+
+
+class JobScheduler {
+public:
+    static JobScheduler& instance() {
+        static JobScheduler* scheduler = new JobScheduler();  // never destroyed: the workers live as long as the process
+        return *scheduler;
+    }
+
+    void submit(const std::shared_ptr<MergeJob>& job) {
+        std::shared_ptr<MergeJob> replaced;
+
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+
+            if (MergeJob::PREVIEW == job->priority()) {
+                // coalesce: only the latest preview matters
+                replaced = preview_;
+                preview_ = job;
+                for (const auto& running: running_) {
+                    if (MergeJob::PREVIEW == running->priority())
+                        running->control_.cancel();
+                }
+            } else {
+                full_.push_back(job);
+                for (const auto& running: running_) {
+                    if (MergeJob::PREVIEW == running->priority())
+                        running->control_.preempt();
+                }
+            }
+        }
+
+        if (replaced) {
+            replaced->control_.cancel();
+            replaced->finish(MergeJob::CANCELLED);
+        }
+
+        available_.notify_all();
+    }
+
+private:
+    JobScheduler() {
+        for (int i = 0; i < JOB_SCHEDULER_THREADS; i++)
+            std::thread([this]() { worker(); }).detach();
+    }
+
+    // Must be called with the mutex locked
+    std::shared_ptr<MergeJob> next() {
+        bool fullRunning = false, previewRunning = false;
+        for (const auto& running: running_) {
+            // a job that is stopping doesn't block the next one
+            if (running->control_.cancelled()) continue;
+            if (MergeJob::FULL == running->priority())
+                fullRunning = true;
+            else
+                previewRunning = true;
+        }
+
+        if (fullRunning) return nullptr;
+
+        std::shared_ptr<MergeJob> job;
+        if (!full_.empty()) {
+            job = full_.front();
+            full_.pop_front();
+        } else if (preview_ && !previewRunning) {
+            job = preview_;
+            preview_ = nullptr;
+        }
+
+        return job;
+    }
+
+    void worker() {
+        for (;;) {
+            std::shared_ptr<MergeJob> job;
+
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                available_.wait(lock, [this, &job]() { return nullptr != (job = next()); });
+                running_.push_back(job);
+            }
+
+            const bool finished = job->run();
+            std::shared_ptr<MergeJob> dropped;
+
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                running_.erase(std::find(running_.begin(), running_.end(), job));
+
+                if (!finished) {
+                    // preempted: back in the preview slot, unless a newer preview is already there
+                    if (preview_) {
+                        dropped = job;
+                    } else {
+                        job->control_.restart();
+                        preview_ = job;
+                    }
+                }
+            }
+
+            if (dropped) {
+                dropped->control_.cancel();
+                dropped->finish(MergeJob::CANCELLED);
+            }
+
+            available_.notify_all();
+        }
+    }
+
+    std::mutex mutex_;
+    std::condition_variable available_;
+    std::deque<std::shared_ptr<MergeJob>> full_;
+    std::shared_ptr<MergeJob> preview_;
+    std::vector<std::shared_ptr<MergeJob>> running_;
+};
+
+
+std::shared_ptr<MergeJob> MergeJob::start(const Task& task, Priority priority) {
+    return start([task](JobControl* control, std::vector<Mat>& outputs) {
+        outputs.resize(1);
+        return task(control, outputs[0]) && !outputs[0].empty();
+    }, priority);
+}
+
+
+std::shared_ptr<MergeJob> MergeJob::start(const ListTask& task, Priority priority) {
+    std::shared_ptr<MergeJob> job(new MergeJob(task, priority));
+    // the scheduler keeps the job alive until it ran, even if the caller released it
+    JobScheduler::instance().submit(job);
+    return job;
+}
+
+
+bool MergeJob::run() {
+    bool success = false;
+
+    if (!control_.cancelled()) {
+        try {
+            success = task_(&control_, outputs_);
+        } catch (const cv::Exception&) {
+            success = false;
+        } catch (...) {
+            // std::bad_alloc & co: an exception must not leave the (detached) worker thread
+            success = false;
+        }
+    }
+
+    if (control_.preempted()) {
+        outputs_.clear();
+        return false;
+    }
+
+    if (control_.cancelled())
+        finish(CANCELLED);
+    else if (success && !outputs_.empty())
+        finish(DONE);
+    else
+        finish(FAILED);
+
+    return true;
+}
+
+
+void MergeJob::finish(State state) {
+    if (DONE != state)
+        outputs_.clear();
+    task_ = nullptr;    // the inputs are not needed anymore
+
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        control_.setProgress(1.0f);
+        state_ = state;
+    }
+    finished_.notify_all();
+}
+
+
+void MergeJob::wait() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    finished_.wait(lock, [this]() { return RUNNING != state_.load(); });
+}
+
+
+bool MergeJob::result(Mat& output) const {
+    if (DONE != state()) return false;
+    output = outputs_[0];   // shared, not copied: the job doesn't touch its outputs anymore
+    return true;
+}
+
+
+bool MergeJob::results(std::vector<Mat>& outputs) const {
+    if (DONE != state()) return false;
+    outputs = outputs_;
+    return true;
+}
@@ -0,0 +1,138 @@
+#ifndef MERGEPHOTOS_JOB_H
+#define MERGEPHOTOS_JOB_H
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include "opencv2/core.hpp"
+
+
+// Shared between a merge and whoever started it: the merge reports its progress and stops
+// (returns false) as soon as it sees the cancel flag. All the engine functions accept a null control.
+class JobControl {
+public:
+    void cancel() { cancelled_ = true; }
+
+    // Stop now but run again later (the scheduler needs the cores for a more important job)
+    void preempt() { preempted_ = true; }
+
+    // Preempted and still wanted (not cancelled)
+    bool preempted() const { return preempted_.load() && !cancelled_.load(); }
+
+    // Clears the preemption before running again
+    void restart() {
+        preempted_ = false;
+        progress_ = 0;
+    }
+
+    bool cancelled() const {
+        return cancelled_.load(std::memory_order_relaxed) || preempted_.load(std::memory_order_relaxed);
+    }
+
+    // 0 .. 1
+    void setProgress(float progress) { progress_ = (int)(std::min(std::max(progress, 0.0f), 1.0f) * 1000.0f); }
+    float progress() const { return progress_.load(std::memory_order_relaxed) / 1000.0f; }
+
+private:
+    std::atomic<bool> cancelled_{false};
+    std::atomic<bool> preempted_{false};
+    std::atomic<int> progress_{0};          // per mille
+};
+
+
+static inline bool isCancelled(const JobControl* control) {
+    return control && control->cancelled();
+}
+
+
+// Progress of a loop over total items, mapped to [from, to] of the job progress.
+// advance() can be called from parallel_for_ bodies.
+class JobProgress {
+public:
+    JobProgress(JobControl* control, int total, float from = 0.0f, float to = 1.0f)
+        : control_(control), total_(std::max(total, 1)), from_(from), to_(to) {
+    }
+
+    void advance(int items = 1) {
+        if (!control_) return;
+        int done = (done_ += items);
+        control_->setProgress(from_ + (to_ - from_) * std::min(done, total_) / total_);
+    }
+
+private:
+    JobControl* control_;
+    std::atomic<int> done_{0};
+    int total_;
+    float from_, to_;
+};
+
+
+class JobScheduler;
+
+
+// A merge running on the job scheduler. The output is available once the job is done.
+//
+// Full resolution jobs run one at a time in FIFO order and preempt the preview.
+// There is only one preview slot: a new preview replaces the queued one and cancels the running one,
+// so only the latest parameters are computed. A preempted preview runs again after the full jobs.
+class MergeJob {
+public:
+    // Same values as MergeJob.STATE_*
+    enum State {
+        RUNNING = 0,    // queued or running
+        DONE,
+        FAILED,
+        CANCELLED
+    };
+
+    // Same values as MergeJob.PRIORITY_*
+    enum Priority {
+        PREVIEW = 0,
+        FULL
+    };
+
+    typedef std::function<bool (JobControl* control, cv::Mat& output)> Task;
+    // A task with several outputs (decoded images): done if it succeeds with at least one output,
+    // the task decides if an empty output is a failure (a file that can't be decoded may just be skipped)
+    typedef std::function<bool (JobControl* control, std::vector<cv::Mat>& outputs)> ListTask;
+
+    // Queues the task on the job scheduler
+    static std::shared_ptr<MergeJob> start(const Task& task, Priority priority = FULL);
+    static std::shared_ptr<MergeJob> start(const ListTask& task, Priority priority = FULL);
+
+    Priority priority() const { return priority_; }
+    State state() const { return (State)state_.load(); }
+    float progress() const { return control_.progress(); }
+    void cancel() { control_.cancel(); }
+
+    // Blocks until the job is not running anymore
+    void wait();
+
+    // false if the job is not done (yet). output shares the job output (no copy).
+    bool result(cv::Mat& output) const;
+    // Same for all the outputs (the first one for a Task)
+    bool results(std::vector<cv::Mat>& outputs) const;
+
+private:
+    friend class JobScheduler;
+
+    MergeJob(const ListTask& task, Priority priority) : task_(task), priority_(priority) {}
+
+    // false if the job was preempted and must run again
+    bool run();
+    void finish(State state);
+
+    ListTask task_;
+    Priority priority_;
+    JobControl control_;
+    std::vector<cv::Mat> outputs_;
+    std::atomic<int> state_{RUNNING};
+    std::mutex mutex_;
+    std::condition_variable finished_;
+};
+
+
+#endif //MERGEPHOTOS_JOB_H
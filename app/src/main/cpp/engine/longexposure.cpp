@@ -0,0 +1,524 @@
+#include "longexposure.h"
+#include "common.h"
+#include "profile.h"
+#include "opencv2/core/hal/intrin.hpp"
+
+
+using namespace cv;
+
+
+static
+unsigned int calculateDistance(const Pixel& p1, const Pixel& p2) {
+    double rmean = (p1.x + p2.x)/2;
+    int r = p1.x - p2.x;
+    int g = p1.y - p2.y;
+    int b = p1.z - p2.z;
+    double wr = 2 + rmean/256;
+    double wg = 4.0;
+    double wb = 2 + (255-rmean)/256;
+    return (unsigned int)sqrt(wr*r*r + wg*g*g + wb*b*b);
+}
+
+
+// sum[i] += src[i] (or -= if add is false) for n values
+static
+void accumulateRow(const uchar* src, int* sum, int n, bool add) {
+    int x = 0;
+
+#if CV_SIMD
+    const int step = v_uint8::nlanes;
+    const int quarter = v_int32::nlanes;
+
+    for (; x <= n - step; x += step) {
+        v_uint16 lo, hi;
+        v_uint32 values[4];
+        v_expand(vx_load(src + x), lo, hi);
+        v_expand(lo, values[0], values[1]);
+        v_expand(hi, values[2], values[3]);
+
+        for (int k = 0; k < 4; k++) {
+            int* ptr = sum + x + k * quarter;
+            v_int32 value = v_reinterpret_as_s32(values[k]);
+            v_store(ptr, add ? vx_load(ptr) + value : vx_load(ptr) - value);
+        }
+    }
+#endif
+
+    if (add) {
+        for (; x < n; x++) sum[x] += src[x];
+    } else {
+        for (; x < n; x++) sum[x] -= src[x];
+    }
+}
+
+
+bool LongExposureAccumulator::accumulate(const Mat& frame, bool add) {
+    if (frame.empty() || CV_8UC3 != frame.type()) return false;
+
+    if (sum_.empty()) {
+        if (!add) return false;
+        sum_ = Mat::zeros(frame.size(), CV_32SC3);
+    } else if (frame.size() != sum_.size()) {
+        return false;
+    }
+
+    // continuous frames are processed as one long row
+    const int rows = frame.isContinuous() ? 1 : frame.rows;
+    const int n = frame.isContinuous() ? (int)frame.total() * 3 : frame.cols * 3;
+    const int grain = frame.isContinuous() ? 65536 : frame.cols * 3 * 16;
+
+    if (1 == rows) {
+        parallel_for_(Range(0, (n + grain - 1) / grain), [&](const Range& range) {
+            for (int chunk = range.start; chunk < range.end; chunk++) {
+                int offset = chunk * grain;
+                accumulateRow(frame.ptr<uchar>() + offset, sum_.ptr<int>() + offset, std::min(grain, n - offset), add);
+            }
+        });
+    } else {
+        parallel_for_(Range(0, rows), [&](const Range& range) {
+            for (int y = range.start; y < range.end; y++)
+                accumulateRow(frame.ptr<uchar>(y), sum_.ptr<int>(y), n, add);
+        });
+    }
+
+    count_ += add ? 1 : -1;
+    if (0 == count_) sum_.release();
+    return true;
+}
+
+
+bool LongExposureAccumulator::add(const Mat& frame) {
+    return accumulate(frame, true);
+}
+
+
+bool LongExposureAccumulator::remove(const Mat& frame) {
+    return count_ > 0 && accumulate(frame, false);
+}
+
+
+bool LongExposureAccumulator::result(Mat& output) const {
+    if (count_ <= 0) return false;
+    sum_.convertTo(output, CV_8UC3, 1.0 / count_);
+    return !output.empty();
+}
+
+
+void LongExposureAccumulator::clear() {
+    sum_.release();
+    count_ = 0;
+}
+
+
+bool makeLongExposureAverage(const std::vector<Mat>& images, Mat& outputImage) {
+    ScopedStage stage("average");
+
+    if (images.size() < 2) return false;
+
+    LongExposureAccumulator accumulator;
+    for (const auto& image: images) {
+        if (!accumulator.add(image))
+            return false;
+    }
+
+    return accumulator.result(outputImage);
+}
+
+
+// Same ordering as calculateDistance but without sqrt: 256 x the weighted squared distance.
+// Max value is ~166M so it fits in 32 bits.
+static inline
+unsigned int calculateDistanceSquared(const uchar* p1, const uchar* p2) {
+    int rmean = (p1[0] + p2[0]) >> 1;
+    int r = p1[0] - p2[0];
+    int g = p1[1] - p2[1];
+    int b = p1[2] - p2[2];
+    return (unsigned int)((512 + rmean)*r*r + 1024*g*g + (767 - rmean)*b*b);
+}
+
+
+#if CV_SIMD
+static inline
+void calculateDistanceSquared(const v_uint8& r1, const v_uint8& g1, const v_uint8& b1,
+                              const v_uint8& r2, const v_uint8& g2, const v_uint8& b2,
+                              v_uint32 (&distance)[4]) {
+    v_uint16 r1Lo, r1Hi, r2Lo, r2Hi;
+    v_expand(r1, r1Lo, r1Hi);
+    v_expand(r2, r2Lo, r2Hi);
+    v_uint16 rmeanLo = v_shr<1>(r1Lo + r2Lo);
+    v_uint16 rmeanHi = v_shr<1>(r1Hi + r2Hi);
+
+    // |diff|^2 <= 65025 so it fits in 16 bits
+    v_uint16 rLo, rHi, gLo, gHi, bLo, bHi;
+    v_expand(v_absdiff(r1, r2), rLo, rHi);
+    v_expand(v_absdiff(g1, g2), gLo, gHi);
+    v_expand(v_absdiff(b1, b2), bLo, bHi);
+    rLo = v_mul_wrap(rLo, rLo); rHi = v_mul_wrap(rHi, rHi);
+    gLo = v_mul_wrap(gLo, gLo); gHi = v_mul_wrap(gHi, gHi);
+    bLo = v_mul_wrap(bLo, bLo); bHi = v_mul_wrap(bHi, bHi);
+
+    const v_uint16 v512 = vx_setall_u16(512);
+    const v_uint16 v767 = vx_setall_u16(767);
+
+    v_uint32 wr[4], wg[4], wb[4];
+    v_mul_expand(v512 + rmeanLo, rLo, wr[0], wr[1]);
+    v_mul_expand(v512 + rmeanHi, rHi, wr[2], wr[3]);
+    v_mul_expand(v767 - rmeanLo, bLo, wb[0], wb[1]);
+    v_mul_expand(v767 - rmeanHi, bHi, wb[2], wb[3]);
+    v_expand(gLo, wg[0], wg[1]);
+    v_expand(gHi, wg[2], wg[3]);
+
+    for (int k = 0; k < 4; k++)
+        distance[k] = wr[k] + v_shl<10>(wg[k]) + wb[k];
+}
+#endif
+
+
+// One row: for each pixel pick the pixel (from rows) nearest to ref
+static
+void nearestRow(const uchar* ref, const std::vector<const uchar*>& rows, uchar* out, int width, bool useSimd) {
+    const int count = (int)rows.size();
+    int x = 0;
+
+#if CV_SIMD
+    if (useSimd) {
+        const int step = v_uint8::nlanes;
+
+        for (; x <= width - step; x += step) {
+            const int offset = 3 * x;
+            v_uint8 refR, refG, refB, bestR, bestG, bestB;
+            v_uint32 bestDistance[4];
+
+            v_load_deinterleave(ref + offset, refR, refG, refB);
+            v_load_deinterleave(rows[0] + offset, bestR, bestG, bestB);
+            calculateDistanceSquared(refR, refG, refB, bestR, bestG, bestB, bestDistance);
+
+            for (int i = 1; i < count; i++) {
+                v_uint8 r, g, b;
+                v_uint32 distance[4];
+                v_load_deinterleave(rows[i] + offset, r, g, b);
+                calculateDistanceSquared(refR, refG, refB, r, g, b, distance);
+
+                // strictly less: on ties the first image wins, like the scalar code
+                v_uint8 mask = v_pack_b(distance[0] < bestDistance[0], distance[1] < bestDistance[1],
+                                        distance[2] < bestDistance[2], distance[3] < bestDistance[3]);
+                for (int k = 0; k < 4; k++)
+                    bestDistance[k] = v_min(bestDistance[k], distance[k]);
+
+                bestR = v_select(mask, r, bestR);
+                bestG = v_select(mask, g, bestG);
+                bestB = v_select(mask, b, bestB);
+            }
+
+            v_store_interleave(out + offset, bestR, bestG, bestB);
+        }
+    }
+#else
+    (void)useSimd;
+#endif
+
+    for (; x < width; x++) {
+        const int offset = 3 * x;
+        int bestIndex = 0;
+        unsigned int bestValue = calculateDistanceSquared(ref + offset, rows[0] + offset);
+
+        for (int i = 1; i < count; i++) {
+            unsigned int value = calculateDistanceSquared(ref + offset, rows[i] + offset);
+            if (value < bestValue) {
+                bestValue = value;
+                bestIndex = i;
+            }
+        }
+
+        const uchar* best = rows[bestIndex] + offset;
+        out[offset] = best[0];
+        out[offset + 1] = best[1];
+        out[offset + 2] = best[2];
+    }
+}
+
+
+static
+bool checkImages(const std::vector<Mat>& images, const Mat& reference) {
+    if (images.empty() || reference.empty() || reference.type() != CV_8UC3) return false;
+
+    for (const auto& image: images) {
+        if (image.size() != reference.size() || image.type() != reference.type())
+            return false;
+    }
+
+    return true;
+}
+
+
+bool makeLongExposureNearest(const std::vector<Mat>& images, const Mat& averageImage, Mat& outputImage,
+                             JobControl* control, bool useSimd) {
+    ScopedStage stage("nearest");
+
+    if (!checkImages(images, averageImage)) return false;
+
+    outputImage.create(averageImage.rows, averageImage.cols, averageImage.type());
+    if (outputImage.empty()) return false;
+
+    JobProgress progress(control, averageImage.rows);
+
+    parallel_for_(Range(0, averageImage.rows), [&](const Range& range) {
+        std::vector<const uchar*> rows(images.size());
+
+        for (int y = range.start; y < range.end; y++) {
+            if (isCancelled(control)) return;
+
+            for (size_t i = 0; i < images.size(); i++)
+                rows[i] = images[i].ptr<uchar>(y);
+
+            nearestRow(averageImage.ptr<uchar>(y), rows, outputImage.ptr<uchar>(y), averageImage.cols, useSimd);
+        }
+
+        progress.advance(range.end - range.start);
+    });
+
+    return !isCancelled(control);
+}
+
+
+bool makeLongExposureNearestReference(const std::vector<Mat>& images, const Mat& averageImage, Mat& outputImage) {
+    outputImage.create(averageImage.rows, averageImage.cols, averageImage.type());
+    if (outputImage.empty()) return false;
+
+    outputImage.forEach<Pixel>(
+        [images, averageImage](Pixel& pixel, const int position[]) -> void {
+            const auto& refPixel = averageImage.at<Pixel>(position);
+            int bestIndex = 0;
+            unsigned int bestValue = calculateDistance(refPixel, images[0].at<Pixel>(position));
+
+            for (int i = 1; i < images.size(); i++) {
+                unsigned int value = calculateDistance(refPixel, images[i].at<Pixel>(position));
+                if (value < bestValue) {
+                    bestValue = value;
+                    bestIndex = i;
+                }
+            }
+
+            pixel = images[bestIndex].at<Pixel>(position);
+        }
+    );
+
+    return true;
+}
+
+
+// Integer luma (BT.601 weights x 256, at most 65280): only used to compare pixels
+static inline
+unsigned int lumaKey(const uchar* p) {
+    return 77u * p[0] + 150u * p[1] + 29u * p[2];
+}
+
+
+#if CV_SIMD
+static inline
+void lumaKey(const v_uint8& r, const v_uint8& g, const v_uint8& b, v_uint16& low, v_uint16& high) {
+    v_uint16 rLo, rHi, gLo, gHi, bLo, bHi;
+    v_expand(r, rLo, rHi);
+    v_expand(g, gLo, gHi);
+    v_expand(b, bLo, bHi);
+    const v_uint16 wr = vx_setall_u16(77), wg = vx_setall_u16(150), wb = vx_setall_u16(29);
+    low = v_mul_wrap(rLo, wr) + v_mul_wrap(gLo, wg) + v_mul_wrap(bLo, wb);
+    high = v_mul_wrap(rHi, wr) + v_mul_wrap(gHi, wg) + v_mul_wrap(bHi, wb);
+}
+#endif
+
+
+// One row: for each pixel pick the pixel (from rows) with the highest (light) or lowest luma.
+// out can be rows[0].
+static
+void lightOrDarkRow(const std::vector<const uchar*>& rows, uchar* out, int width, bool light, bool useSimd) {
+    const int count = (int)rows.size();
+    int x = 0;
+
+#if CV_SIMD
+    if (useSimd) {
+        const int step = v_uint8::nlanes;
+
+        for (; x <= width - step; x += step) {
+            const int offset = 3 * x;
+            v_uint8 bestR, bestG, bestB;
+            v_uint16 bestLo, bestHi;
+            v_load_deinterleave(rows[0] + offset, bestR, bestG, bestB);
+            lumaKey(bestR, bestG, bestB, bestLo, bestHi);
+
+            for (int i = 1; i < count; i++) {
+                v_uint8 r, g, b;
+                v_uint16 lo, hi;
+                v_load_deinterleave(rows[i] + offset, r, g, b);
+                lumaKey(r, g, b, lo, hi);
+
+                // strictly better: on ties the first image wins, like the scalar code
+                v_uint8 mask = light ? v_pack_b(lo > bestLo, hi > bestHi) : v_pack_b(lo < bestLo, hi < bestHi);
+                bestLo = light ? v_max(bestLo, lo) : v_min(bestLo, lo);
+                bestHi = light ? v_max(bestHi, hi) : v_min(bestHi, hi);
+
+                bestR = v_select(mask, r, bestR);
+                bestG = v_select(mask, g, bestG);
+                bestB = v_select(mask, b, bestB);
+            }
+
+            v_store_interleave(out + offset, bestR, bestG, bestB);
+        }
+    }
+#else
+    (void)useSimd;
+#endif
+
+    for (; x < width; x++) {
+        const int offset = 3 * x;
+        int bestIndex = 0;
+        unsigned int bestValue = lumaKey(rows[0] + offset);
+
+        for (int i = 1; i < count; i++) {
+            unsigned int value = lumaKey(rows[i] + offset);
+            if (light ? value > bestValue : value < bestValue) {
+                bestValue = value;
+                bestIndex = i;
+            }
+        }
+
+        const uchar* best = rows[bestIndex] + offset;
+        out[offset] = best[0];
+        out[offset + 1] = best[1];
+        out[offset + 2] = best[2];
+    }
+}
+
+
+bool makeLongExposureLightOrDark(const std::vector<Mat>& images, Mat& outputImage, bool light, JobControl* control,
+                                 bool useSimd) {
+    ScopedStage stage(light ? "light" : "dark");
+
+    if (images.size() < 2 || !checkImages(images, images[0])) return false;
+
+    outputImage.create(images[0].rows, images[0].cols, images[0].type());
+    if (outputImage.empty()) return false;
+
+    JobProgress progress(control, outputImage.rows);
+
+    parallel_for_(Range(0, outputImage.rows), [&](const Range& range) {
+        std::vector<const uchar*> rows(images.size());
+
+        for (int y = range.start; y < range.end; y++) {
+            if (isCancelled(control)) return;
+
+            for (size_t i = 0; i < images.size(); i++)
+                rows[i] = images[i].ptr<uchar>(y);
+
+            lightOrDarkRow(rows, outputImage.ptr<uchar>(y), outputImage.cols, light, useSimd);
+        }
+
+        progress.advance(range.end - range.start);
+    });
+
+    return !isCancelled(control);
+}
+
+
+static
+bool readBands(const std::vector<Ptr<FrameSource>>& frames, int y, int rows, std::vector<Mat>& bands) {
+    bands.resize(frames.size());
+    for (size_t i = 0; i < frames.size(); i++) {
+        if (!frames[i]->readBand(y, rows, bands[i]))
+            return false;
+    }
+    return true;
+}
+
+
+bool makeLongExposureBanded(const std::vector<Ptr<FrameSource>>& frames, int mode, Mat& outputImage, int bandRows,
+                            JobControl* control) {
+    ScopedStage stage("banded");
+
+    if (frames.size() < 2 || bandRows <= 0) return false;
+
+    const Size size = frames[0]->size();
+    const int type = frames[0]->type();
+    if (CV_8UC3 != type) return false;
+
+    for (const auto& frame: frames) {
+        if (frame->size() != size || frame->type() != type)
+            return false;
+    }
+
+    outputImage.create(size, type);
+    if (outputImage.empty()) return false;
+
+    std::vector<Mat> bands;
+    Mat band, average;
+    LongExposureAccumulator accumulator;
+    JobProgress progress(control, size.height);
+
+    for (int y = 0; y < size.height; y += bandRows) {
+        if (isCancelled(control)) return false;
+
+        const int rows = std::min(bandRows, size.height - y);
+        Mat outputBand = outputImage.rowRange(y, y + rows);
+
+        switch (mode) {
+            case LONG_EXPOSURE_AVERAGE:
+                accumulator.clear();
+                for (const auto& frame: frames) {
+                    if (!frame->readBand(y, rows, band)) return false;
+                    if (!accumulator.add(band)) return false;
+                }
+                if (!accumulator.result(outputBand)) return false;
+                break;
+
+            case LONG_EXPOSURE_NEAREST_TO_AVERAGE:
+                if (!readBands(frames, y, rows, bands)) return false;
+                if (!makeLongExposureAverage(bands, average)) return false;
+                if (!makeLongExposureNearest(bands, average, band)) return false;
+                band.copyTo(outputBand);
+                break;
+
+            case LONG_EXPOSURE_LIGHT:
+            case LONG_EXPOSURE_DARK:
+                // Running best, in place in the output band: comparing the current best with the next frame gives
+                // the same result as comparing all the frames (the first one wins on ties in both cases)
+                if (!frames[0]->readBand(y, rows, band)) return false;
+                band.copyTo(outputBand);
+                bands.resize(2);
+                bands[0] = outputBand;
+                for (size_t i = 1; i < frames.size(); i++) {
+                    if (!frames[i]->readBand(y, rows, bands[1])) return false;
+                    if (!makeLongExposureLightOrDark(bands, outputBand, LONG_EXPOSURE_LIGHT == mode)) return false;
+                }
+                break;
+
+            default:
+                return false;
+        }
+
+        progress.advance(rows);
+    }
+
+    return true;
+}
+
+
+bool spillFrames(int count, const std::function<bool (int index, Mat& image)>& read,
+                 const std::vector<Mat>& transforms, const std::string& directory,
+                 std::vector<Ptr<FrameSource>>& frames, JobControl* control) {
+    ScopedStage stage("spill");
+
+    if (!transforms.empty() && (int)transforms.size() != count) return false;
+
+    for (int i = (int)frames.size(); i < count; i++) {
+        if (isCancelled(control)) return false;
+
+        Mat image;
+        if (!read(i, image)) return false;
+
+        Ptr<FrameSource> frame = RawFileFrameSource::create(image, directory, transforms.empty() ? Mat() : transforms[i]);
+        if (!frame) return false;
+        frames.push_back(frame);
+    }
+
+    return true;
+}
@@ -0,0 +1,79 @@
+#ifndef MERGEPHOTOS_LONGEXPOSURE_H
+#define MERGEPHOTOS_LONGEXPOSURE_H
+
+#include <functional>
+#include <string>
+#include <vector>
+#include "opencv2/core.hpp"
+#include "framesource.h"
+#include "job.h"
+
+
+// Same values as Settings.LONG_EXPOSURE_*
+enum LongExposureMode {
+    LONG_EXPOSURE_AVERAGE = 0,
+    LONG_EXPOSURE_NEAREST_TO_AVERAGE,
+    LONG_EXPOSURE_LIGHT,
+    LONG_EXPOSURE_DARK
+};
+
+
+#define LONG_EXPOSURE_BAND_ROWS 256
+
+
+// Running sum of frames with 32 bits per channel (no overflow before ~8M frames).
+// A frame can be added or removed without touching the other frames.
+class LongExposureAccumulator {
+public:
+    // frame: CV_8UC3, same size as the frames added before
+    bool add(const cv::Mat& frame);
+    bool remove(const cv::Mat& frame);
+
+    // Average of the frames currently in the accumulator
+    bool result(cv::Mat& output) const;
+
+    int count() const { return count_; }
+    void clear();
+
+private:
+    bool accumulate(const cv::Mat& frame, bool add);
+
+    cv::Mat sum_;
+    int count_ = 0;
+};
+
+
+// Average of all the images (CV_8UC3)
+bool makeLongExposureAverage(const std::vector<cv::Mat>& images, cv::Mat& outputImage);
+
+// For each pixel keep the input pixel nearest to the average one (all CV_8UC3, same size).
+// Uses an integer weighted squared distance, vectorized unless useSimd is false.
+bool makeLongExposureNearest(const std::vector<cv::Mat>& images, const cv::Mat& averageImage, cv::Mat& outputImage,
+                             JobControl* control = nullptr, bool useSimd = true);
+
+// Original double precision / sqrt implementation, kept as a reference.
+// The truncated sqrt can make ties that the exact distance doesn't, so on those pixels it may pick a different image.
+bool makeLongExposureNearestReference(const std::vector<cv::Mat>& images, const cv::Mat& averageImage, cv::Mat& outputImage);
+
+// For each pixel keep the lightest (light = true) or the darkest pixel, compared on an integer luma
+// (the whole pixel is kept, so the colors don't mix). Light over a night sequence gives star trails.
+// Vectorized unless useSimd is false; outputImage can be images[0].
+bool makeLongExposureLightOrDark(const std::vector<cv::Mat>& images, cv::Mat& outputImage, bool light,
+                                 JobControl* control = nullptr, bool useSimd = true);
+
+// Streaming version of all the modes: frames are read (and aligned) one band at a time.
+// Only per band buffers are allocated, so peak memory is about bandRows x width x frames
+// (nearest to average) or bandRows x width (the other modes), plus the output.
+bool makeLongExposureBanded(const std::vector<cv::Ptr<FrameSource>>& frames, int mode, cv::Mat& outputImage,
+                            int bandRows = LONG_EXPOSURE_BAND_ROWS, JobControl* control = nullptr);
+
+// Spills count frames to raw files in directory (RawFileFrameSource), one at a time: read(index, image) gives
+// a frame (decoded, or taken from memory) and the frame is released before the next one is read, so at most
+// one full size frame is in memory. transforms: one per frame or empty (not aligned).
+// The frames already spilled (a job that runs again) are kept: only the next ones are read.
+bool spillFrames(int count, const std::function<bool (int index, cv::Mat& image)>& read,
+                 const std::vector<cv::Mat>& transforms, const std::string& directory,
+                 std::vector<cv::Ptr<FrameSource>>& frames, JobControl* control = nullptr);
+
+
+#endif //MERGEPHOTOS_LONGEXPOSURE_H
@@ -0,0 +1,83 @@
+#include "panorama.h"
+#include "profile.h"
+
+
+using namespace cv;
+
+
+bool PanoramaSession::registerImages(JobControl* control) {
+    if (NOT_REGISTERED != registration_) return REGISTERED == registration_;
+    if (isCancelled(control) || images_.empty()) return false;
+
+    if (!source_) {
+        ScopedStage stage("register");
+        if (!registerPanorama(images_, cameras_, component_, RegistrationOptions(), control)) {
+            // a cancelled registration runs again on the next compose
+            if (!isCancelled(control)) registration_ = FAILED;
+            return false;
+        }
+
+        registration_ = REGISTERED;
+        return true;
+    }
+
+    std::vector<detail::CameraParams> cameras;
+    std::vector<int> component;
+    Size sourceSize;
+    if (!source_->cameras(cameras, component, sourceSize, control)) {
+        if (!isCancelled(control)) registration_ = FAILED;
+        return false;
+    }
+
+    ScopedStage stage("register-rescale");
+    const double scaleX = (double)images_[0].cols / sourceSize.width;
+    const double scaleY = (double)images_[0].rows / sourceSize.height;
+    for (auto& camera: cameras) {
+        camera.focal *= scaleX;
+        camera.aspect *= scaleY / scaleX;
+        camera.ppx *= scaleX;
+        camera.ppy *= scaleY;
+    }
+
+    cameras_ = cameras;
+    component_ = component;
+    registration_ = REGISTERED;
+    return true;
+}
+
+
+bool PanoramaSession::cameras(std::vector<detail::CameraParams>& cameras, std::vector<int>& component, Size& size,
+                              JobControl* control) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!registerImages(control)) return false;
+
+    cameras = cameras_;
+    component = component_;
+    size = images_[0].size();
+    return true;
+}
+
+
+bool PanoramaSession::compose(int projection, int quality, Mat& panorama, JobControl* control) {
+    CompositorOptions options;
+    options.warpMaps = &warpMaps_;  // used under the session lock (composeTiled)
+    return composeTiled(projection, quality, panorama, options, control);
+}
+
+
+bool PanoramaSession::composeTiled(int projection, int quality, Mat& panorama, const CompositorOptions& options,
+                                   JobControl* control) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!registerImages(control) || isCancelled(control)) return false;
+
+    ScopedStage stage("compose");
+    return composePanoramaTiled(images_, cameras_, component_, projection, panoramaQualityProfile(quality), panorama,
+                                options, control);
+}
+
+
+bool makePanorama(const std::vector<Mat>& images, Mat& panorama, int projection, int quality, JobControl* control) {
+    ScopedStage stage("stitch");
+    PanoramaSession session(images);
+    return session.compose(projection, quality, panorama, control);
+}
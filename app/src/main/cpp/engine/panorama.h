@@ -0,0 +1,73 @@
+#ifndef MERGEPHOTOS_PANORAMA_H
+#define MERGEPHOTOS_PANORAMA_H
+
+#include <mutex>
+#include <vector>
+#include "opencv2/core.hpp"
+#include "opencv2/stitching.hpp"
+#include "compositor.h"
+#include "job.h"
+#include "registration.h"
+
+
+enum PanoramaProjection {
+    PANORAMA_PLANE = 0,
+    PANORAMA_CYLINDRICAL,
+    PANORAMA_SPHERICAL
+};
+
+
+// Panorama of a fixed set of images. The registration (features, matching, bundle adjustment,
+// wave correction) only depends on the images: it runs once, on the first compose, and is kept
+// so changing the projection only re-runs the compositing.
+//
+// With a source session (same scene, other resolution: the previews) the images are not registered,
+// the cameras of the source are rescaled to this resolution.
+// compose can be called from several threads, the calls are serialized.
+// compose keeps the projection maps for the next composes (preview: other projection or quality); they are
+// released with the session.
+class PanoramaSession {
+public:
+    explicit PanoramaSession(const std::vector<cv::Mat>& images,
+                             const std::shared_ptr<PanoramaSession>& source = std::shared_ptr<PanoramaSession>())
+        : images_(images), source_(source) {
+    }
+
+    // quality: PanoramaQuality
+    bool compose(int projection, int quality, cv::Mat& panorama, JobControl* control = nullptr);
+
+    // Same as compose with the tiled compositor options (tile size, file-backed output).
+    // The maps are only cached in options.warpMaps: a full size panorama composed once (saved, then released)
+    // would fill a cache that is never hit, on top of its tiles.
+    bool composeTiled(int projection, int quality, cv::Mat& panorama,
+                      const CompositorOptions& options = CompositorOptions(), JobControl* control = nullptr);
+
+private:
+    enum Registration {
+        NOT_REGISTERED,
+        REGISTERED,
+        FAILED
+    };
+
+    // Cameras in full resolution pixels of this session images (registers them if needed)
+    bool cameras(std::vector<cv::detail::CameraParams>& cameras, std::vector<int>& component, cv::Size& size,
+                 JobControl* control);
+
+    // Must be called with the mutex locked
+    bool registerImages(JobControl* control);
+
+    std::mutex mutex_;
+    std::vector<cv::Mat> images_;
+    std::shared_ptr<PanoramaSession> source_;
+    Registration registration_ = NOT_REGISTERED;
+    std::vector<cv::detail::CameraParams> cameras_;     // full resolution pixels
+    std::vector<int> component_;
+    WarpMapCache warpMaps_;
+};
+
+
+bool makePanorama(const std::vector<cv::Mat>& images, cv::Mat& panorama, int projection,
+                  int quality = PANORAMA_QUALITY_BALANCED, JobControl* control = nullptr);
+
+
+#endif //MERGEPHOTOS_PANORAMA_H
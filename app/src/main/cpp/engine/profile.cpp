@@ -0,0 +1,40 @@
+#include "profile.h"
+
+
+static StageRecorder* currentRecorder = nullptr;
+
+
+StageRecorder* StageRecorder::current() {
+    return currentRecorder;
+}
+
+
+void StageRecorder::setCurrent(StageRecorder* recorder) {
+    currentRecorder = recorder;
+}
+
+
+void StageRecorder::add(const char* name, double ms) {
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    for (auto& stage: stages_) {
+        if (stage.name == name) {
+            stage.ms += ms;
+            return;
+        }
+    }
+
+    stages_.push_back({name, ms});
+}
+
+
+void StageRecorder::clear() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stages_.clear();
+}
+
+
+std::vector<StageRecorder::Stage> StageRecorder::stages() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return stages_;
+}
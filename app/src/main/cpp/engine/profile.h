@@ -0,0 +1,54 @@
+#ifndef MERGEPHOTOS_PROFILE_H
+#define MERGEPHOTOS_PROFILE_H
+
+#include <string>
+#include <vector>
+#include <mutex>
+#include "opencv2/core/utility.hpp"
+
+
+// Collects per-stage timings. Nothing is recorded unless a recorder is
+// installed with StageRecorder::setCurrent (the benchmark does it, the app doesn't).
+class StageRecorder {
+public:
+    struct Stage {
+        std::string name;
+        double ms;
+    };
+
+    static StageRecorder* current();
+    static void setCurrent(StageRecorder* recorder);
+
+    void add(const char* name, double ms);
+    void clear();
+    std::vector<Stage> stages() const;
+
+private:
+    mutable std::mutex mutex_;
+    std::vector<Stage> stages_;
+};
+
+
+// Times the enclosing scope as a named stage
+class ScopedStage {
+public:
+    explicit ScopedStage(const char* name)
+        : name_(name), recorder_(StageRecorder::current()), start_(recorder_ ? cv::getTickCount() : 0) {
+    }
+
+    ~ScopedStage() {
+        if (recorder_)
+            recorder_->add(name_, (double)(cv::getTickCount() - start_) * 1000.0 / cv::getTickFrequency());
+    }
+
+    ScopedStage(const ScopedStage&) = delete;
+    ScopedStage& operator=(const ScopedStage&) = delete;
+
+private:
+    const char* name_;
+    StageRecorder* recorder_;
+    int64 start_;
+};
+
+
+#endif //MERGEPHOTOS_PROFILE_H
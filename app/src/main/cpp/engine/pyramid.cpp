@@ -0,0 +1,35 @@
+#include "pyramid.h"
+#include "opencv2/imgproc.hpp"
+
+
+using namespace cv;
+
+
+void buildLaplacianPyramid(const Mat& image, int levels, std::vector<Mat>& laplacian, Mat& residual,
+                           int fractionBits) {
+    Mat current, down, up;
+    image.convertTo(current, CV_16S, (double)(1 << fractionBits));
+    laplacian.resize(levels);
+
+    for (int level = 0; level < levels; level++) {
+        pyrDown(current, down);
+        pyrUp(down, up, current.size());
+        subtract(current, up, laplacian[level]);
+        current = down;
+    }
+
+    residual = current;
+}
+
+
+void collapseLaplacianPyramid(const std::vector<Mat>& laplacian, const Mat& residual, Mat& output,
+                              int fractionBits) {
+    Mat current = residual, up;
+
+    for (int level = (int)laplacian.size() - 1; level >= 0; level--) {
+        pyrUp(current, up, laplacian[level].size());
+        add(up, laplacian[level], current);
+    }
+
+    current.convertTo(output, CV_8U, 1.0 / (1 << fractionBits));
+}
@@ -0,0 +1,19 @@
+#ifndef MERGEPHOTOS_PYRAMID_H
+#define MERGEPHOTOS_PYRAMID_H
+
+#include <vector>
+#include "opencv2/core.hpp"
+
+
+// laplacian[0..levels-1] are Laplacian levels, residual is the coarsest Gaussian level (all CV_16S, same channels)
+// fractionBits: fixed point levels (the image is scaled by 1 << fractionBits), so that the rounding errors of
+// the operations on the levels don't add up to visible steps. 4 bits keep 8 bits images far from the CV_16S range.
+void buildLaplacianPyramid(const cv::Mat& image, int levels, std::vector<cv::Mat>& laplacian, cv::Mat& residual,
+                           int fractionBits = 0);
+
+// Inverse of buildLaplacianPyramid (same fractionBits), rounded and saturated to CV_8U
+void collapseLaplacianPyramid(const std::vector<cv::Mat>& laplacian, const cv::Mat& residual, cv::Mat& output,
+                              int fractionBits = 0);
+
+
+#endif //MERGEPHOTOS_PYRAMID_H
@@ -0,0 +1,121 @@
+#include "registration.h"
+#include <algorithm>
+#include <cmath>
+#include "profile.h"
+#include "opencv2/features2d.hpp"
+#include "opencv2/imgproc.hpp"
+
+
+using namespace cv;
+
+
+static
+Ptr<Feature2D> createFeaturesFinder(int features) {
+    switch (features) {
+        case PANORAMA_FEATURES_ORB:
+            return ORB::create();   // same as the Stitcher panorama preset
+
+        case PANORAMA_FEATURES_AKAZE:
+            return AKAZE::create();
+    }
+
+    return Ptr<Feature2D>();
+}
+
+
+// Candidate pairs: the next images in capture order (and the loop closure)
+static
+Mat matchMask(int count, const RegistrationOptions& options) {
+    if (options.neighbours <= 0) return Mat(count, count, CV_8U, Scalar::all(1));
+
+    Mat mask(count, count, CV_8U, Scalar::all(0));
+    for (int i = 0; i < count; i++) {
+        for (int j = i + 1; j <= std::min(count - 1, i + options.neighbours); j++)
+            mask.at<uchar>(i, j) = 1;
+    }
+
+    if (options.closeLoop && count > 2)
+        mask.at<uchar>(0, count - 1) = 1;
+
+    return mask;
+}
+
+
+bool registerPanorama(const std::vector<Mat>& images, std::vector<detail::CameraParams>& cameras,
+                      std::vector<int>& component, const RegistrationOptions& options, JobControl* control) {
+    const int count = (int)images.size();
+    if (count < 2 || images[0].empty()) return false;
+    if (!createFeaturesFinder(options.features)) return false;
+
+    const double workScale = std::min(1.0, std::sqrt(options.megapixels * 1e6 / images[0].size().area()));
+    std::vector<detail::ImageFeatures> features(count);
+
+    {
+        ScopedStage stage("register-features");
+        JobProgress progress(control, count, 0.0f, 0.4f);
+
+        // Feature2D instances are not shared between threads
+        parallel_for_(Range(0, count), [&](const Range& range) {
+            Ptr<Feature2D> finder = createFeaturesFinder(options.features);
+            for (int i = range.start; i < range.end; i++) {
+                if (isCancelled(control)) return;
+
+                Mat work;
+                resize(images[i], work, Size(), workScale, workScale, INTER_LINEAR_EXACT);
+                detail::computeImageFeatures(finder, work, features[i]);
+                features[i].img_idx = i;
+                progress.advance();
+            }
+        });
+    }
+
+    if (isCancelled(control)) return false;
+
+    std::vector<detail::MatchesInfo> pairwise;
+
+    {
+        ScopedStage stage("register-match");
+        // same matcher as the Stitcher panorama preset, it runs the pairs in parallel
+        detail::BestOf2NearestMatcher matcher(false);
+        matcher(features, pairwise, matchMask(count, options).getUMat(ACCESS_READ));
+        matcher.collectGarbage();
+    }
+
+    if (isCancelled(control)) return false;
+    if (control) control->setProgress(0.5f);
+
+    ScopedStage stage("register-adjust");
+
+    component = detail::leaveBiggestComponent(features, pairwise, (float)PANORAMA_CONFIDENCE);
+    if (component.size() < 2) return false;
+
+    detail::HomographyBasedEstimator estimator;
+    if (!estimator(features, pairwise, cameras)) return false;
+
+    for (auto& camera: cameras) {
+        Mat R;
+        camera.R.convertTo(R, CV_32F);
+        camera.R = R;
+    }
+
+    detail::BundleAdjusterRay adjuster;
+    adjuster.setConfThresh(PANORAMA_CONFIDENCE);
+    if (!adjuster(features, pairwise, cameras)) return false;
+
+    if (isCancelled(control)) return false;
+
+    std::vector<Mat> rotations;
+    for (const auto& camera: cameras)
+        rotations.push_back(camera.R.clone());
+    detail::waveCorrect(rotations, detail::WAVE_CORRECT_HORIZ);
+
+    for (size_t i = 0; i < cameras.size(); i++) {
+        cameras[i].R = rotations[i];
+        // full resolution pixels
+        cameras[i].focal /= workScale;
+        cameras[i].ppx /= workScale;
+        cameras[i].ppy /= workScale;
+    }
+
+    return true;
+}
@@ -0,0 +1,41 @@
+#ifndef MERGEPHOTOS_REGISTRATION_H
+#define MERGEPHOTOS_REGISTRATION_H
+
+#include <vector>
+#include "opencv2/core.hpp"
+#include "opencv2/stitching.hpp"
+#include "job.h"
+
+
+#define PANORAMA_REGISTRATION_MEGAPIXELS    0.6     // same as Stitcher
+#define PANORAMA_MATCH_NEIGHBOURS           2
+#define PANORAMA_CONFIDENCE                 1.0     // same as the Stitcher panorama preset
+
+
+enum PanoramaFeatures {
+    PANORAMA_FEATURES_ORB = 0,
+    PANORAMA_FEATURES_AKAZE
+};
+
+
+struct RegistrationOptions {
+    int features = PANORAMA_FEATURES_ORB;
+    // Each image is only matched with the next ones in capture order (0: all the pairs, like Stitcher)
+    int neighbours = PANORAMA_MATCH_NEIGHBOURS;
+    // Also match the last image with the first one (360 degrees panoramas)
+    bool closeLoop = true;
+    double megapixels = PANORAMA_REGISTRATION_MEGAPIXELS;
+};
+
+
+// Same steps as Stitcher::estimateTransform (features, matching, homography based estimation, ray bundle
+// adjustment, horizontal wave correction) but the features of all the images are detected concurrently and
+// only the neighbour pairs are matched: the matching cost grows linearly with the number of images.
+//
+// cameras: for images[component[i]], in full resolution pixels
+bool registerPanorama(const std::vector<cv::Mat>& images, std::vector<cv::detail::CameraParams>& cameras,
+                      std::vector<int>& component, const RegistrationOptions& options = RegistrationOptions(),
+                      JobControl* control = nullptr);
+
+
+#endif //MERGEPHOTOS_REGISTRATION_H
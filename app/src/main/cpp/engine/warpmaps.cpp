@@ -0,0 +1,203 @@
+#include "warpmaps.h"
+#include <cstring>
+#include "panorama.h"
+#include "opencv2/imgproc.hpp"
+#include "opencv2/stitching/detail/warpers.hpp"
+
+
+using namespace cv;
+
+
+// Source coordinates of the warped pixels in roi (same as RotationWarperBase::buildMaps, for a part of the warped image)
+template<class P>
+static
+void buildProjectorMaps(const Mat& K, const Mat& R, float scale, const Rect& roi, Mat& xmap, Mat& ymap) {
+    P projector;
+    projector.scale = scale;
+    projector.setCameraParams(K, R);
+
+    xmap.create(roi.size(), CV_32F);
+    ymap.create(roi.size(), CV_32F);
+
+    parallel_for_(Range(0, roi.height), [&](const Range& range) {
+        P rowProjector = projector;
+        for (int y = range.start; y < range.end; y++) {
+            float* xs = xmap.ptr<float>(y);
+            float* ys = ymap.ptr<float>(y);
+            for (int x = 0; x < roi.width; x++)
+                rowProjector.mapBackward((float)(roi.x + x), (float)(roi.y + y), xs[x], ys[x]);
+        }
+    });
+}
+
+
+static
+bool buildTileMaps(int projection, const Mat& K, const Mat& R, float scale, const Rect& roi, Mat& xmap, Mat& ymap) {
+    switch (projection) {
+        case PANORAMA_PLANE:
+            buildProjectorMaps<detail::PlaneProjector>(K, R, scale, roi, xmap, ymap);
+            return true;
+
+        case PANORAMA_CYLINDRICAL:
+            buildProjectorMaps<detail::CylindricalProjector>(K, R, scale, roi, xmap, ymap);
+            return true;
+
+        case PANORAMA_SPHERICAL:
+            buildProjectorMaps<detail::SphericalProjector>(K, R, scale, roi, xmap, ymap);
+            return true;
+    }
+
+    return false;
+}
+
+
+// Pixels mapped inside the source image (same as warping a full mask with INTER_NEAREST)
+static
+void validMask(const Mat& xmap, const Mat& ymap, const Size& sourceSize, Mat& mask) {
+    mask.create(xmap.size(), CV_8U);
+    const float maxX = sourceSize.width - 0.5f;
+    const float maxY = sourceSize.height - 0.5f;
+
+    parallel_for_(Range(0, xmap.rows), [&](const Range& range) {
+        for (int y = range.start; y < range.end; y++) {
+            const float* xs = xmap.ptr<float>(y);
+            const float* ys = ymap.ptr<float>(y);
+            uchar* m = mask.ptr<uchar>(y);
+            for (int x = 0; x < xmap.cols; x++)
+                m[x] = (xs[x] >= -0.5f && xs[x] < maxX && ys[x] >= -0.5f && ys[x] < maxY) ? 255 : 0;
+        }
+    });
+}
+
+
+bool panoramaWarpMaps(int projection, const Mat& K, const Mat& R, float scale, const Size& sourceSize,
+                      const Rect& roi, WarpMaps& maps) {
+    if (CV_32F != K.type() || CV_32F != R.type() || 9 != K.total() || 9 != R.total() || roi.empty()) return false;
+
+    Mat xmap, ymap;
+    if (!buildTileMaps(projection, K, R, scale, roi, xmap, ymap)) return false;
+
+    maps = WarpMaps();
+    validMask(xmap, ymap, sourceSize, maps.mask);
+    // fixed point maps: 6 bytes per pixel instead of 8, and remap skips the conversion
+    if (0 != countNonZero(maps.mask))
+        convertMaps(xmap, ymap, maps.map1, maps.map2, CV_16SC2);
+    else
+        maps.mask.release();
+
+    return true;
+}
+
+
+bool WarpMapCache::Key::operator<(const Key& other) const {
+    return memcmp(this, &other, sizeof(Key)) < 0;
+}
+
+
+// entries with no pixel still count, so they are evicted too
+size_t WarpMapCache::size(const WarpMaps& maps) {
+    return sizeof(Entry) + sizeof(Key) + maps.map1.total() * maps.map1.elemSize() + maps.map2.total() * maps.map2.elemSize()
+           + maps.mask.total() * maps.mask.elemSize();
+}
+
+
+bool WarpMapCache::makeRoom(size_t bytes) {
+    if (bytes > budget_) return false;
+
+    // a block used by this compose is more recent than all the blocks of the previous composes
+    while (stats_.bytes + bytes > budget_ && !order_.empty()) {
+        auto last = entries_.find(order_.back());
+        if (generation_ == last->second.generation) return false;
+        stats_.bytes -= size(last->second.maps);
+        entries_.erase(last);
+        order_.pop_back();
+    }
+
+    return stats_.bytes + bytes <= budget_;
+}
+
+
+const WarpMaps* WarpMapCache::block(const Key& key, const Mat& K, const Mat& R, const Size& sourceSize) {
+    auto it = entries_.find(key);
+    if (entries_.end() != it) {
+        order_.splice(order_.begin(), order_, it->second.order);
+        it->second.generation = generation_;
+        stats_.hits++;
+        return &it->second.maps;
+    }
+
+    stats_.misses++;
+    const Rect rect(key.blockX * WARP_MAP_BLOCK_SIZE, key.blockY * WARP_MAP_BLOCK_SIZE, WARP_MAP_BLOCK_SIZE, WARP_MAP_BLOCK_SIZE);
+    WarpMaps maps;
+    if (!panoramaWarpMaps(key.projection, K, R, key.scale, sourceSize, rect, maps)) return nullptr;
+
+    const size_t bytes = size(maps);
+    if (!makeRoom(bytes)) {
+        uncached_ = maps;
+        return &uncached_;
+    }
+
+    order_.push_front(key);
+    Entry& entry = entries_[key];
+    entry = { maps, order_.begin(), generation_ };
+    stats_.bytes += bytes;
+    return &entry.maps;
+}
+
+
+bool WarpMapCache::maps(int projection, const Mat& K, const Mat& R, float scale, const Size& sourceSize,
+                        const Rect& roi, WarpMaps& maps) {
+    if (CV_32F != K.type() || CV_32F != R.type() || 9 != K.total() || 9 != R.total() || roi.empty()) return false;
+
+    Key key;
+    memset(&key, 0, sizeof(key));
+    key.projection = projection;
+    key.scale = scale;
+    memcpy(key.K, K.isContinuous() ? K.ptr<float>() : K.clone().ptr<float>(), sizeof(key.K));
+    memcpy(key.R, R.isContinuous() ? R.ptr<float>() : R.clone().ptr<float>(), sizeof(key.R));
+    key.sourceWidth = sourceSize.width;
+    key.sourceHeight = sourceSize.height;
+
+    const int firstX = cvFloor((double)roi.x / WARP_MAP_BLOCK_SIZE), lastX = cvFloor((double)(roi.br().x - 1) / WARP_MAP_BLOCK_SIZE);
+    const int firstY = cvFloor((double)roi.y / WARP_MAP_BLOCK_SIZE), lastY = cvFloor((double)(roi.br().y - 1) / WARP_MAP_BLOCK_SIZE);
+
+    maps.map1.create(roi.size(), CV_16SC2);
+    maps.map2.create(roi.size(), CV_16UC1);
+    maps.mask.create(roi.size(), CV_8U);
+    bool mapped = false;
+
+    for (key.blockY = firstY; key.blockY <= lastY; key.blockY++) {
+        for (key.blockX = firstX; key.blockX <= lastX; key.blockX++) {
+            const WarpMaps* block = this->block(key, K, R, sourceSize);
+            if (nullptr == block) return false;
+
+            const Rect blockRect(key.blockX * WARP_MAP_BLOCK_SIZE, key.blockY * WARP_MAP_BLOCK_SIZE,
+                                 WARP_MAP_BLOCK_SIZE, WARP_MAP_BLOCK_SIZE);
+            const Rect part = blockRect & roi;
+            const Rect to = part - roi.tl(), from = part - blockRect.tl();
+
+            if (block->mask.empty()) {
+                maps.map1(to).setTo(Scalar::all(0));
+                maps.map2(to).setTo(Scalar::all(0));
+                maps.mask(to).setTo(Scalar::all(0));
+                continue;
+            }
+
+            block->map1(from).copyTo(maps.map1(to));
+            block->map2(from).copyTo(maps.map2(to));
+            block->mask(from).copyTo(maps.mask(to));
+            mapped = true;
+        }
+    }
+
+    if (!mapped || 0 == countNonZero(maps.mask)) maps = WarpMaps();
+    return true;
+}
+
+
+void WarpMapCache::clear() {
+    entries_.clear();
+    order_.clear();
+    uncached_ = WarpMaps();
+    stats_ = WarpMapCacheStats();
+}
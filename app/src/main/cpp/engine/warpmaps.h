@@ -0,0 +1,90 @@
+#ifndef MERGEPHOTOS_WARPMAPS_H
+#define MERGEPHOTOS_WARPMAPS_H
+
+#include <list>
+#include <map>
+#include "opencv2/core.hpp"
+
+
+#define WARP_MAP_CACHE_MEGABYTES        96      // maps kept by a panorama for re-compositing
+#define WARP_MAP_BLOCK_SIZE             128     // maps are cached by blocks of warped pixels, in a fixed grid
+
+
+// Source coordinates of a part of a warped image, in the compact remap format.
+// All empty if no pixel maps inside the source image.
+struct WarpMaps {
+    cv::Mat map1;       // CV_16SC2: integer source coordinates
+    cv::Mat map2;       // CV_16UC1: interpolation table index (convertMaps)
+    cv::Mat mask;       // CV_8U: pixels mapped inside the source image
+};
+
+struct WarpMapCacheStats {
+    int hits = 0;       // blocks
+    int misses = 0;
+    size_t bytes = 0;
+};
+
+
+// Maps of the pixels in roi of the image warped with projection (PanoramaProjection), camera K, R (CV_32F)
+// and warped scale. Not cached.
+bool panoramaWarpMaps(int projection, const cv::Mat& K, const cv::Mat& R, float scale, const cv::Size& sourceSize,
+                      const cv::Rect& roi, WarpMaps& maps);
+
+
+// Projection maps of the images of one panorama, kept for its next composes (other quality, other output,
+// frames added to an incremental panorama whose cameras didn't move).
+//
+// The maps are cached by blocks of a fixed grid of the warped image, keyed by the camera, the source size,
+// the projection and the block, so they don't depend on the tiles or on the blending margin (quality).
+// A compose can need more maps than the budget (full size panorama): the blocks used by the current compose
+// are never evicted, so a compose that doesn't fit keeps its first blocks instead of evicting each block
+// before the next compose reuses it. The blocks of the previous composes are evicted first (least recently used).
+//
+// Owned by a panorama (session): the maps are released with it. Not thread safe (used under the panorama lock).
+class WarpMapCache {
+public:
+    explicit WarpMapCache(size_t megabytes = WARP_MAP_CACHE_MEGABYTES) : budget_(megabytes * 1024 * 1024) {}
+
+    // Called before each compose
+    void beginCompose() { generation_++; }
+
+    // Same as panoramaWarpMaps, assembled from the cached blocks. The returned Mats are not shared with the cache.
+    bool maps(int projection, const cv::Mat& K, const cv::Mat& R, float scale, const cv::Size& sourceSize,
+              const cv::Rect& roi, WarpMaps& maps);
+
+    WarpMapCacheStats stats() const { return stats_; }
+    void clear();
+
+private:
+    // Plain bytes (zero filled), compared with memcmp
+    struct Key {
+        int projection;
+        float scale;
+        float K[9];
+        float R[9];
+        int sourceWidth, sourceHeight;
+        int blockX, blockY;
+
+        bool operator<(const Key& other) const;
+    };
+
+    struct Entry {
+        WarpMaps maps;
+        std::list<Key>::iterator order;
+        int generation;
+    };
+
+    const WarpMaps* block(const Key& key, const cv::Mat& K, const cv::Mat& R, const cv::Size& sourceSize);
+    bool makeRoom(size_t bytes);
+    static size_t size(const WarpMaps& maps);
+
+    size_t budget_;
+    int generation_ = 0;
+    std::map<Key, Entry> entries_;
+    std::list<Key> order_;      // most recently used first
+    WarpMaps uncached_;         // last block that didn't fit
+    WarpMapCacheStats stats_;
+};
+
+
+#endif //MERGEPHOTOS_WARPMAPS_H
@@ -1,231 +1,460 @@
 #include <jni.h>
+#include <algorithm>
+#include <unistd.h>
 #include <string>
 #include <vector>
-#include "opencv2/stitching.hpp"
-#include "opencv2/imgproc.hpp"
+#include "engine/align.h"
+#include "engine/borders.h"
+#include "engine/focusstack.h"
+#include "engine/hdr.h"
+#include "engine/imageio.h"
+#include "engine/incrementalpanorama.h"
+#include "engine/job.h"
+#include "engine/longexposure.h"
+#include "engine/panorama.h"
 
 
 using namespace cv;
 
 
-typedef Point3_<uchar> Pixel;
-
-
 static
-unsigned int calculateDistance(const Pixel& p1, const Pixel& p2) {
-    double rmean = (p1.x + p2.x)/2;
-    int r = p1.x - p2.x;
-    int g = p1.y - p2.y;
-    int b = p1.z - p2.z;
-    double wr = 2 + rmean/256;
-    double wg = 4.0;
-    double wb = 2 + (255-rmean)/256;
-    return (unsigned int)sqrt(wr*r*r + wg*g*g + wb*b*b);
+void Mat_to_vector_Mat(cv::Mat &mat, std::vector<cv::Mat> &v_mat) {
+    v_mat.clear();
+    if (mat.type() == CV_32SC2 && mat.cols == 1) {
+        v_mat.reserve(mat.rows);
+        for (int i = 0; i < mat.rows; i++) {
+            Vec<int, 2> a = mat.at<Vec<int, 2> >(i, 0);
+            long long addr = (((long long) a[0]) << 32) | (a[1] & 0xffffffff);
+            Mat &m = *((Mat *) addr);
+            v_mat.push_back(m);
+        }
+    }
 }
 
 
 static
-bool makeLongExposureNearestNative( std::vector<Mat> &images, const Mat &averageImage, Mat &outputImage) {
-    outputImage.create(averageImage.rows, averageImage.cols, averageImage.type());
-    if (outputImage.empty()) return false;
-
-    outputImage.forEach<Pixel>(
-        [images, averageImage](Pixel& pixel, const int position[]) -> void {
-            const auto& refPixel = averageImage.at<Pixel>(position);
-            int bestIndex = 0;
-            unsigned int bestValue = calculateDistance(refPixel, images[0].at<Pixel>(position));
-
-            for (int i = 1; i < images.size(); i++) {
-                unsigned int value = calculateDistance(refPixel, images[i].at<Pixel>(position));
-                if (value < bestValue) {
-                    bestValue = value;
-                    bestIndex = i;
-                }
-            }
-
-            pixel = images[bestIndex].at<Pixel>(position);
-        }
-    );
-
-    return true;
+std::string jstring_to_string(JNIEnv *env, jstring str) {
+    const char* chars = env->GetStringUTFChars(str, nullptr);
+    std::string result(chars ? chars : "");
+    if (chars) env->ReleaseStringUTFChars(str, chars);
+    return result;
 }
 
 
+// Same as Mat_to_vector_Mat but keeps the pointers, so the native code can write in the Java Mats
 static
-void Mat_to_vector_Mat(cv::Mat &mat, std::vector<cv::Mat> &v_mat) {
+void Mat_to_vector_Mat_ptr(cv::Mat &mat, std::vector<cv::Mat*> &v_mat) {
     v_mat.clear();
     if (mat.type() == CV_32SC2 && mat.cols == 1) {
         v_mat.reserve(mat.rows);
         for (int i = 0; i < mat.rows; i++) {
             Vec<int, 2> a = mat.at<Vec<int, 2> >(i, 0);
             long long addr = (((long long) a[0]) << 32) | (a[1] & 0xffffffff);
-            Mat &m = *((Mat *) addr);
-            v_mat.push_back(m);
+            v_mat.push_back((Mat *) addr);
         }
     }
 }
 
 
+// The handle given to Java owns a reference to the job: the job stays valid while it runs, even if Java released it
+static
+jlong startJob(const MergeJob::Task& task, jint priority) {
+    return (jlong) new std::shared_ptr<MergeJob>(MergeJob::start(task, (MergeJob::Priority) priority));
+}
+
+
+static
+jlong startJob(const MergeJob::ListTask& task, jint priority) {
+    return (jlong) new std::shared_ptr<MergeJob>(MergeJob::start(task, (MergeJob::Priority) priority));
+}
+
+
+static
+MergeJob& jobFromHandle(jlong job_nativeObj) {
+    return **((std::shared_ptr<MergeJob> *) job_nativeObj);
+}
+
+
+static
+bool copy_to_vector_Mat_ptr(const std::vector<cv::Mat> &v_src, std::vector<cv::Mat*> &v_dst) {
+    if (v_src.size() != v_dst.size()) return false;
+    for (size_t i = 0; i < v_src.size(); i++)
+        *v_dst[i] = v_src[i];
+    return true;
+}
+
+
+// The descriptors of a job: duplicated because Java closes its own as soon as the job is started,
+// closed when the job doesn't need them anymore (done, cancelled or dropped before running)
+static
+std::shared_ptr<std::vector<int>> duplicate_descriptors(JNIEnv *env, jintArray fds) {
+    std::vector<int> fdList(env->GetArrayLength(fds));
+    env->GetIntArrayRegion(fds, 0, (jsize) fdList.size(), fdList.data());
+
+    for (int &fd: fdList)
+        fd = fd >= 0 ? dup(fd) : -1;
+
+    return std::shared_ptr<std::vector<int>>(new std::vector<int>(fdList), [](std::vector<int> *fds) {
+        for (int fd: *fds)
+            if (fd >= 0) close(fd);
+        delete fds;
+    });
+}
+
+
 extern "C" {
 
 
 JNIEXPORT jboolean JNICALL
-Java_com_dan_mergephotos_MainFragment_00024Companion_makePanoramaNative(JNIEnv */*env*/, jobject /*thiz*/,
-                                                                jlong images_nativeObj,
-                                                                jlong panorama_nativeObj,
-                                                                jint projection) {
+Java_com_dan_mergephotos_MainFragment_00024Companion_readImagesNative(
+        JNIEnv *env, jobject /*thiz*/, jintArray fds, jlong images_nativeObj) {
+
+    std::vector<Mat*> imagesOutput;
+    Mat &imagesAsMat = *((Mat *) images_nativeObj);
+    Mat_to_vector_Mat_ptr(imagesAsMat, imagesOutput);
+
+    std::vector<int> fdList(env->GetArrayLength(fds));
+    env->GetIntArrayRegion(fds, 0, (jsize) fdList.size(), fdList.data());
+
+    // the decoded images are given to Java as they are, without a copy
+    std::vector<Mat> images;
+    if (!readImages(fdList, images)) return false;
+    return copy_to_vector_Mat_ptr(images, imagesOutput);
+}
+
+
+JNIEXPORT jlong JNICALL
+Java_com_dan_mergephotos_PanoramaSession_00024Companion_createNative(
+        JNIEnv */*env*/, jobject /*thiz*/, jlong images_nativeObj, jlong source_nativeObj) {
 
     std::vector<Mat> images;
     Mat &imagesAsMat = *((Mat *) images_nativeObj);
     Mat_to_vector_Mat(imagesAsMat, images);
 
-    Mat &panorama = *((Mat *) panorama_nativeObj);
+    // source is optional
+    std::shared_ptr<PanoramaSession> source;
+    if (0 != source_nativeObj) source = *((std::shared_ptr<PanoramaSession> *) source_nativeObj);
 
-    Ptr<Stitcher> stitcher = Stitcher::create(Stitcher::PANORAMA);
-    stitcher->setInterpolationFlags(INTER_LANCZOS4);
+    return (jlong) new std::shared_ptr<PanoramaSession>(std::make_shared<PanoramaSession>(images, source));
+}
 
-    switch (projection) {
-        case 0:
-            stitcher->setWarper(makePtr<cv::PlaneWarper>());
-            break;
 
-        case 1:
-            stitcher->setWarper(makePtr<cv::CylindricalWarper>());
-            break;
+JNIEXPORT void JNICALL
+Java_com_dan_mergephotos_PanoramaSession_00024Companion_releaseNative(
+        JNIEnv */*env*/, jobject /*thiz*/, jlong session_nativeObj) {
+    delete (std::shared_ptr<PanoramaSession> *) session_nativeObj;
+}
 
-        case 2:
-            stitcher->setWarper(makePtr<cv::SphericalWarper>());
-            break;
 
-        default:
-            return false;
-    }
+JNIEXPORT jlong JNICALL
+Java_com_dan_mergephotos_IncrementalPanorama_00024Companion_createNative(
+        JNIEnv */*env*/, jobject /*thiz*/, jint projection, jint quality) {
+    return (jlong) new std::shared_ptr<IncrementalPanorama>(std::make_shared<IncrementalPanorama>(projection, quality));
+}
 
-    if (Stitcher::OK != stitcher->stitch(images, panorama))
-        return false;
 
-    return true;
+JNIEXPORT void JNICALL
+Java_com_dan_mergephotos_IncrementalPanorama_00024Companion_releaseNative(
+        JNIEnv */*env*/, jobject /*thiz*/, jlong panorama_nativeObj) {
+    delete (std::shared_ptr<IncrementalPanorama> *) panorama_nativeObj;
+}
+
+
+JNIEXPORT jlong JNICALL
+Java_com_dan_mergephotos_LongExposureAccumulator_00024Companion_createNative(JNIEnv */*env*/, jobject /*thiz*/) {
+    return (jlong) new LongExposureAccumulator();
+}
+
+
+JNIEXPORT void JNICALL
+Java_com_dan_mergephotos_LongExposureAccumulator_00024Companion_releaseNative(
+        JNIEnv */*env*/, jobject /*thiz*/, jlong accumulator_nativeObj) {
+    delete (LongExposureAccumulator *) accumulator_nativeObj;
+}
+
+
+JNIEXPORT jboolean JNICALL
+Java_com_dan_mergephotos_LongExposureAccumulator_00024Companion_addNative(
+        JNIEnv */*env*/, jobject /*thiz*/, jlong accumulator_nativeObj, jlong frame_nativeObj) {
+    LongExposureAccumulator &accumulator = *((LongExposureAccumulator *) accumulator_nativeObj);
+    return accumulator.add(*((Mat *) frame_nativeObj));
 }
 
 
 JNIEXPORT jboolean JNICALL
-Java_com_dan_mergephotos_MainFragment_00024Companion_makeLongExposureNearestNative(
-        JNIEnv */*env*/, jobject /*thiz*/, jlong images_nativeObj, jlong averageImage_nativeObj, jlong outputImage_nativeObj) {
+Java_com_dan_mergephotos_LongExposureAccumulator_00024Companion_resultNative(
+        JNIEnv */*env*/, jobject /*thiz*/, jlong accumulator_nativeObj, jlong output_nativeObj) {
+    LongExposureAccumulator &accumulator = *((LongExposureAccumulator *) accumulator_nativeObj);
+    return accumulator.result(*((Mat *) output_nativeObj));
+}
+
+
+JNIEXPORT jlong JNICALL
+Java_com_dan_mergephotos_MergeJob_00024Companion_startPanoramaNative(
+        JNIEnv */*env*/, jobject /*thiz*/, jlong session_nativeObj, jint projection, jint quality, jint borders,
+        jint priority) {
+
+    // the job keeps the session alive, even if Java releases it meanwhile
+    std::shared_ptr<PanoramaSession> session = *((std::shared_ptr<PanoramaSession> *) session_nativeObj);
+
+    return startJob([session, projection, quality, borders](JobControl* control, Mat& output) {
+        return session->compose(projection, quality, output, control)
+               && finishPanoramaBorders(output, borders, control);
+    }, priority);
+}
+
+
+JNIEXPORT jlong JNICALL
+Java_com_dan_mergephotos_MergeJob_00024Companion_startPanoramaToFileNative(
+        JNIEnv *env, jobject /*thiz*/, jlong session_nativeObj, jint projection, jint quality, jint borders, jstring path,
+        jstring spillDirectory, jint jpegQuality, jint priority) {
 
+    std::shared_ptr<PanoramaSession> session = *((std::shared_ptr<PanoramaSession> *) session_nativeObj);
+    const std::string outputPath = jstring_to_string(env, path);
+    CompositorOptions options;
+    options.spillDirectory = jstring_to_string(env, spillDirectory);
+
+    // the output never goes to Java: the tiles are composed in a file-backed buffer and encoded from there
+    return startJob([session, projection, quality, borders, outputPath, options, jpegQuality](JobControl* control, Mat& output) {
+        if (!session->composeTiled(projection, quality, output, options, control)) return false;
+        if (!finishPanoramaBorders(output, borders, control)) return false;
+        return !isCancelled(control) && writeJpeg(outputPath, output, jpegQuality);
+    }, priority);
+}
+
+
+JNIEXPORT jlong JNICALL
+Java_com_dan_mergephotos_MergeJob_00024Companion_startIncrementalPanoramaNative(
+        JNIEnv */*env*/, jobject /*thiz*/, jlong panorama_nativeObj, jlong images_nativeObj, jint borders,
+        jint priority) {
+
+    std::shared_ptr<IncrementalPanorama> panorama = *((std::shared_ptr<IncrementalPanorama> *) panorama_nativeObj);
     std::vector<Mat> images;
     Mat &imagesAsMat = *((Mat *) images_nativeObj);
     Mat_to_vector_Mat(imagesAsMat, images);
-    Mat &averageImage = *((Mat *) averageImage_nativeObj);
-    Mat &outputImage = *((Mat *) outputImage_nativeObj);
-
-    if ( averageImage.empty()
-         || averageImage.size.dims() != 2
-         || !(averageImage.type() == CV_8UC3 || averageImage.type() == CV_16UC3))
-        return false;
 
-    return makeLongExposureNearestNative(images, averageImage, outputImage);
+    // only the images not added yet are registered
+    return startJob([panorama, images, borders](JobControl* control, Mat& output) {
+        return panorama->update(images, control) && panorama->panorama(output)
+               && finishPanoramaBorders(output, borders, control);
+    }, priority);
 }
 
 
-JNIEXPORT jboolean JNICALL
-Java_com_dan_mergephotos_MainFragment_00024Companion_makeLongExposureLightOrDarkNative(
-        JNIEnv */*env*/, jobject /*thiz*/, jlong images_nativeObj, jlong outputImage_nativeObj, jboolean light) {
+JNIEXPORT jlong JNICALL
+Java_com_dan_mergephotos_MergeJob_00024Companion_startLongExposureNearestNative(
+        JNIEnv */*env*/, jobject /*thiz*/, jlong images_nativeObj, jlong averageImage_nativeObj, jint priority) {
+
+    std::vector<Mat> images;
+    Mat &imagesAsMat = *((Mat *) images_nativeObj);
+    Mat_to_vector_Mat(imagesAsMat, images);
+    Mat averageImage = *((Mat *) averageImage_nativeObj);
+
+    return startJob([images, averageImage](JobControl* control, Mat& output) {
+        if ( averageImage.empty()
+             || averageImage.size.dims() != 2
+             || averageImage.type() != CV_8UC3)
+            return false;
+
+        return makeLongExposureNearest(images, averageImage, output, control);
+    }, priority);
+}
+
 
-    static const Pixel black(0, 0, 0);
-    static const Pixel white(255, 255, 255);
-    const Pixel& refPixel = light ? white : black;
+JNIEXPORT jlong JNICALL
+Java_com_dan_mergephotos_MergeJob_00024Companion_startLongExposureLightOrDarkNative(
+        JNIEnv */*env*/, jobject /*thiz*/, jlong images_nativeObj, jboolean light, jint priority) {
 
     std::vector<Mat> images;
     Mat &imagesAsMat = *((Mat *) images_nativeObj);
     Mat_to_vector_Mat(imagesAsMat, images);
-    Mat &outputImage = *((Mat *) outputImage_nativeObj);
 
-    if (images.size() < 2) return false;
+    return startJob([images, light](JobControl* control, Mat& output) {
+        return makeLongExposureLightOrDark(images, output, light, control);
+    }, priority);
+}
 
-    outputImage.create(images[0].rows, images[0].cols, images[0].type());
-    if (outputImage.empty()) return false;
 
-    outputImage.forEach<Pixel>(
-            [images, refPixel](Pixel& pixel, const int position[]) -> void {
-                int bestIndex = 0;
-                unsigned int bestValue = calculateDistance(images[0].at<Pixel>(position), refPixel);
+// The frames are spilled to raw files in spillDirectory, one at a time, before the bands are merged:
+// the job holds the only reference to a spilled image, which is released before the next one is read.
+JNIEXPORT jlong JNICALL
+Java_com_dan_mergephotos_MergeJob_00024Companion_startLongExposureBandedNative(
+        JNIEnv *env, jobject /*thiz*/, jlong images_nativeObj, jlong transforms_nativeObj, jint mode,
+        jstring spillDirectory, jint priority) {
 
-                for (int i = 1; i < images.size(); i++) {
-                    unsigned int value = calculateDistance(images[i].at<Pixel>(position), refPixel);
-                    if (bestValue < value) {
-                        bestValue = value;
-                        bestIndex = i;
-                    }
-                }
+    auto images = std::make_shared<std::vector<Mat>>();
+    std::vector<Mat> transforms;
+    Mat &imagesAsMat = *((Mat *) images_nativeObj);
+    Mat_to_vector_Mat(imagesAsMat, *images);
+    Mat &transformsAsMat = *((Mat *) transforms_nativeObj);
+    Mat_to_vector_Mat(transformsAsMat, transforms);
+
+    const std::string directory = jstring_to_string(env, spillDirectory);
+    auto frames = std::make_shared<std::vector<Ptr<FrameSource>>>();
+
+    return startJob([images, transforms, mode, directory, frames](JobControl* control, Mat& output) {
+        auto read = [&images](int index, Mat& image) {
+            image = (*images)[index];
+            (*images)[index].release();
+            return !image.empty();
+        };
+
+        return spillFrames((int)images->size(), read, transforms, directory, *frames, control)
+               && makeLongExposureBanded(*frames, mode, output, LONG_EXPOSURE_BAND_ROWS, control);
+    }, priority);
+}
 
-                pixel = images[bestIndex].at<Pixel>(position);
-            }
-    );
 
-    return true;
+// Same, decoding the files: the full size images are never all in memory
+JNIEXPORT jlong JNICALL
+Java_com_dan_mergephotos_MergeJob_00024Companion_startLongExposureBandedFromFilesNative(
+        JNIEnv *env, jobject /*thiz*/, jintArray fds, jlong transforms_nativeObj, jint mode,
+        jstring spillDirectory, jint priority) {
+
+    auto fdList = duplicate_descriptors(env, fds);
+    std::vector<Mat> transforms;
+    Mat &transformsAsMat = *((Mat *) transforms_nativeObj);
+    Mat_to_vector_Mat(transformsAsMat, transforms);
+
+    const std::string directory = jstring_to_string(env, spillDirectory);
+    auto frames = std::make_shared<std::vector<Ptr<FrameSource>>>();
+
+    return startJob([fdList, transforms, mode, directory, frames](JobControl* control, Mat& output) {
+        auto read = [&fdList](int index, Mat& image) {
+            return readImage((*fdList)[index], image);
+        };
+
+        return spillFrames((int)fdList->size(), read, transforms, directory, *frames, control)
+               && makeLongExposureBanded(*frames, mode, output, LONG_EXPOSURE_BAND_ROWS, control);
+    }, priority);
 }
 
 
-#define FOCUS_STACK_WORKING_SIZE    800
+JNIEXPORT jlong JNICALL
+Java_com_dan_mergephotos_MergeJob_00024Companion_startHdrNative(
+        JNIEnv */*env*/, jobject /*thiz*/, jlong images_nativeObj, jint priority) {
 
+    std::vector<Mat> images;
+    Mat &imagesAsMat = *((Mat *) images_nativeObj);
+    Mat_to_vector_Mat(imagesAsMat, images);
+
+    return startJob([images](JobControl* control, Mat& output) {
+        return makeHdr(images, output, true, control);
+    }, priority);
+}
 
-JNIEXPORT jboolean JNICALL
-Java_com_dan_mergephotos_MainFragment_00024Companion_makeFocusStackNative(
-        JNIEnv * /*env*/, jobject /*thiz*/, jlong images_nativeObj, jlong outputImage_nativeObj) {
+
+JNIEXPORT jlong JNICALL
+Java_com_dan_mergephotos_MergeJob_00024Companion_startFocusStackNative(
+        JNIEnv */*env*/, jobject /*thiz*/, jlong images_nativeObj, jint algorithm, jint priority) {
 
     std::vector<Mat> images;
     Mat &imagesAsMat = *((Mat *) images_nativeObj);
     Mat_to_vector_Mat(imagesAsMat, images);
-    Mat &outputImage = *((Mat *) outputImage_nativeObj);
 
-    std::vector<Mat> laplaces;
+    return startJob([images, algorithm](JobControl* control, Mat& output) {
+        return makeFocusStack(images, output, algorithm, control);
+    }, priority);
+}
+
 
-    for (const auto& image: images) {
-        int scaledCols, scaledRows;
+JNIEXPORT jlong JNICALL
+Java_com_dan_mergephotos_MergeJob_00024Companion_startAlignNative(
+        JNIEnv */*env*/, jobject /*thiz*/, jlong images_nativeObj, jlong mask_nativeObj, jlong previewReference_nativeObj,
+        jlong previewMask_nativeObj, jlong previewTransforms_nativeObj, jboolean refine, jlong transforms_nativeObj,
+        jboolean warp, jint priority) {
 
-        if (image.rows > image.cols) {
-            scaledRows = FOCUS_STACK_WORKING_SIZE;
-            scaledCols = FOCUS_STACK_WORKING_SIZE * image.cols / image.rows;
-        } else {
-            scaledCols = FOCUS_STACK_WORKING_SIZE;
-            scaledRows = FOCUS_STACK_WORKING_SIZE * image.rows / image.cols;
-        }
+    std::vector<Mat> images, previewTransforms, transforms;
+    Mat &imagesAsMat = *((Mat *) images_nativeObj);
+    Mat_to_vector_Mat(imagesAsMat, images);
+    Mat mask = *((Mat *) mask_nativeObj);
+    Mat previewReference = *((Mat *) previewReference_nativeObj);
+    Mat previewMask = *((Mat *) previewMask_nativeObj);
+    Mat &previewTransformsAsMat = *((Mat *) previewTransforms_nativeObj);
+    Mat_to_vector_Mat(previewTransformsAsMat, previewTransforms);
+    Mat &transformsAsMat = *((Mat *) transforms_nativeObj);
+    Mat_to_vector_Mat(transformsAsMat, transforms);
+
+    // outputs: the transforms then, if warp, the aligned images (empty for the frames that failed to align)
+    return startJob([images, mask, previewReference, previewMask, previewTransforms, refine, transforms, warp]
+                    (JobControl* control, std::vector<Mat>& outputs) {
+        std::vector<Mat> frameTransforms = transforms, alignedImages;
+        if (!alignForMerge(images, mask, previewReference, previewMask, previewTransforms, refine,
+                           frameTransforms, warp ? &alignedImages : nullptr, control)) return false;
+        outputs = frameTransforms;
+        outputs.insert(outputs.end(), alignedImages.begin(), alignedImages.end());
+        return true;
+    }, priority);
+}
 
-        Mat tmp, gray, laplace;
-        cvtColor(image, tmp, COLOR_BGR2GRAY);
-        resize(tmp, gray, Size(scaledCols, scaledRows), 0.0, 0.0, INTER_AREA);
 
-        GaussianBlur(gray, tmp, Size(3,3), 0.0);
-        Laplacian(tmp, laplace, CV_16S, 1);
-        laplace = abs(tmp);
-        GaussianBlur(laplace, tmp, Size(31,31), 0.0); //It's huge but really reduce out of focus halo
+JNIEXPORT jlong JNICALL
+Java_com_dan_mergephotos_MergeJob_00024Companion_startReadImagesNative(
+        JNIEnv *env, jobject /*thiz*/, jintArray fds, jint priority) {
+    auto fdList = duplicate_descriptors(env, fds);
+    // one output per file: the job fails if any of them can't be decoded
+    return startJob([fdList](JobControl* control, std::vector<Mat>& outputs) {
+        return readImages(*fdList, outputs, control)
+               && std::none_of(outputs.begin(), outputs.end(), [](const Mat& image) { return image.empty(); });
+    }, priority);
+}
 
-        resize(laplace, tmp, Size(image.cols, image.rows), 0.0, 0.0, INTER_LANCZOS4);
 
-        laplaces.push_back(tmp);
-    }
+JNIEXPORT jlong JNICALL
+Java_com_dan_mergephotos_MergeJob_00024Companion_startReadImagePreviewsNative(
+        JNIEnv *env, jobject /*thiz*/, jintArray fds, jint maxSize, jint priority) {
+    auto fdList = duplicate_descriptors(env, fds);
+    // one output per file, empty if the file can't be decoded
+    return startJob([fdList, maxSize](JobControl* control, std::vector<Mat>& outputs) {
+        return readImagePreviews(*fdList, maxSize, outputs, control);
+    }, priority);
+}
 
-    outputImage.create(images[0].rows, images[0].cols, images[0].type());
-    if (outputImage.empty()) return false;
 
-    outputImage.forEach<Pixel>(
-            [laplaces, images](Pixel& pixel, const int position[]) -> void {
-                int bestIndex = 0;
-                int16_t bestValue = laplaces[0].at<int16_t>(position);
+JNIEXPORT void JNICALL
+Java_com_dan_mergephotos_MergeJob_00024Companion_releaseNative(JNIEnv */*env*/, jobject /*thiz*/, jlong job_nativeObj) {
+    auto job = (std::shared_ptr<MergeJob> *) job_nativeObj;
+    (*job)->cancel();   // nobody can get the result anymore
+    delete job;
+}
+
 
-                for (int i = 1; i < laplaces.size(); i++) {
-                    int16_t value = laplaces[i].at<int16_t>(position);
-                    if (bestValue < value) {
-                        bestValue = value;
-                        bestIndex = i;
-                    }
-                }
+JNIEXPORT void JNICALL
+Java_com_dan_mergephotos_MergeJob_00024Companion_cancelNative(JNIEnv */*env*/, jobject /*thiz*/, jlong job_nativeObj) {
+    jobFromHandle(job_nativeObj).cancel();
+}
 
-                pixel = images[bestIndex].at<Pixel>(position);
-            }
-    );
 
-    return true;
+JNIEXPORT jint JNICALL
+Java_com_dan_mergephotos_MergeJob_00024Companion_stateNative(JNIEnv */*env*/, jobject /*thiz*/, jlong job_nativeObj) {
+    return jobFromHandle(job_nativeObj).state();
+}
+
+
+JNIEXPORT jfloat JNICALL
+Java_com_dan_mergephotos_MergeJob_00024Companion_progressNative(JNIEnv */*env*/, jobject /*thiz*/, jlong job_nativeObj) {
+    return jobFromHandle(job_nativeObj).progress();
+}
+
+
+JNIEXPORT jboolean JNICALL
+Java_com_dan_mergephotos_MergeJob_00024Companion_resultNative(
+        JNIEnv */*env*/, jobject /*thiz*/, jlong job_nativeObj, jlong output_nativeObj) {
+    return jobFromHandle(job_nativeObj).result(*((Mat *) output_nativeObj));
+}
+
+
+JNIEXPORT jboolean JNICALL
+Java_com_dan_mergephotos_MergeJob_00024Companion_resultsNative(
+        JNIEnv */*env*/, jobject /*thiz*/, jlong job_nativeObj, jlong outputs_nativeObj) {
+    std::vector<Mat*> outputsOutput;
+    Mat &outputsAsMat = *((Mat *) outputs_nativeObj);
+    Mat_to_vector_Mat_ptr(outputsAsMat, outputsOutput);
+
+    std::vector<Mat> outputs;
+    if (!jobFromHandle(job_nativeObj).results(outputs)) return false;
+    return copy_to_vector_Mat_ptr(outputs, outputsOutput);
 }
 
+
 }
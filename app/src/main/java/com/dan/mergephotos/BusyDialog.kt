@@ -38,6 +38,14 @@ class BusyDialog(private val title: String): DialogFragment() {
             }
         }
 
+        // Changes the title of the dialog currently shown
+        fun update(title: String) {
+            try {
+                currentDialog?.setTitle(title)
+            } catch (e: Exception) {
+            }
+        }
+
         fun dismiss(all: Boolean = false) {
             activity.runOnUiThread {
                 if( counter <= 1 || all) {
@@ -0,0 +1,22 @@
+package com.dan.mergephotos
+
+/**
+Native panorama built one frame at a time: a new frame is only matched against the last ones,
+a local bundle adjustment refines the last cameras and only the canvas part they cover is composed again.
+ */
+class IncrementalPanorama(val projection: Int, val quality: Int) {
+    companion object {
+        private external fun createNative(projection: Int, quality: Int): Long
+        private external fun releaseNative(nativeObj: Long)
+    }
+
+    var nativeObj = createNative(projection, quality)
+        private set
+
+    fun release() {
+        if (0L != nativeObj) {
+            releaseNative(nativeObj)
+            nativeObj = 0L
+        }
+    }
+}
@@ -0,0 +1,29 @@
+package com.dan.mergephotos
+
+import org.opencv.core.Mat
+
+/**
+Running sum of frames (native, 32 bits per channel): the frames are added one at a time,
+so the average never needs a 32 bits copy of the whole stack.
+ */
+class LongExposureAccumulator {
+    companion object {
+        private external fun createNative(): Long
+        private external fun releaseNative(nativeObj: Long)
+        private external fun addNative(nativeObj: Long, frame: Long): Boolean
+        private external fun resultNative(nativeObj: Long, output: Long): Boolean
+    }
+
+    private var nativeObj = createNative()
+
+    fun add(frame: Mat): Boolean = 0L != nativeObj && addNative(nativeObj, frame.nativeObj)
+
+    fun result(output: Mat): Boolean = 0L != nativeObj && resultNative(nativeObj, output.nativeObj)
+
+    fun release() {
+        if (0L != nativeObj) {
+            releaseNative(nativeObj)
+            nativeObj = 0L
+        }
+    }
+}
@@ -2,7 +2,6 @@ package com.dan.mergephotos
 
 import android.content.Intent
 import android.graphics.Bitmap
-import android.graphics.BitmapFactory
 import android.media.MediaScannerConnection
 import android.net.Uri
 import android.os.Bundle
@@ -14,13 +13,10 @@ import androidx.core.view.isVisible
 import androidx.documentfile.provider.DocumentFile
 import com.dan.mergephotos.databinding.MainFragmentBinding
 import org.opencv.android.Utils
-import org.opencv.calib3d.Calib3d
 import org.opencv.core.*
-import org.opencv.video.Video.calcOpticalFlowPyrLK
 import org.opencv.imgproc.Imgproc
 import org.opencv.imgproc.Imgproc.INTER_LANCZOS4
 import org.opencv.imgproc.Imgproc.INTER_NEAREST
-import org.opencv.photo.Photo
 import org.opencv.utils.Converters
 import java.io.File
 import kotlin.concurrent.timer
@@ -28,72 +24,50 @@ import kotlin.concurrent.timer
 class MainFragment(activity: MainActivity) : AppFragment(activity) {
     companion object {
         private const val INTENT_OPEN_IMAGES = 2
+        private const val INTENT_ADD_IMAGES = 3
 
         private const val CACHE_IMAGES = "Big"
         private const val CACHE_IMAGES_SMALL = "Small"
         private const val CACHE_IMAGES_ALIGNED_SUFFIX = ".Aligned"
+        private const val CACHE_TRANSFORMS_SUFFIX = ".Transforms"
         private const val CACHE_MASK_SUFFIX = ".Mask"
         private const val CACHE_IMAGES_AVERAGE_SUFFIX = ".Average"
 
-        private fun makePanorama(images: List<Mat>, panorama: Mat, projection: Int): Boolean {
+        // Decodes the files in parallel, straight to RGB: images must have one Mat per descriptor,
+        // a Mat stays empty if its file can't be decoded
+        private fun readImages(fds: IntArray, images: List<Mat>): Boolean {
             val imagesMat = Converters.vector_Mat_to_Mat(images)
-            return makePanoramaNative(imagesMat.nativeObj, panorama.nativeObj, projection)
+            return readImagesNative(fds, imagesMat.nativeObj)
         }
 
-        private fun makeLongExposureNearest(
-            images: List<Mat>,
-            averageImage: Mat,
-            outputImage: Mat
-        ): Boolean {
-            if (images.size < 3) return false
-            val imagesMat = Converters.vector_Mat_to_Mat(images)
-            return makeLongExposureNearestNative(
-                imagesMat.nativeObj,
-                averageImage.nativeObj,
-                outputImage.nativeObj
-            )
-        }
-
-        private fun makeLongExposureLightOrDark(
-            images: List<Mat>,
-            outputImage: Mat,
-            light: Boolean
-        ): Boolean {
-            if (images.size < 2) return false
-            val imagesMat = Converters.vector_Mat_to_Mat(images)
-            return makeLongExposureLightOrDarkNative(
-                imagesMat.nativeObj,
-                outputImage.nativeObj,
-                light
-            )
-        }
-
-        private fun makeFocusStack(
-            images: List<Mat>,
-            outputImage: Mat
-        ): Boolean {
-            if (images.size < 2) return false
-            val imagesMat = Converters.vector_Mat_to_Mat(images)
-            return makeFocusStackNative(
-                imagesMat.nativeObj,
-                outputImage.nativeObj
-            )
-        }
-
-        private external fun makePanoramaNative(images: Long, panorama: Long, projection: Int): Boolean
-        private external fun makeLongExposureNearestNative(images: Long, averageImage: Long, outputImage: Long): Boolean
-        private external fun makeLongExposureLightOrDarkNative(images: Long, outputImage: Long, light: Boolean): Boolean
-        private external fun makeFocusStackNative(images: Long, outputImage: Long): Boolean
+        private external fun readImagesNative(fds: IntArray, images: Long): Boolean
 
         fun show(activity: MainActivity) {
             activity.pushView("Merge Photos", MainFragment(activity))
         }
     }
 
+    private fun jobPriority(prefix: String) = if (CACHE_IMAGES_SMALL == prefix) MergeJob.PRIORITY_PREVIEW else MergeJob.PRIORITY_FULL
+
+    // Output of a merge: the images if they are already available, else the job computing them.
+    // If file is set the job saves its output directly in it (nothing to encode).
+    // onFailed: replaces the result if the job fails (for example to run the merge another way)
+    private class MergeOutput(val name: String, val images: List<Mat> = listOf(), val job: MergeJob? = null, val file: File? = null,
+                              val onFailed: (() -> Unit)? = null)
+
     private lateinit var binding: MainFragmentBinding
     private val cache = mutableMapOf<String, MutableList<Mat>>()
+    // Sources of the full size images (same order as the previews): only decoded when a full size merge needs them
+    private val imageUris = mutableListOf<Uri>()
+    private val panoramaSessions = mutableMapOf<String, PanoramaSession>()
+    // Preview panorama of images added a few at a time: only the new frames are registered and composed
+    private var incrementalPanorama: IncrementalPanorama? = null
+    private var imagesAppended = false
+    // A frame didn't overlap the last ones: the previews of this set of images always use a full session
+    private var incrementalPanoramaFailed = false
     private var outputName = Settings.DEFAULT_NAME
     private var firstSourceUri: Uri? = null
+    private var previewJob: MergeJob? = null
 
     private val listenerOnItemSelectedListener = object : AdapterView.OnItemSelectedListener {
         override fun onItemSelected(parent: AdapterView<*>, view: View, position: Int, id: Long) {
@@ -101,6 +75,7 @@ class MainFragment(activity: MainActivity) : AppFragment(activity) {
                 binding.spinnerMerge -> {
                     binding.panoramaOptions.isVisible = Settings.MERGE_PANORAMA == position
                     binding.longexposureOptions.isVisible = Settings.MERGE_LONG_EXPOSURE == position
+                    binding.focusstackOptions.isVisible = Settings.MERGE_FOCUS_STACK == position
                     binding.alignOptions.isVisible = Settings.MERGE_PANORAMA != position
                 }
             }
@@ -120,7 +95,12 @@ class MainFragment(activity: MainActivity) : AppFragment(activity) {
     override fun onOptionsItemSelected(item: MenuItem): Boolean {
         when(item.itemId) {
             R.id.loadImages -> {
-                startActivityToOpenImages()
+                startActivityToOpenImages(INTENT_OPEN_IMAGES)
+                return true
+            }
+
+            R.id.addImages -> {
+                startActivityToOpenImages(INTENT_ADD_IMAGES)
                 return true
             }
 
@@ -141,7 +121,7 @@ class MainFragment(activity: MainActivity) : AppFragment(activity) {
     override fun onActivityResult(requestCode: Int, resultCode: Int, data: Intent?) {
         super.onActivityResult(requestCode, resultCode, data)
 
-        if (resultCode == AppCompatActivity.RESULT_OK && requestCode == INTENT_OPEN_IMAGES) {
+        if (resultCode == AppCompatActivity.RESULT_OK && (requestCode == INTENT_OPEN_IMAGES || requestCode == INTENT_ADD_IMAGES)) {
             data?.clipData?.let { clipData ->
                 val uriList = mutableListOf<Uri>()
                 val count = clipData.itemCount
@@ -149,62 +129,87 @@ class MainFragment(activity: MainActivity) : AppFragment(activity) {
                     uriList.add(clipData.getItemAt(i).uri)
                 }
 
-                loadImages(uriList.toList())
+                loadImages(uriList.toList(), requestCode == INTENT_ADD_IMAGES)
             }
         }
     }
 
-    private fun loadImages( uriList: List<Uri> ) {
-        imagesClear()
-        outputName = Settings.DEFAULT_NAME
-        firstSourceUri = null
+    private fun loadImages( uriList: List<Uri>, append: Boolean = false ) {
+        val previousImagesSmall = cache[CACHE_IMAGES_SMALL]
+        val appendImages = append && null != previousImagesSmall && previousImagesSmall.size == imageUris.size
+
+        if (appendImages) {
+            imagesAppendClear()
+        } else {
+            imagesClear()
+            outputName = Settings.DEFAULT_NAME
+            firstSourceUri = null
+        }
         BusyDialog.show(/*supportFragmentManager*/ requireFragmentManager(), "Loading images")
 
-        val imagesBig = mutableListOf<Mat>()
+        val uris = mutableListOf<Uri>()
         val imagesSmall = mutableListOf<Mat>()
+        val previousCount = if (appendImages) imageUris.size else 0
+        if (appendImages) {
+            uris.addAll(imageUris)
+            imagesSmall.addAll(previousImagesSmall!!)
+        }
 
-        runFakeAsync {
-            var nameFound = false
-
-            for (uri in uriList) {
-                val image = loadImage(uri) ?: continue
-                if (null == firstSourceUri) firstSourceUri = uri
+        // Decoded on the job workers (JPEG previews come from a reduced decode): the UI keeps running
+        val previews = uriList.map { Mat() }
+        val job = readDescriptors(uriList) { fds -> MergeJob.readImagePreviews(fds, Settings.IMG_SIZE_SMALL, MergeJob.PRIORITY_PREVIEW) }
+        job.observe(
+            { progress -> BusyDialog.update("Loading images ... ${(progress * 100).toInt()}%") },
+            { state, _ ->
+                if (MergeJob.STATE_DONE != state) {
+                    BusyDialog.dismiss()
+                    if (MergeJob.STATE_FAILED == state) showToast("Failed to load images")
+                    return@observe
+                }
 
-                try {
-                    if (!nameFound) {
-                        DocumentFile.fromSingleUri( requireContext(), uri )?.name?.let { name ->
-                            if (name.isNotEmpty()) {
-                                nameFound = true
-                                val fields = name.split('.')
-                                outputName = fields[0]
+                var nameFound = appendImages
+
+                // an empty preview: the file can't be decoded
+                for ((uri, image) in uriList.zip(previews)) {
+                    if (image.empty()) continue
+                    if (null == firstSourceUri) firstSourceUri = uri
+
+                    try {
+                        if (!nameFound) {
+                            DocumentFile.fromSingleUri( requireContext(), uri )?.name?.let { name ->
+                                if (name.isNotEmpty()) {
+                                    nameFound = true
+                                    val fields = name.split('.')
+                                    outputName = fields[0]
+                                }
                             }
                         }
+                    } catch (e: Exception) {
+                        e.printStackTrace()
                     }
-                } catch (e: Exception) {
-                    e.printStackTrace()
-                }
-
-                imagesBig.add(image)
-            }
 
-            if (imagesBig.size < 2) {
-                showNotEnoughImagesToast()
-            } else {
-                for (image in imagesBig) {
-                    imagesSmall.add(createSmallImage(image))
+                    uris.add(uri)
+                    imagesSmall.add(image)
                 }
 
-                if (imagesBig.size < 2) {
+                if (uris.size < 2) {
                     showNotEnoughImagesToast()
                 } else {
-                    cache[CACHE_IMAGES] = imagesBig
+                    imageUris.clear()
+                    imageUris.addAll(uris)
                     cache[CACHE_IMAGES_SMALL] = imagesSmall
+                    if (appendImages && uris.size > previousCount) {
+                        releaseFullImages()
+                        imagesAppended = true
+                    }
                     mergePhotosSmall()
                 }
-            }
 
-            BusyDialog.dismiss()
-        }
+                BusyDialog.dismiss()
+            },
+            false,
+            previews
+        )
     }
 
     private fun runFakeAsync(l: () -> Unit) {
@@ -220,7 +225,7 @@ class MainFragment(activity: MainActivity) : AppFragment(activity) {
         showToast("You must select at least 2 images")
     }
 
-    private fun startActivityToOpenImages() {
+    private fun startActivityToOpenImages(requestCode: Int) {
         val intent = Intent(Intent.ACTION_OPEN_DOCUMENT)
             .putExtra("android.content.extra.SHOW_ADVANCED", true)
             .putExtra(Intent.EXTRA_ALLOW_MULTIPLE, true)
@@ -228,11 +233,26 @@ class MainFragment(activity: MainActivity) : AppFragment(activity) {
             .addFlags(Intent.FLAG_GRANT_READ_URI_PERMISSION)
             .addCategory(Intent.CATEGORY_OPENABLE)
             .setType("image/*")
-        startActivityForResult(intent, INTENT_OPEN_IMAGES)
+        startActivityForResult(intent, requestCode)
     }
 
     private fun imagesClear() {
+        imagesAppendClear()
         cache.clear()
+        imageUris.clear()
+        incrementalPanorama?.release()
+        incrementalPanorama = null
+        imagesAppended = false
+        incrementalPanoramaFailed = false
+    }
+
+    // Everything computed for the current set of images, except the incremental panorama
+    private fun imagesAppendClear() {
+        previewJob?.cancel()
+        previewJob = null
+        cache.keys.filter { it != CACHE_IMAGES && it != CACHE_IMAGES_SMALL && !it.endsWith(CACHE_MASK_SUFFIX) }.forEach { cache.remove(it) }
+        panoramaSessions.values.forEach { it.release() }
+        panoramaSessions.clear()
     }
 
     private fun createSmallImage(image: Mat, nearest: Boolean = false) : Mat {
@@ -259,112 +279,213 @@ class MainFragment(activity: MainActivity) : AppFragment(activity) {
         return imageSmall
     }
 
-    private fun loadImage(uri: Uri) : Mat? {
-        val inputStream = requireContext().contentResolver.openInputStream(uri) ?: return null
-        val bitmap = BitmapFactory.decodeStream(inputStream)
-        inputStream.close()
-        if (null == bitmap)  return null
+    // Opens the uris for the native decoder (-1 if a uri can't be opened); they are closed when read returns
+    private fun <T> readDescriptors(uriList: List<Uri>, read: (fds: IntArray) -> T): T {
+        val descriptors = uriList.map { uri ->
+            try {
+                requireContext().contentResolver.openFileDescriptor(uri, "r")
+            } catch (e: Exception) {
+                e.printStackTrace()
+                null
+            }
+        }
 
-        val image = Mat()
-        Utils.bitmapToMat(bitmap, image)
-        if (image.empty()) return null
+        try {
+            return read(descriptors.map { it?.fd ?: -1 }.toIntArray())
+        } finally {
+            descriptors.forEach { it?.close() }
+        }
+    }
 
-        val imageRGB = Mat()
-        Imgproc.cvtColor(
-            image,
-            imageRGB,
-            Imgproc.COLOR_RGBA2RGB)
+    // Full size images of the uris, null if any of them can't be decoded anymore
+    private fun loadFullImages(uriList: List<Uri>) : MutableList<Mat>? {
+        val images = uriList.map { Mat() }
+        readDescriptors(uriList) { fds -> readImages(fds, images) }
+        return if (images.any { it.empty() }) null else images.toMutableList()
+    }
 
-        return imageRGB
+    // Only needed while saving: the modes are browsed on the previews. The transforms are kept (same images).
+    private fun releaseFullImages() {
+        cache.remove(CACHE_IMAGES)
+        cache.remove(CACHE_IMAGES + CACHE_IMAGES_ALIGNED_SUFFIX)
+        cache.remove(CACHE_IMAGES + CACHE_IMAGES_AVERAGE_SUFFIX)
+        panoramaSessions.remove(CACHE_IMAGES)?.release()
     }
 
-    private fun mergePanorama(prefix: String): Pair<List<Mat>, String> {
+    // Kept for the next projection change: only the compositing runs again.
+    // The full size images reuse the preview registration (only composed at full resolution).
+    private fun panoramaSession(prefix: String, images: List<Mat>): PanoramaSession {
+        return panoramaSessions.getOrPut(prefix) {
+            val previewImages = cache[CACHE_IMAGES_SMALL]
+            if (CACHE_IMAGES == prefix && null != previewImages && previewImages.size == images.size) {
+                PanoramaSession(images.toList(), panoramaSession(CACHE_IMAGES_SMALL, previewImages))
+            } else {
+                PanoramaSession(images.toList())
+            }
+        }
+    }
+
+    private fun mergePanorama(prefix: String): MergeOutput {
         //parameters
         val mode = binding.panoramaProjection.selectedItemPosition
+        val filePrefix = "panorama_" + binding.panoramaProjection.selectedItem.toString()
 
-        val inputImages = cache[prefix] ?: return Pair(listOf(), "")
-        val output = Mat()
-        makePanorama(inputImages.toList(), output, mode)
+        val inputImages = cache[prefix] ?: return MergeOutput(filePrefix)
+        if (CACHE_IMAGES_SMALL == prefix && imagesAppended && !incrementalPanoramaFailed) {
+            val quality = settings.panoramaQuality
+            val panorama = incrementalPanorama?.takeIf { it.projection == mode && it.quality == quality }
+                ?: IncrementalPanorama(mode, quality).also {
+                    incrementalPanorama?.release()
+                    incrementalPanorama = it
+                }
+            val job = MergeJob.incrementalPanorama(panorama, inputImages.toList(), settings.panoramaBorders, jobPriority(prefix))
+            return MergeOutput(filePrefix, job = job) {
+                // the rejected frame would fail every next update: register the whole set again
+                incrementalPanorama?.release()
+                incrementalPanorama = null
+                incrementalPanoramaFailed = true
+                mergePhotosSmall()
+            }
+        }
 
-        val outputList = mutableListOf<Mat>()
-        val filePrefix = "panorama_" + binding.panoramaProjection.selectedItem.toString()
+        val session = panoramaSession(prefix, inputImages)
 
-        if (!output.empty()) {
-            outputList.add(output)
+        if (CACHE_IMAGES == prefix) {
+            // The full size panorama can be much larger than the memory: it's composed tile by tile and saved natively
+            val file = outputFile(filePrefix)
+            file.parentFile?.mkdirs()
+            val job = MergeJob.panoramaToFile(session, mode, settings.panoramaQuality, settings.panoramaBorders, file, requireContext().cacheDir, settings.jpegQuality, jobPriority(prefix))
+            return MergeOutput(filePrefix, job = job, file = file)
         }
 
-        return Pair(outputList.toList(), filePrefix)
+        return MergeOutput(filePrefix, job = MergeJob.panorama(session, mode, settings.panoramaQuality, settings.panoramaBorders, jobPriority(prefix)))
     }
 
-    private fun alignImages(prefix: String): Pair<List<Mat>, String> {
-        val inputImages = cache[prefix] ?: mutableListOf()
-
-        var alignedImages = cache[prefix + CACHE_IMAGES_ALIGNED_SUFFIX]
-        if (null == alignedImages) {
-            val masks = cache[prefix + CACHE_MASK_SUFFIX]
-            val mask = if (null != masks && masks.isNotEmpty()) masks[0] else Mat()
+    private fun alignMask(prefix: String): Mat {
+        val masks = cache[prefix + CACHE_MASK_SUFFIX]
+        return if (null != masks && masks.isNotEmpty()) masks[0] else Mat()
+    }
 
-            alignedImages = mutableListOf()
-            alignedImages.add(inputImages[0])
+    // Full size images can use the transforms estimated on the preview (scaled), so the save only has to warp
+    private fun alignFromPreview(prefix: String): Boolean {
+        val previewImages = cache[CACHE_IMAGES_SMALL]
+        return CACHE_IMAGES == prefix && Settings.ALIGN_FULL != settings.alignMode && null != previewImages && previewImages.isNotEmpty()
+    }
 
-            val firstFramePts = MatOfPoint()
-            val firstFrameGray = Mat()
+    // Transform for each image (first is identity, empty if failed to align), cached by startAlignment
+    private fun alignTransforms(prefix: String): List<Mat> {
+        return cache[prefix + CACHE_TRANSFORMS_SUFFIX] ?: listOf()
+    }
 
-            Imgproc.cvtColor(inputImages[0], firstFrameGray, Imgproc.COLOR_RGB2GRAY)
-            Imgproc.goodFeaturesToTrack(firstFrameGray, firstFramePts,200,0.01, 30.0, mask)
+    // The frames that could be aligned, cached by startAlignment
+    private fun alignImages(prefix: String): Pair<List<Mat>, String> {
+        val alignedImages = cache[prefix + CACHE_IMAGES_ALIGNED_SUFFIX] ?: listOf<Mat>()
 
-            val firstFramePts2f = MatOfPoint2f()
-            firstFramePts2f.fromList(firstFramePts.toList())
+        if (alignedImages.size < 2) {
+            showToast( "Failed to align images !")
+        }
 
-            for (imageIndex in 1 until inputImages.size) {
-                val frameGray = Mat()
-                Imgproc.cvtColor(inputImages[imageIndex], frameGray, Imgproc.COLOR_RGB2GRAY)
+        return Pair(alignedImages, "align")
+    }
 
-                val framePts2f = MatOfPoint2f()
-                val status = MatOfByte()
-                val err = MatOfFloat()
-                calcOpticalFlowPyrLK(firstFrameGray, frameGray, firstFramePts2f, framePts2f, status, err)
+    // Aligns the images of prefix on the job workers (Lanczos warp of every full size frame: seconds) then calls onAligned,
+    // unless the job is cancelled. Caches the transforms and, if warp, the aligned images (a failure caches no aligned frame).
+    // A full size alignment from the preview starts by aligning the preview if it is not aligned yet.
+    private fun startAlignment(prefix: String, warp: Boolean, priority: Int, onAligned: () -> Unit) {
+        val fromPreview = alignFromPreview(prefix)
+        if (fromPreview && null == cache[CACHE_IMAGES_SMALL + CACHE_TRANSFORMS_SUFFIX]) {
+            startAlignment(CACHE_IMAGES_SMALL, false, priority) { startAlignment(prefix, warp, priority, onAligned) }
+            return
+        }
 
-                // Filter only valid points
-                val firstFramePts2fList = firstFramePts2f.toList()
-                val framePts2fList = framePts2f.toList()
-                val statusList = status.toList()
+        val inputImages = cache[prefix] ?: mutableListOf()
+        val previewImages = cache[CACHE_IMAGES_SMALL] ?: mutableListOf()
+        val transformsKey = prefix + CACHE_TRANSFORMS_SUFFIX
+        val job = MergeJob.align(
+            inputImages,
+            alignMask(prefix),
+            if (fromPreview) previewImages[0] else Mat(),
+            alignMask(CACHE_IMAGES_SMALL),
+            if (fromPreview) alignTransforms(CACHE_IMAGES_SMALL) else listOf(),
+            Settings.ALIGN_FROM_PREVIEW_REFINED == settings.alignMode,
+            cache[transformsKey] ?: listOf(),
+            warp,
+            priority
+        )
 
-                val firstFramePts2fFilteredList = mutableListOf<Point>()
-                val framePts2fFilteredList = mutableListOf<Point>()
+        val preview = MergeJob.PRIORITY_PREVIEW == priority
+        if (preview) {
+            previewJob = job
+            binding.mergeProgress.progress = 0
+            binding.mergeProgress.isVisible = true
+        }
 
-                for( i in firstFramePts2fList.indices ) {
-                    if (0.toByte() != statusList[i]) {
-                        firstFramePts2fFilteredList.add(firstFramePts2fList[i])
-                        framePts2fFilteredList.add(framePts2fList[i])
+        // the transforms then the aligned images
+        val outputs = MutableList(inputImages.size * (if (warp) 2 else 1)) { Mat() }
+        job.observe(
+            { progress ->
+                val percent = (progress * 100).toInt()
+                if (preview) binding.mergeProgress.progress = percent
+                else BusyDialog.update("Aligning photos ... $percent%")
+            },
+            { state, _ ->
+                if (preview) {
+                    if (previewJob !== job) {
+                        if (null == previewJob) binding.mergeProgress.isVisible = false
+                        return@observe
                     }
+                    previewJob = null
+                    binding.mergeProgress.isVisible = false
                 }
 
-                // Find transformation matrix
-                val firstFramePtsMat = MatOfPoint2f()
-                val framePtsMat = MatOfPoint2f()
+                if (MergeJob.STATE_CANCELLED == state) return@observe
 
-                firstFramePtsMat.fromList(firstFramePts2fFilteredList)
-                framePtsMat.fromList(framePts2fFilteredList)
+                val done = MergeJob.STATE_DONE == state
+                if (done || null == cache[transformsKey]) {
+                    cache[transformsKey] = if (done) outputs.subList(0, inputImages.size).toMutableList() else MutableList(inputImages.size) { Mat() }
+                }
+                if (warp) {
+                    //skip the frames that failed to align
+                    cache[prefix + CACHE_IMAGES_ALIGNED_SUFFIX] =
+                        if (done) outputs.subList(inputImages.size, outputs.size).filter { !it.empty() }.toMutableList() else mutableListOf()
+                }
 
-                val t = Calib3d.estimateAffinePartial2D(framePtsMat, firstFramePtsMat)
-                if (t.empty()) continue //failed to align
+                onAligned()
+            },
+            false,
+            outputs
+        )
+    }
 
-                val alignedFrame = Mat()
-                Imgproc.warpAffine(inputImages[imageIndex], alignedFrame, t, inputImages[imageIndex].size(), INTER_LANCZOS4)
-                if (alignedFrame.empty()) continue //failed to warp !
+    // The full size long exposure decodes the files itself, unless the images are needed to align them
+    private fun longExposureFromFiles(merge: Int): Boolean {
+        return Settings.MERGE_LONG_EXPOSURE == merge
+                && (!binding.checkBoxAlign.isChecked || null != cache[CACHE_IMAGES + CACHE_TRANSFORMS_SUFFIX])
+    }
 
-                alignedImages.add(alignedFrame)
-            }
+    // Full size: the frames are spilled to raw files one at a time, then aligned and merged one band at a time,
+    // so neither the full size images nor the aligned ones stay in memory
+    private fun mergeLongExposureBanded(prefix: String, mode: Int): MergeJob? {
+        val alignTransforms = if (binding.checkBoxAlign.isChecked) alignTransforms(prefix) else null
+        //skip the frames that failed to align
+        val indices = imageUris.indices.filter { null == alignTransforms || !alignTransforms[it].empty() }
+        val transforms = if (null == alignTransforms) listOf() else indices.map { if (0 == it) Mat() else alignTransforms[it] }
 
-            cache[prefix + CACHE_IMAGES_ALIGNED_SUFFIX] = alignedImages
-        }
+        if (indices.size < (if (Settings.LONG_EXPOSURE_NEAREST_TO_AVERAGE == mode) 3 else 2)) return null
 
-        if (alignedImages.size < 2) {
-            showToast( "Failed to align images !")
+        val spillDirectory = requireContext().cacheDir
+        val inputImages = cache[prefix]
+        if (null == inputImages) {
+            return readDescriptors(indices.map { imageUris[it] }) { fds ->
+                MergeJob.longExposureBandedFromFiles(fds, transforms, mode, spillDirectory, jobPriority(prefix))
+            }
         }
 
-        return Pair(alignedImages, "align")
+        // decoded for the alignment: the job holds the only reference left, each image is freed once spilled
+        val job = MergeJob.longExposureBanded(indices.map { inputImages[it] }, transforms, mode, spillDirectory, jobPriority(prefix))
+        releaseFullImages()
+        inputImages.forEach { it.release() }
+        return job
     }
 
     private fun calculateAverage(prefix: String): List<Mat> {
@@ -378,14 +499,13 @@ class MainFragment(activity: MainActivity) : AppFragment(activity) {
             val output = Mat()
 
             if (inputImages.size >= 2) {
-                val floatMat = Mat()
-                inputImages[0].convertTo(floatMat, CvType.CV_16UC3)
-
-                for (imageIndex in 1 until inputImages.size) {
-                    Core.add(floatMat, inputImages[imageIndex], floatMat, Mat(), CvType.CV_16UC3)
+                // One frame at a time in a 32 bits sum: no 32 bits copy of the whole stack
+                val accumulator = LongExposureAccumulator()
+                try {
+                    if (inputImages.all { accumulator.add(it) }) accumulator.result(output)
+                } finally {
+                    accumulator.release()
                 }
-
-                floatMat.convertTo(output, inputImages[0].type(), 1.0 / inputImages.size.toDouble())
             }
 
             if (!output.empty()) averageImages.add(output)
@@ -395,111 +515,179 @@ class MainFragment(activity: MainActivity) : AppFragment(activity) {
         return averageImages
     }
 
-    private fun mergeLongExposure(prefix: String): Pair<List<Mat>, String> {
+    private fun mergeLongExposure(prefix: String): MergeOutput {
         val alignImages = binding.checkBoxAlign.isChecked
         val mode = binding.longexposureAlgorithm.selectedItemPosition
-        var resultImages: List<Mat> = listOf()
+        val name = "longexposure_" + binding.longexposureAlgorithm.selectedItem.toString()
+
+        if (CACHE_IMAGES == prefix) {
+            return MergeOutput(name, job = mergeLongExposureBanded(prefix, mode))
+        }
 
         when(mode) {
             Settings.LONG_EXPOSURE_AVERAGE -> {
-                val averageImages = calculateAverage(prefix)
-                resultImages = averageImages
+                return MergeOutput(name, calculateAverage(prefix))
             }
 
             Settings.LONG_EXPOSURE_NEAREST_TO_AVERAGE -> {
                 val averageImages = calculateAverage(prefix)
                 if (averageImages.isNotEmpty()) {
                     val inputImages = if (alignImages) cache[prefix + CACHE_IMAGES_ALIGNED_SUFFIX] else (cache[prefix] ?: listOf())
-                    if (null != inputImages && inputImages.isNotEmpty()) {
-                        val outputImage = Mat()
-
-                        if (makeLongExposureNearest(inputImages, averageImages[0], outputImage)) {
-                            if (!outputImage.empty()) {
-                                resultImages = listOf(outputImage)
-                            }
-                        }
+                    if (null != inputImages && inputImages.size >= 3) {
+                        return MergeOutput(name, job = MergeJob.longExposureNearest(inputImages.toList(), averageImages[0], jobPriority(prefix)))
                     }
                 }
             }
 
             Settings.LONG_EXPOSURE_LIGHT, Settings.LONG_EXPOSURE_DARK -> {
                 val inputImages = if (alignImages) alignImages(prefix).first else (cache[prefix] ?: listOf())
-                if (inputImages.isNotEmpty()) {
-                    val outputImage = Mat()
-                    if (makeLongExposureLightOrDark(inputImages, outputImage, Settings.LONG_EXPOSURE_LIGHT == mode)) {
-                        if (!outputImage.empty()) {
-                            resultImages = listOf(outputImage)
-                        }
-                    }
+                if (inputImages.size >= 2) {
+                    return MergeOutput(name, job = MergeJob.longExposureLightOrDark(inputImages.toList(), Settings.LONG_EXPOSURE_LIGHT == mode, jobPriority(prefix)))
                 }
             }
         }
 
-        return Pair(
-            resultImages,
-            "longexposure_" + binding.longexposureAlgorithm.selectedItem.toString()
-        )
+        return MergeOutput(name)
     }
 
-    private fun mergeHdr(prefix: String): Pair<List<Mat>, String> {
+    private fun mergeHdr(prefix: String): MergeOutput {
         val alignImages = binding.checkBoxAlign.isChecked
         val inputImages = if (alignImages) alignImages(prefix).first else ( cache[prefix] ?: listOf() )
-        val output = Mat()
-
-        if (inputImages.size >= 2) {
-            val hdrMat = Mat()
-            val mergeMertens = Photo.createMergeMertens()
-            mergeMertens.process(inputImages, hdrMat)
 
-            if (!hdrMat.empty()) {
-                hdrMat.convertTo(output, inputImages[0].type(), 255.0)
-            }
-        }
-
-        val outputList = if (output.empty()) listOf() else listOf(output)
-        return Pair(outputList, "hdr")
+        if (inputImages.size < 2) return MergeOutput("hdr")
+        return MergeOutput("hdr", job = MergeJob.hdr(inputImages.toList(), jobPriority(prefix)))
     }
 
-    private fun mergeFocusStack(prefix: String): Pair<List<Mat>, String> {
+    private fun mergeFocusStack(prefix: String): MergeOutput {
         val alignImages = binding.checkBoxAlign.isChecked
         val inputImages = if (alignImages) alignImages(prefix).first else ( cache[prefix] ?: listOf() )
-        val output = Mat()
-        var success = false
-
-        if (inputImages.size >= 2) {
-            success = makeFocusStack(inputImages, output)
-        }
+        val name = "focusstack_" + binding.focusstackAlgorithm.selectedItem.toString()
 
-        val outputList = if (!success || output.empty()) listOf() else listOf(output)
-        return Pair(outputList, "focusstack_")
+        if (inputImages.size < 2) return MergeOutput(name)
+        return MergeOutput(name, job = MergeJob.focusStack(inputImages.toList(), binding.focusstackAlgorithm.selectedItemPosition, jobPriority(prefix)))
     }
 
-    private fun mergePhotos(prefix: String, l: (output: List<Mat>, name: String) -> Unit) {
-        val inputImages = cache[prefix]
-        if (null == inputImages || inputImages.size < 2) return
+    private fun mergePhotos(prefix: String, l: (output: List<Mat>, name: String, file: File?) -> Unit) {
+        val imagesCount = if (CACHE_IMAGES == prefix) imageUris.size else (cache[prefix]?.size ?: 0)
+        if (imagesCount < 2) return
 
-        BusyDialog.show(requireFragmentManager(), "Merging photos ...")
-        activity.window.addFlags(WindowManager.LayoutParams.FLAG_KEEP_SCREEN_ON)
         val merge = binding.spinnerMerge.selectedItemPosition
 
-        runFakeAsync {
-            val result: Pair<List<Mat>, String> = when(merge) {
-                Settings.MERGE_PANORAMA -> mergePanorama(prefix)
-                Settings.MERGE_LONG_EXPOSURE -> mergeLongExposure(prefix)
-                Settings.MERGE_HDR -> mergeHdr(prefix)
-                Settings.MERGE_ALIGN -> alignImages(prefix)
-                Settings.MERGE_FOCUS_STACK -> mergeFocusStack(prefix)
-                else -> Pair(listOf(), "")
-            }
+        if (CACHE_IMAGES_SMALL == prefix) {
+            // Only the latest parameters matter: the running preview is dropped right away.
+            // No busy dialog, so the spinners can still be changed while the preview is computed.
+            previewJob?.cancel()
+            previewJob = null
+            startMerge(prefix, merge, l)
+            return
+        }
 
+        BusyDialog.show(requireFragmentManager(), "Merging photos ...")
+        activity.window.addFlags(WindowManager.LayoutParams.FLAG_KEEP_SCREEN_ON)
+
+        val onMerged: (output: List<Mat>, name: String, file: File?) -> Unit = { outputImages, name, file ->
             activity.window.clearFlags(WindowManager.LayoutParams.FLAG_KEEP_SCREEN_ON)
-            l.invoke(result.first, result.second)
+            l.invoke(outputImages, name, file)
             BusyDialog.dismiss()
         }
+
+        if (null != cache[CACHE_IMAGES] || longExposureFromFiles(merge)) {
+            runFakeAsync { startMerge(prefix, merge, onMerged) }
+            return
+        }
+
+        // Decoded on the job workers (all the files in parallel) the first time a full size merge needs them
+        val uris = imageUris.toList()
+        val images = uris.map { Mat() }
+        val job = readDescriptors(uris) { fds -> MergeJob.readImages(fds, MergeJob.PRIORITY_FULL) }
+        job.observe(
+            { progress -> BusyDialog.update("Loading images ... ${(progress * 100).toInt()}%") },
+            { state, _ ->
+                // the images can't change under the busy dialog, but the uris are the key of the decoded images
+                if (MergeJob.STATE_DONE != state || uris != imageUris) {
+                    activity.window.clearFlags(WindowManager.LayoutParams.FLAG_KEEP_SCREEN_ON)
+                    BusyDialog.dismiss()
+                    if (MergeJob.STATE_FAILED == state) showToast("Failed to load images")
+                    return@observe
+                }
+
+                cache[CACHE_IMAGES] = images.toMutableList()
+                startMerge(prefix, merge, onMerged)
+            },
+            false,
+            images
+        )
+    }
+
+    private fun startMerge(prefix: String, merge: Int, l: (output: List<Mat>, name: String, file: File?) -> Unit) {
+        // The frames are aligned by a job of their own first: the merge only reads the cache
+        if (Settings.MERGE_ALIGN == merge || (Settings.MERGE_PANORAMA != merge && binding.checkBoxAlign.isChecked)) {
+            // the full size long exposure only needs the transforms: it warps the frames band by band
+            val warp = !(CACHE_IMAGES == prefix && Settings.MERGE_LONG_EXPOSURE == merge)
+            if (null == cache[prefix + if (warp) CACHE_IMAGES_ALIGNED_SUFFIX else CACHE_TRANSFORMS_SUFFIX]) {
+                startAlignment(prefix, warp, jobPriority(prefix)) { startMerge(prefix, merge, l) }
+                return
+            }
+        }
+
+        val output: MergeOutput = when(merge) {
+            Settings.MERGE_PANORAMA -> mergePanorama(prefix)
+            Settings.MERGE_LONG_EXPOSURE -> mergeLongExposure(prefix)
+            Settings.MERGE_HDR -> mergeHdr(prefix)
+            Settings.MERGE_ALIGN -> alignImages(prefix).let { MergeOutput(it.second, it.first) }
+            Settings.MERGE_FOCUS_STACK -> mergeFocusStack(prefix)
+            else -> MergeOutput("")
+        }
+
+        val job = output.job
+        if (null == job) {
+            l.invoke(output.images, output.name, null)
+            return
+        }
+
+        val preview = CACHE_IMAGES_SMALL == prefix
+        if (preview) {
+            previewJob = job
+            binding.mergeProgress.progress = 0
+            binding.mergeProgress.isVisible = true
+        }
+
+        val file = output.file
+        job.observe(
+            { progress ->
+                val percent = (progress * 100).toInt()
+                if (preview) binding.mergeProgress.progress = percent
+                else BusyDialog.update("Merging photos ... $percent%")
+            },
+            { state, outputImage ->
+                if (preview) {
+                    if (previewJob !== job) {
+                        // replaced by a newer preview (still running: keep its progress) or dropped with the images
+                        if (null == previewJob) binding.mergeProgress.isVisible = false
+                        return@observe
+                    }
+                    previewJob = null
+                    binding.mergeProgress.isVisible = false
+                }
+
+                if (null != file && MergeJob.STATE_DONE != state) file.delete()
+
+                if (MergeJob.STATE_FAILED == state && null != output.onFailed) {
+                    output.onFailed.invoke()
+                    return@observe
+                }
+
+                if (MergeJob.STATE_CANCELLED != state) {
+                    val savedFile = if (null != file && MergeJob.STATE_DONE == state) file else null
+                    l.invoke(if (outputImage.empty()) listOf() else listOf(outputImage), output.name, savedFile)
+                }
+            },
+            null == file
+        )
     }
 
     private fun mergePhotosSmall() {
-        mergePhotos(CACHE_IMAGES_SMALL) { outputImages, _ ->
+        mergePhotos(CACHE_IMAGES_SMALL) { outputImages, _, _ ->
             if (outputImages.isEmpty()) {
                 setBitmap(null)
             } else {
@@ -517,26 +705,20 @@ class MainFragment(activity: MainActivity) : AppFragment(activity) {
     }
 
     private fun mergePhotosBig() {
-        mergePhotos(CACHE_IMAGES) { outputImages, name ->
+        mergePhotos(CACHE_IMAGES) { outputImages, name, savedFile ->
             settings.mergeMode = binding.spinnerMerge.selectedItemPosition
             settings.panoramaProjection = binding.panoramaProjection.selectedItemPosition
             settings.longexposureAlgorithm = binding.longexposureAlgorithm.selectedItemPosition
+            settings.focusStackAlgorithm = binding.focusstackAlgorithm.selectedItemPosition
             settings.saveProperties()
 
-            val outputExtension = Settings.EXT_JPEG
-
             BusyDialog.show(requireFragmentManager(), "Saving")
 
+            //already encoded by the merge
+            savedFile?.let { onImageSaved(it) }
+
             for (outputImage in outputImages) {
-                var fileName = "${outputName}_${name}.${outputExtension}"
-                var file = File(Settings.SAVE_FOLDER, fileName)
-                var counter = 0
-                while (file.exists() && counter < 998) {
-                    counter++
-                    val counterStr = "%03d".format(counter)
-                    fileName = "${outputName}_${name}_${counterStr}.${outputExtension}"
-                    file = File(Settings.SAVE_FOLDER, fileName)
-                }
+                val file = outputFile(name)
 
                 try {
                     file.parentFile?.mkdirs()
@@ -546,29 +728,54 @@ class MainFragment(activity: MainActivity) : AppFragment(activity) {
                     val outputStream = file.outputStream()
                     bitmap.compress(Bitmap.CompressFormat.JPEG, settings.jpegQuality, outputStream)
                     outputStream.close()
-
-                    //copy exif tags
-                    firstSourceUri?.let { uri ->
-                        ExifTools.copyExif(activity.contentResolver, uri, file)
-                    }
-
-                    //Add it to gallery
-                    MediaScannerConnection.scanFile(context, arrayOf(file.absolutePath), null, null)
-
                 } catch (e: Exception) {
                     e.printStackTrace()
                 }
 
-                if (file.exists()) {
-                    showToast("Saved to: $fileName")
-                } else {
-                    showToast("Save failed")
-                }
+                onImageSaved(file)
             }
+
+            releaseFullImages()
             BusyDialog.dismiss()
         }
     }
 
+    // First free file name for this output
+    private fun outputFile(name: String): File {
+        val outputExtension = Settings.EXT_JPEG
+        var fileName = "${outputName}_${name}.${outputExtension}"
+        var file = File(Settings.SAVE_FOLDER, fileName)
+        var counter = 0
+        while (file.exists() && counter < 998) {
+            counter++
+            val counterStr = "%03d".format(counter)
+            fileName = "${outputName}_${name}_${counterStr}.${outputExtension}"
+            file = File(Settings.SAVE_FOLDER, fileName)
+        }
+        return file
+    }
+
+    private fun onImageSaved(file: File) {
+        if (!file.exists()) {
+            showToast("Save failed")
+            return
+        }
+
+        try {
+            //copy exif tags
+            firstSourceUri?.let { uri ->
+                ExifTools.copyExif(activity.contentResolver, uri, file)
+            }
+
+            //Add it to gallery
+            MediaScannerConnection.scanFile(context, arrayOf(file.absolutePath), null, null)
+        } catch (e: Exception) {
+            e.printStackTrace()
+        }
+
+        showToast("Saved to: ${file.name}")
+    }
+
     private fun setBitmap(bitmap: Bitmap?) {
         if (null != bitmap) {
             binding.imageView.setBitmap(bitmap)
@@ -581,22 +788,30 @@ class MainFragment(activity: MainActivity) : AppFragment(activity) {
     private fun cleanUpAlignedImages() {
         cache.remove(CACHE_IMAGES + CACHE_IMAGES_ALIGNED_SUFFIX)
         cache.remove(CACHE_IMAGES_SMALL + CACHE_IMAGES_ALIGNED_SUFFIX)
+        cache.remove(CACHE_IMAGES + CACHE_TRANSFORMS_SUFFIX)
+        cache.remove(CACHE_IMAGES_SMALL + CACHE_TRANSFORMS_SUFFIX)
         cache.remove(CACHE_IMAGES + CACHE_IMAGES_AVERAGE_SUFFIX)
         cache.remove(CACHE_IMAGES_SMALL + CACHE_IMAGES_AVERAGE_SUFFIX)
     }
 
     private fun editMask() {
-        val images = cache[CACHE_IMAGES]
-        if (null == images || images.isEmpty()) return
+        if (imageUris.isEmpty()) return
         if (!binding.checkBoxAlign.isChecked) return
 
+        // the mask is drawn on the full size reference image: only this one is decoded
+        val image = cache[CACHE_IMAGES]?.firstOrNull() ?: loadFullImages(listOf(imageUris[0]))?.firstOrNull()
+        if (null == image) {
+            showToast("Failed to load images")
+            return
+        }
+
         var mask = Mat()
         val masks = cache[CACHE_IMAGES + CACHE_MASK_SUFFIX]
         if (null != masks && masks.isNotEmpty()) {
             mask = masks[0]
         }
 
-        MaskEditFragment.show(activity, images[0], mask) {
+        MaskEditFragment.show(activity, image, mask) {
             cleanUpAlignedImages()
             val maskSmall = createSmallImage(mask, true)
             cache[CACHE_IMAGES + CACHE_MASK_SUFFIX] = mutableListOf(mask)
@@ -615,10 +830,12 @@ class MainFragment(activity: MainActivity) : AppFragment(activity) {
         binding.spinnerMerge.onItemSelectedListener = listenerOnItemSelectedListener
         binding.panoramaProjection.onItemSelectedListener = listenerOnItemSelectedListener
         binding.longexposureAlgorithm.onItemSelectedListener = listenerOnItemSelectedListener
+        binding.focusstackAlgorithm.onItemSelectedListener = listenerOnItemSelectedListener
 
         binding.spinnerMerge.setSelection( if (settings.mergeMode >= binding.spinnerMerge.adapter.count) 0 else settings.mergeMode )
         binding.panoramaProjection.setSelection( if (settings.panoramaProjection >= binding.panoramaProjection.adapter.count) 0 else settings.panoramaProjection )
         binding.longexposureAlgorithm.setSelection( if (settings.longexposureAlgorithm >= binding.longexposureAlgorithm.adapter.count) 0 else settings.longexposureAlgorithm )
+        binding.focusstackAlgorithm.setSelection( if (settings.focusStackAlgorithm >= binding.focusstackAlgorithm.adapter.count) 0 else settings.focusStackAlgorithm )
 
         binding.checkBoxAlign.setOnCheckedChangeListener { _, isChecked ->
             binding.btnEditMask.isEnabled = isChecked
@@ -0,0 +1,180 @@
+package com.dan.mergephotos
+
+import android.os.Handler
+import android.os.Looper
+import org.opencv.core.Mat
+import org.opencv.utils.Converters
+import java.io.File
+
+/**
+Native merge running on the native job scheduler.
+It can be cancelled at any time and reports its progress.
+Full resolution jobs run first, in order. Only the latest preview job runs: a new one cancels the previous one.
+ */
+class MergeJob private constructor(private var nativeObj: Long) {
+    companion object {
+        // Same values as MergeJob::State (native)
+        const val STATE_RUNNING = 0
+        const val STATE_DONE = 1
+        const val STATE_FAILED = 2
+        const val STATE_CANCELLED = 3
+
+        // Same values as MergeJob::Priority (native)
+        const val PRIORITY_PREVIEW = 0
+        const val PRIORITY_FULL = 1
+
+        // About one frame, so a finished preview is shown without waiting
+        private const val POLL_INTERVAL_MS = 16L
+
+        // quality: Settings.PANORAMA_QUALITY_*, borders: Settings.PANORAMA_BORDERS_*
+        fun panorama(session: PanoramaSession, projection: Int, quality: Int, borders: Int, priority: Int): MergeJob {
+            return MergeJob(startPanoramaNative(session.nativeObj, projection, quality, borders, priority))
+        }
+
+        // The panorama is composed tile by tile in a file-backed buffer (in spillDirectory) and saved
+        // as JPEG directly in file: the result is not returned.
+        fun panoramaToFile(session: PanoramaSession, projection: Int, quality: Int, borders: Int, file: File, spillDirectory: File, jpegQuality: Int, priority: Int): MergeJob {
+            return MergeJob(startPanoramaToFileNative(session.nativeObj, projection, quality, borders, file.absolutePath, spillDirectory.absolutePath, jpegQuality, priority))
+        }
+
+        // Registers and composes only the images not added to the panorama yet
+        fun incrementalPanorama(panorama: IncrementalPanorama, images: List<Mat>, borders: Int, priority: Int): MergeJob {
+            val imagesMat = Converters.vector_Mat_to_Mat(images)
+            return MergeJob(startIncrementalPanoramaNative(panorama.nativeObj, imagesMat.nativeObj, borders, priority))
+        }
+
+        fun longExposureNearest(images: List<Mat>, averageImage: Mat, priority: Int): MergeJob {
+            val imagesMat = Converters.vector_Mat_to_Mat(images)
+            return MergeJob(startLongExposureNearestNative(imagesMat.nativeObj, averageImage.nativeObj, priority))
+        }
+
+        fun longExposureLightOrDark(images: List<Mat>, light: Boolean, priority: Int): MergeJob {
+            val imagesMat = Converters.vector_Mat_to_Mat(images)
+            return MergeJob(startLongExposureLightOrDarkNative(imagesMat.nativeObj, light, priority))
+        }
+
+        // The frames are spilled to raw files (in spillDirectory) one at a time and merged one band at a time.
+        // The job takes its own reference to the images: release them once it is started, so each image
+        // is freed as soon as it is spilled.
+        fun longExposureBanded(images: List<Mat>, transforms: List<Mat>, mode: Int, spillDirectory: File, priority: Int): MergeJob {
+            val imagesMat = Converters.vector_Mat_to_Mat(images)
+            val transformsMat = Converters.vector_Mat_to_Mat(transforms)
+            return MergeJob(startLongExposureBandedNative(imagesMat.nativeObj, transformsMat.nativeObj, mode, spillDirectory.absolutePath, priority))
+        }
+
+        // Same, decoding the files one at a time (the descriptors are duplicated, see readImages)
+        fun longExposureBandedFromFiles(fds: IntArray, transforms: List<Mat>, mode: Int, spillDirectory: File, priority: Int): MergeJob {
+            val transformsMat = Converters.vector_Mat_to_Mat(transforms)
+            return MergeJob(startLongExposureBandedFromFilesNative(fds, transformsMat.nativeObj, mode, spillDirectory.absolutePath, priority))
+        }
+
+        fun hdr(images: List<Mat>, priority: Int): MergeJob {
+            val imagesMat = Converters.vector_Mat_to_Mat(images)
+            return MergeJob(startHdrNative(imagesMat.nativeObj, priority))
+        }
+
+        fun focusStack(images: List<Mat>, algorithm: Int, priority: Int): MergeJob {
+            val imagesMat = Converters.vector_Mat_to_Mat(images)
+            return MergeJob(startFocusStackNative(imagesMat.nativeObj, algorithm, priority))
+        }
+
+        // The alignment before a merge, see observe(outputs): one transform per image (empty if the frame failed to align)
+        // then, if warp, one aligned image per image (empty too if it failed).
+        // transforms: used as they are if not empty, else previewTransforms (estimated on previewReference) are scaled
+        // and refined if refine is set, else the transforms are estimated (mask: where to search the features).
+        fun align(images: List<Mat>, mask: Mat, previewReference: Mat, previewMask: Mat, previewTransforms: List<Mat>, refine: Boolean,
+                  transforms: List<Mat>, warp: Boolean, priority: Int): MergeJob {
+            val imagesMat = Converters.vector_Mat_to_Mat(images)
+            val previewTransformsMat = Converters.vector_Mat_to_Mat(previewTransforms)
+            val transformsMat = Converters.vector_Mat_to_Mat(transforms)
+            return MergeJob(startAlignNative(imagesMat.nativeObj, mask.nativeObj, previewReference.nativeObj, previewMask.nativeObj,
+                    previewTransformsMat.nativeObj, refine, transformsMat.nativeObj, warp, priority))
+        }
+
+        // Decodes the files (in parallel, straight to RGB), one output per descriptor: see observe(outputs).
+        // The descriptors are duplicated: they can be closed as soon as the job is started.
+        fun readImages(fds: IntArray, priority: Int): MergeJob {
+            return MergeJob(startReadImagesNative(fds, priority))
+        }
+
+        // Same, only the previews (largest side maxSize, reduced decode for JPEG files).
+        // An output is empty if its file can't be decoded: the job only fails if it can't run.
+        fun readImagePreviews(fds: IntArray, maxSize: Int, priority: Int): MergeJob {
+            return MergeJob(startReadImagePreviewsNative(fds, maxSize, priority))
+        }
+
+        private external fun startPanoramaNative(session: Long, projection: Int, quality: Int, borders: Int, priority: Int): Long
+        private external fun startPanoramaToFileNative(session: Long, projection: Int, quality: Int, borders: Int, path: String, spillDirectory: String, jpegQuality: Int, priority: Int): Long
+        private external fun startIncrementalPanoramaNative(panorama: Long, images: Long, borders: Int, priority: Int): Long
+        private external fun startLongExposureNearestNative(images: Long, averageImage: Long, priority: Int): Long
+        private external fun startLongExposureLightOrDarkNative(images: Long, light: Boolean, priority: Int): Long
+        private external fun startLongExposureBandedNative(images: Long, transforms: Long, mode: Int, spillDirectory: String, priority: Int): Long
+        private external fun startLongExposureBandedFromFilesNative(fds: IntArray, transforms: Long, mode: Int, spillDirectory: String, priority: Int): Long
+        private external fun startHdrNative(images: Long, priority: Int): Long
+        private external fun startFocusStackNative(images: Long, algorithm: Int, priority: Int): Long
+        private external fun startAlignNative(images: Long, mask: Long, previewReference: Long, previewMask: Long, previewTransforms: Long, refine: Boolean, transforms: Long, warp: Boolean, priority: Int): Long
+        private external fun startReadImagesNative(fds: IntArray, priority: Int): Long
+        private external fun startReadImagePreviewsNative(fds: IntArray, maxSize: Int, priority: Int): Long
+        private external fun releaseNative(nativeObj: Long)
+        private external fun cancelNative(nativeObj: Long)
+        private external fun stateNative(nativeObj: Long): Int
+        private external fun progressNative(nativeObj: Long): Float
+        private external fun resultNative(nativeObj: Long, output: Long): Boolean
+        private external fun resultsNative(nativeObj: Long, outputs: Long): Boolean
+    }
+
+    private val handler = Handler(Looper.getMainLooper())
+
+    val state: Int
+        get() = if (0L == nativeObj) STATE_CANCELLED else stateNative(nativeObj)
+
+    // 0 .. 1
+    val progress: Float
+        get() = if (0L == nativeObj) 0f else progressNative(nativeObj)
+
+    fun cancel() {
+        if (0L != nativeObj) cancelNative(nativeObj)
+    }
+
+    fun result(output: Mat): Boolean = 0L != nativeObj && resultNative(nativeObj, output.nativeObj)
+
+    // outputs: one Mat per output of the job
+    fun results(outputs: List<Mat>): Boolean {
+        if (0L == nativeObj) return false
+        val outputsMat = Converters.vector_Mat_to_Mat(outputs)
+        return resultsNative(nativeObj, outputsMat.nativeObj)
+    }
+
+    fun release() {
+        handler.removeCallbacksAndMessages(null)
+        if (0L != nativeObj) {
+            releaseNative(nativeObj)
+            nativeObj = 0L
+        }
+    }
+
+    /**
+    Polls the job on the UI thread: onProgress while it runs, then onFinished once with the output
+    (empty if the job failed or was cancelled, or if fetchResult is false). The job is already released when onFinished is called.
+    outputs: for a job with several outputs (readImages), filled before onFinished if the job is done.
+     */
+    fun observe(onProgress: (progress: Float) -> Unit, onFinished: (state: Int, output: Mat) -> Unit, fetchResult: Boolean = true,
+                outputs: List<Mat>? = null) {
+        handler.postDelayed(object : Runnable {
+            override fun run() {
+                val state = this@MergeJob.state
+                if (STATE_RUNNING == state) {
+                    onProgress(progress)
+                    handler.postDelayed(this, POLL_INTERVAL_MS)
+                    return
+                }
+
+                val output = Mat()
+                if (STATE_DONE == state && fetchResult) result(output)
+                if (STATE_DONE == state && null != outputs) results(outputs)
+                release()
+                onFinished(state, output)
+            }
+        }, POLL_INTERVAL_MS)
+    }
+}
@@ -0,0 +1,26 @@
+package com.dan.mergephotos
+
+import org.opencv.core.Mat
+import org.opencv.utils.Converters
+
+/**
+Native panorama of a fixed set of images.
+The registration runs once (on the first merge), changing the projection only re-runs the compositing.
+With a source session (the previews) the images are not registered again: the cameras of the source are rescaled.
+ */
+class PanoramaSession(images: List<Mat>, source: PanoramaSession? = null) {
+    companion object {
+        private external fun createNative(images: Long, source: Long): Long
+        private external fun releaseNative(nativeObj: Long)
+    }
+
+    var nativeObj = createNative(Converters.vector_Mat_to_Mat(images).nativeObj, source?.nativeObj ?: 0L)
+        private set
+
+    fun release() {
+        if (0L != nativeObj) {
+            releaseNative(nativeObj)
+            nativeObj = 0L
+        }
+    }
+}
@@ -32,12 +32,33 @@ class Settings( private val activity: Activity) {
         const val LONG_EXPOSURE_NEAREST_TO_AVERAGE = 1
         const val LONG_EXPOSURE_LIGHT = 2
         const val LONG_EXPOSURE_DARK = 3
+
+        const val FOCUS_STACK_PYRAMID = 0
+        const val FOCUS_STACK_SHARPEST = 1
+
+        // Same values as PanoramaQuality (native)
+        const val PANORAMA_QUALITY_FAST = 0
+        const val PANORAMA_QUALITY_BALANCED = 1
+        const val PANORAMA_QUALITY_BEST = 2
+
+        // Same values as PanoramaBorders (native)
+        const val PANORAMA_BORDERS_BLACK = 0
+        const val PANORAMA_BORDERS_FILL = 1
+        const val PANORAMA_BORDERS_CROP = 2
+
+        const val ALIGN_FULL = 0
+        const val ALIGN_FROM_PREVIEW = 1
+        const val ALIGN_FROM_PREVIEW_REFINED = 2
     }
 
     var mergeMode: Int = MERGE_PANORAMA
     var panoramaProjection: Int = 0
     var longexposureAlgorithm: Int = LONG_EXPOSURE_AVERAGE
+    var focusStackAlgorithm: Int = FOCUS_STACK_PYRAMID
     var jpegQuality = 95
+    var alignMode: Int = ALIGN_FROM_PREVIEW_REFINED
+    var panoramaQuality: Int = PANORAMA_QUALITY_BALANCED
+    var panoramaBorders: Int = PANORAMA_BORDERS_BLACK
 
     init {
         loadProperties()
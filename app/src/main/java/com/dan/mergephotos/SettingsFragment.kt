@@ -22,6 +22,9 @@ class SettingsFragment(activity: MainActivity ) : AppFragment(activity) {
         if (!homeButton) return
 
         settings.jpegQuality = JPEG_QUALITY_BASE + (100 - JPEG_QUALITY_BASE) * binding.seekBarJpegQuality.progress / binding.seekBarJpegQuality.max
+        settings.alignMode = binding.spinnerAlignMode.selectedItemPosition
+        settings.panoramaQuality = binding.spinnerPanoramaQuality.selectedItemPosition
+        settings.panoramaBorders = binding.spinnerPanoramaBorders.selectedItemPosition
 
         activity.settings.saveProperties()
     }
@@ -37,6 +40,9 @@ class SettingsFragment(activity: MainActivity ) : AppFragment(activity) {
 
         binding.seekBarJpegQuality.progress = jpegQualityProgress
         binding.txtJpegQuality.text = settings.jpegQuality.toString()
+        binding.spinnerAlignMode.setSelection( if (settings.alignMode >= binding.spinnerAlignMode.adapter.count) 0 else settings.alignMode )
+        binding.spinnerPanoramaQuality.setSelection( if (settings.panoramaQuality >= binding.spinnerPanoramaQuality.adapter.count) Settings.PANORAMA_QUALITY_BALANCED else settings.panoramaQuality )
+        binding.spinnerPanoramaBorders.setSelection( if (settings.panoramaBorders >= binding.spinnerPanoramaBorders.adapter.count) Settings.PANORAMA_BORDERS_BLACK else settings.panoramaBorders )
 
         binding.seekBarJpegQuality.setOnSeekBarChangeListener(object: SeekBar.OnSeekBarChangeListener {
             override fun onProgressChanged(p0: SeekBar?, progress: Int, p2: Boolean) {